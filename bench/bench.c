@@ -0,0 +1,469 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// bench.c: end-to-end benchmark of the process callback
+//
+// runs the engine's client against mockjack.c instead of a JACK server, feeding it a scripted MIDI
+// stream (a rolling set of held notes, and a controller sweep) and timing every cycle of the whole
+// process callback: MIDI decoding, event handling, rendering and output checks. the output is
+// checked for NaNs and silence, and hashed, so that changes to what's rendered show up too
+//
+
+#include <bench.h>
+#include <jbase.h>
+#include <math.h>
+#include <mockjack.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HIST_SUB 8    // buckets per power of two in cycle time histogram
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+#define SCRIPT_LO 36  // range of notes played
+#define SCRIPT_HI 96
+#define SCRIPT_CC 1   // controller swept
+
+// a two operator FM voice, with the mod wheel routed to the modulator's fold
+static jb_def_t default_defs[] = {
+    {JB_DEF_ENV, "pad: 0.01s1.0 -> 0.1s0.7 -> SUST -> 0.2s0.0"},
+    {JB_DEF_OSC, "car: wave=sin vol=1.0"},
+    {JB_DEF_OSC, "mod: wave=sin vol=0.5 base=12"},
+    {JB_DEF_INST, "pad pad: car % mod"},
+    {JB_DEF_CHAN, "0: pad"},
+    {JB_DEF_ROUTE, "0: 1 mod.bias 0.0 0.8"},
+};
+
+typedef struct {
+    jb_def_t *defs;         // patch to run (default patch if empty)
+    size_t cycles;          // cycles to run
+    jack_nframes_t frames;  // period size
+    jack_nframes_t srate;   // sample rate
+    size_t poly;            // notes held at once
+    size_t length;          // cycles each note is held for
+    size_t ccs;             // controller events per cycle
+    bool accurate;          // apply events on the frame they arrive on
+    bool freewheel;         // run as JACK does while freewheeling (bouncing)
+    size_t voices;          // voices the engine can sound at once
+    char *trace_path;       // path to write zone trace to (NULL for none)
+    char *meter_name;       // shared memory object to publish meters to (NULL for none)
+    uint32_t tap;           // frames averaged into each waveform tap sample (0 for no tap)
+    size_t shards;          // workers to play the patch in, behind a front end (0 for none)
+} bench_opts_t;
+
+// scripted MIDI stream; notes are started in turn, each replacing the oldest held note
+typedef struct {
+    uint8_t *held;          // notes held, oldest at `next`
+    size_t next;
+    size_t stride;          // cycles between new notes
+    uint32_t rng;
+    uint8_t cc;             // controller value
+    int8_t cc_dir;
+} script_t;
+
+static uint8_t script_note(script_t *sc) {
+    sc->rng = sc->rng * 1664525 + 1013904223;
+    return SCRIPT_LO + (sc->rng >> 16) % (SCRIPT_HI - SCRIPT_LO);
+}
+
+// replace the oldest held note with a new one
+static void script_notes(script_t *sc, size_t poly, jack_nframes_t frame, jack_port_t *port) {
+    uint8_t *note = &sc->held[sc->next];
+
+    if (*note) mock_midi_push(port, frame, (uint8_t[]){JB_NOTE_OFF, *note, 0}, 3);
+    *note = script_note(sc);
+    mock_midi_push(port, frame, (uint8_t[]){JB_NOTE_ON, *note, 100}, 3);
+
+    sc->next = (sc->next + 1) % poly;
+}
+
+static void script_cycle(script_t *sc, const bench_opts_t *opts, size_t cycle, jack_port_t *port) {
+    // notes land at varying points through the cycle, so that accurate mode splits it up
+    jack_nframes_t at = (cycle * 37) % opts->frames;
+    bool notes = cycle % sc->stride == 0;
+
+    // controller events are spread evenly across the cycle, with notes slotted in between them,
+    // since events have to be written in order
+    for (size_t i = 0; i < opts->ccs; i++) {
+        jack_nframes_t frame = i * opts->frames / opts->ccs;
+
+        if (notes && at <= frame) {
+            script_notes(sc, opts->poly, at, port);
+            notes = false;
+        }
+
+        if (sc->cc == 0) sc->cc_dir = 1;
+        if (sc->cc == 127) sc->cc_dir = -1;
+        sc->cc += sc->cc_dir;
+
+        mock_midi_push(port, frame, (uint8_t[]){JB_CTRL, SCRIPT_CC, sc->cc}, 3);
+    }
+
+    if (notes) script_notes(sc, opts->poly, at, port);
+}
+
+// log-linear histogram bucket of a time in ns
+static size_t hist_bucket(uint64_t ns) {
+    if (ns < HIST_SUB) return ns;
+
+    int octave = 63 - __builtin_clzll(ns);
+    return (octave - 2) * HIST_SUB + ((ns >> (octave - 3)) & (HIST_SUB - 1));
+}
+
+// lowest time in ns that falls in a bucket
+static uint64_t hist_value(size_t bucket) {
+    if (bucket < HIST_SUB) return bucket;
+
+    size_t octave = bucket / HIST_SUB + 2;
+    return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << (octave - 3);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, size_t total, double p) {
+    size_t want = (size_t)ceil(total * p), seen = 0;
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= want && seen > 0) return hist_value(i);
+    }
+
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+typedef struct {
+    uint64_t hist[HIST_BUCKETS];
+    uint64_t total_ns;
+    uint64_t max_ns;
+
+    size_t bad;        // NaN or infinite samples
+    size_t silent;     // cycles with notes held that rendered nothing
+    double sum_sq;
+    float peak;
+    uint64_t hash;
+} results_t;
+
+static void check_output(results_t *res, jack_port_t **outs, jack_nframes_t frames, bool held) {
+    bool heard = false;
+
+    for (size_t i = 0; i < JB_OUTS; i++) {
+        const float *buf = mock_audio(outs[i]);
+
+        for (size_t j = 0; j < frames; j++) {
+            if (!isfinite(buf[j])) {
+                res->bad++;
+                continue;
+            }
+
+            res->sum_sq += (double)buf[j] * buf[j];
+            res->peak = fmaxf(res->peak, fabsf(buf[j]));
+            heard |= buf[j] != 0.0f;
+        }
+
+        res->hash = jb_hash(res->hash, buf, frames * sizeof(*buf));
+    }
+
+    if (held && !heard) res->silent++;
+}
+
+static void report(const bench_opts_t *opts, const results_t *res) {
+    double budget = (double)opts->frames * 1e9 / opts->srate;
+    double mean = (double)res->total_ns / opts->cycles;
+
+#define US(ns) ((double)(ns) / 1000.0)
+    printf("# %zu cycles of %u frames at %u Hz, %zu notes held, %zu controller events per cycle"
+           "%s%s\n",
+           opts->cycles,
+           opts->frames,
+           opts->srate,
+           opts->poly,
+           opts->ccs,
+           opts->accurate ? ", sample-accurate" : "",
+           opts->freewheel ? ", freewheeling" : "");
+    if (opts->shards) printf("# played by %zu workers behind a front end\n", opts->shards);
+    printf("cycle time (us):  mean %.2f  p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+           US(mean),
+           US(hist_percentile(res->hist, opts->cycles, 0.5)),
+           US(hist_percentile(res->hist, opts->cycles, 0.99)),
+           US(hist_percentile(res->hist, opts->cycles, 0.999)),
+           US(res->max_ns));
+    printf("budget (us):      %.2f  (mean load %.2f%%, max load %.2f%%)\n",
+           US(budget),
+           100.0 * mean / budget,
+           100.0 * res->max_ns / budget);
+    printf("output:           peak %.4f  rms %.4f  hash %016llx\n",
+           res->peak,
+           sqrt(res->sum_sq / ((double)opts->cycles * opts->frames * JB_OUTS)),
+           (unsigned long long)res->hash);
+#undef US
+
+    if (res->bad) printf("error: %zu non-finite samples\n", res->bad);
+    if (res->silent) printf("error: %zu silent cycles while notes were held\n", res->silent);
+
+    // only ever non-zero when built with `make RTCHECK=1`
+    if (jb_rt_violations())
+        printf("error: %zu realtime safety violations (see above)\n", jb_rt_violations());
+}
+
+static jb_res_t bench_run(bench_opts_t *opts, results_t *res) {
+    script_t sc = {.stride = JB_MAX(opts->length / opts->poly, 1), .cc_dir = 1};
+    sc.held = calloc(opts->poly, 1);
+
+    if (!sc.held) return JB_ERR(JB_ERR_OOM, "failed to allocate script");
+
+    jb_patch_t patch;
+    jb_patch_init(&patch);
+
+    const jb_def_t *defs = opts->defs;
+    size_t n_defs = jb_buf_len(opts->defs);
+
+    if (n_defs == 0) {
+        defs = default_defs;
+        n_defs = sizeof(default_defs) / sizeof(*default_defs);
+    }
+
+    mock_init(opts->srate, opts->frames);
+
+    JB_TRY(jb_patch_compile(&patch, defs, n_defs));
+
+    // sharded, every worker plays the whole patch, so one worker should sound just like none
+    size_t n_engs = JB_MAX(opts->shards, 1);
+    jb_engine_t *engs = calloc(n_engs, sizeof(*engs));
+    jb_worker_t *workers = calloc(n_engs, sizeof(*workers));
+
+    if (!engs || !workers) return JB_ERR(JB_ERR_OOM, "failed to allocate engines");
+
+    for (size_t i = 0; i < n_engs; i++) {
+        JB_TRY(jb_engine_init(&engs[i], &patch, opts->voices));
+        engs[i].accurate = opts->accurate;
+    }
+
+    jb_meter_t meter = {.shm = NULL};
+    if (opts->meter_name) {
+        JB_TRY(jb_meter_create(&meter, opts->meter_name, opts->tap));
+        engs[0].meter = &meter;
+    }
+
+    jb_client_t cl;
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = &engs[0],
+                              .midi_batch_cb = jb_engine_midi_batch,
+                              .audio_cb = jb_engine_audio,
+                              .prepare_cb = jb_engine_prepare,
+                              .freewheel_cb = jb_engine_freewheel};
+
+    jb_front_t front = {.shm = NULL};
+    char front_name[64];
+    snprintf(front_name, sizeof(front_name), "/midid-bench-%d", (int)getpid());
+
+    if (opts->shards) {
+        JB_TRY(jb_front_create(&front, front_name, 0, 0));
+
+        cfg.state = &front;
+        cfg.midi_batch_cb = jb_front_midi_batch;
+        cfg.audio_cb = jb_front_audio;
+        cfg.prepare_cb = jb_front_prepare;
+        cfg.freewheel_cb = jb_front_freewheel;
+    }
+
+    JB_TRY(jb_client_init(&cl, cfg));
+    JB_TRY(jb_client_prepare(&cl));
+
+    // workers are threads here rather than processes, which is all the same to the front end
+    bool chans[JB_CHANS];
+    for (size_t c = 0; c < JB_CHANS; c++) chans[c] = patch.chans[c].len > 0;
+
+    for (size_t i = 0; i < opts->shards; i++) {
+        jb_client_config_t wcfg = {.name = "midid",
+                                   .state = &engs[i],
+                                   .midi_batch_cb = jb_engine_midi_batch,
+                                   .audio_cb = jb_engine_audio,
+                                   .prepare_cb = jb_engine_prepare,
+                                   .freewheel_cb = jb_engine_freewheel};
+
+        JB_TRY(jb_worker_init(&workers[i], front_name, wcfg, chans));
+        JB_TRY(jb_worker_start(&workers[i]));
+    }
+
+    front.metrics = &cl.metrics;
+
+    JB_TRY(jb_client_activate(&cl));
+
+    if (opts->freewheel) jack_set_freewheel(cl.jack, 1);
+
+    jack_port_t *in = mock_port("midid:midi_in");
+    jack_port_t *outs[JB_OUTS] = {mock_port("midid:audio_out_l"), mock_port("midid:audio_out_r")};
+
+    res->hash = JB_HASH_INIT;
+
+    jb_res_t prof = opts->trace_path ? jb_prof_start(opts->trace_path) : JB_OK_VAL;
+    if (prof JB_IS_ERR) {
+        jb_warn("not tracing: %s", prof.msg);
+        free(prof.msg);
+    }
+
+    for (size_t i = 0; i < opts->cycles; i++) {
+        script_cycle(&sc, opts, i, in);
+
+        uint64_t start = now_ns();
+        mock_cycle();
+        uint64_t ns = now_ns() - start;
+
+        res->hist[JB_MIN(hist_bucket(ns), HIST_BUCKETS - 1)]++;
+        res->total_ns += ns;
+        res->max_ns = JB_MAX(res->max_ns, ns);
+
+        // notes are only certain to be held once the first has been played out
+        check_output(res, outs, opts->frames, i > 0);
+    }
+
+    jb_prof_stop();
+
+    free(sc.held);
+
+    // the client goes first, as its process thread posts to the workers
+    jb_client_close(&cl);
+    for (size_t i = 0; i < opts->shards; i++) jb_worker_stop(&workers[i]);
+    jb_front_close(&front);
+
+    for (size_t i = 0; i < n_engs; i++) jb_engine_free(&engs[i]);
+    free(engs);
+    free(workers);
+
+    jb_meter_close(&meter);
+    jb_patch_free(&patch);
+
+    return JB_OK_VAL;
+}
+
+int main(int argc, char **argv) {
+    jb_log_init();
+
+    if (argc > 1 && strcmp(argv[1], "stress") == 0) return stress_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "golden") == 0) return golden_main(argc - 1, argv + 1);
+
+    bench_opts_t opts = {.cycles = 100000,
+                         .frames = 256,
+                         .srate = 48000,
+                         .poly = 16,
+                         .length = 64,
+                         .ccs = 4,
+                         .voices = JB_ENGINE_VOICES};
+
+    int c;
+    while ((c = getopt(argc, argv, "c:f:r:n:l:e:aFV:T:M:W:S:I:E:O:C:R:")) != -1) {
+        switch (c) {
+            case 'c':  // cycles to run
+                opts.cycles = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'f':  // period size
+                opts.frames = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':  // sample rate
+                opts.srate = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'n':  // notes held at once
+                opts.poly = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'l':  // cycles each note is held
+                opts.length = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'e':  // controller events per cycle
+                opts.ccs = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'a':  // sample-accurate events
+                opts.accurate = true;
+                break;
+
+            case 'F':  // freewheel
+                opts.freewheel = true;
+                break;
+
+            case 'V':  // voices the engine can sound at once
+                opts.voices = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'T':  // write zone trace
+                opts.trace_path = optarg;
+                break;
+
+            case 'M':  // publish meters
+                opts.meter_name = optarg;
+                break;
+
+            case 'W':  // waveform tap decimation
+                opts.tap = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'S':  // play the patch in workers behind a front end
+                opts.shards = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'I':  // patch to run (notes are played on channel 0, CC 1 is swept)
+            case 'E':
+            case 'O':
+            case 'C':
+            case 'R':
+                jb_buf_push(opts.defs, ((jb_def_t){.kind = c, .src = optarg}));
+                break;
+
+            default:
+                return 1;
+        }
+    }
+
+    if (opts.cycles == 0 || opts.poly == 0 || opts.srate == 0 || opts.frames == 0 ||
+        opts.frames > MOCK_MAX_FRAMES) {
+        jb_error("cycles, notes, sample rate and period size (up to %d) must be positive",
+                 MOCK_MAX_FRAMES);
+        return 1;
+    }
+
+    results_t *res = calloc(1, sizeof(*res));
+    if (!res) return 1;
+
+    jb_res_t r = bench_run(&opts, res);
+    jb_buf_free(opts.defs);
+
+    if (r JB_IS_ERR) {
+        jb_report_result(r);
+        free(res);
+        return 1;
+    }
+
+    report(&opts, res);
+
+    int status = res->bad || res->silent || res->peak == 0.0f || jb_rt_violations();
+    free(res);
+
+    return status;
+}
@@ -0,0 +1,31 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// bench.h: bench subcommands
+//
+
+#pragma once
+
+#include <jbase.h>
+
+// `bench stress`: find the most load each patch can take within a share of the period
+int stress_main(int argc, char **argv);
+
+// `bench golden`: compare renders against references, and the scalar and vector renderers
+int golden_main(int argc, char **argv);
@@ -0,0 +1,667 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// golden.c: golden output comparison
+//
+// `bench golden` guards the sound of the synthesis code while it's optimised. it renders a fixed
+// set of scenarios (every wave, modulation and a handful of envelopes and controller sweeps)
+// through the whole process callback against mockjack.c, and either writes the renders out as
+// references or compares them against references written earlier. renders are compared by SNR,
+// and by how far their averaged spectra differ, since an approximation can shift a waveform
+// without changing how it sounds. separately, every chain of two waves is run through both the
+// scalar (synth.c) and vector (vsynth.c) renderers, and compared sample by sample, as is a bank of
+// partials against the same partials summed with libm
+//
+
+#include <bench.h>
+#include <errno.h>
+#include <math.h>
+#include <mockjack.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define GOLDEN_MAGIC "JBGOLDEN"
+#define GOLDEN_VERSION 1
+
+#define RENDER_SRATE 48000
+#define RENDER_FRAMES 256
+#define RENDER_CYCLES 160
+#define RENDER_RELEASE 100  // cycle held notes are released on
+#define RENDER_RETRIGGER 60 // cycle a note is struck again on, in scenarios that retrigger
+
+#define SPECTRUM_LEN 1024   // frames in each block of an averaged spectrum (a power of two)
+#define SPECTRUM_FLOOR 1e-6 // bins this far under a spectrum's peak (-60dB) aren't compared
+
+#define LANE_SAMPLES 4800   // samples rendered per lane when comparing scalar and vector paths
+#define PARTIAL_GROUPS ((JB_PARTIALS + JB_LANES - 1) / JB_LANES) // groups in a full partial bank
+
+#define SCENARIO_DEFS 6
+#define SCENARIO_SRC 128
+
+// a patch, and how it's played
+typedef struct {
+    char name[32];
+    jb_def_kind_t kinds[SCENARIO_DEFS];
+    char srcs[SCENARIO_DEFS][SCENARIO_SRC];
+    size_t n_defs;
+
+    bool sweep;      // sweep CC 1
+    bool retrigger;  // strike a held note again
+    bool stochastic; // renders differ sample by sample (noise), so only spectra are compared
+} scenario_t;
+
+typedef struct {
+    char *dir;       // directory of references (NULL to only compare scalar and vector paths)
+    bool write;      // write references rather than compare against them
+    double snr;      // least SNR against a reference, in dB
+    double spectral; // most RMS difference between spectra, in dB
+    double lanes;    // least SNR between scalar and vector paths, in dB...
+    float error;     // ...unless no sample differs by more than this
+} golden_opts_t;
+
+// stored ahead of a render's interleaved samples
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t srate;
+    uint64_t frames;
+} golden_hdr_t;
+
+static void scenario_def(scenario_t *sc, jb_def_kind_t kind, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(sc->srcs[sc->n_defs], SCENARIO_SRC, fmt, args);
+    va_end(args);
+
+    sc->kinds[sc->n_defs++] = kind;
+}
+
+static scenario_t *scenarios_build(void) {
+    // modulations by name rather than operator, since scenario names become file names
+    static const char *mods[JB_MOD_MAX] = {
+        [JB_MOD_AM] = "am",
+        [JB_MOD_FM] = "fm",
+        [JB_MOD_PM] = "pm",
+        [JB_MOD_BM] = "bm",
+    };
+
+    static const char *envs[][2] = {
+        {"pad", "0.01s1.0 -> 0.1s0.7 -> SUST -> 0.2s0.0"},
+        {"pluck", "0s1.0 -> 0.4s0.0"},
+        {"swell", "0.5s1.0 -> SUST -> 0.5s0.0"},
+        {"gate", "0s1.0 -> SUST -> 0s0.0"},
+    };
+
+    scenario_t *scs = NULL;
+    scenario_t sc;
+
+    // every wave on its own
+    for (size_t w = 0; w < JB_WAVE_MAX; w++) {
+        sc = (scenario_t){.stochastic = w == JB_WAVE_NOISE};
+        snprintf(sc.name, sizeof(sc.name), "wave-%s", jb_wave_str[w]);
+
+        scenario_def(&sc, JB_DEF_ENV, "e: %s", envs[0][1]);
+        scenario_def(&sc, JB_DEF_OSC, "o: wave=%s vol=1.0", jb_wave_str[w]);
+        scenario_def(&sc, JB_DEF_INST, "i e: o");
+        scenario_def(&sc, JB_DEF_CHAN, "0: i");
+        jb_buf_push(scs, sc);
+    }
+
+    // a sine modulated by every wave, every way
+    for (size_t m = 0; m < JB_MOD_MAX; m++) {
+        for (size_t w = 0; w < JB_WAVE_MAX; w++) {
+            sc = (scenario_t){.stochastic = w == JB_WAVE_NOISE};
+            snprintf(sc.name, sizeof(sc.name), "%s-%s", mods[m], jb_wave_str[w]);
+
+            scenario_def(&sc, JB_DEF_ENV, "e: %s", envs[0][1]);
+            scenario_def(&sc, JB_DEF_OSC, "car: wave=sin vol=1.0");
+            scenario_def(&sc, JB_DEF_OSC, "mod: wave=%s vol=0.5 base=12", jb_wave_str[w]);
+            scenario_def(&sc, JB_DEF_INST, "i e: car %c mod", jb_mod_char[m]);
+            scenario_def(&sc, JB_DEF_CHAN, "0: i");
+            jb_buf_push(scs, sc);
+        }
+    }
+
+    // envelope shapes, with a note struck again part way through
+    for (size_t e = 0; e < sizeof(envs) / sizeof(*envs); e++) {
+        sc = (scenario_t){.retrigger = true};
+        snprintf(sc.name, sizeof(sc.name), "env-%s", envs[e][0]);
+
+        scenario_def(&sc, JB_DEF_ENV, "e: %s", envs[e][1]);
+        scenario_def(&sc, JB_DEF_OSC, "o: wave=sin vol=1.0");
+        scenario_def(&sc, JB_DEF_INST, "i e: o");
+        scenario_def(&sc, JB_DEF_CHAN, "0: i");
+        jb_buf_push(scs, sc);
+    }
+
+    // controller sweeps of a wave's bias, which glide between cycles
+    for (size_t w = 0; w < JB_WAVE_MAX; w++) {
+        if (w == JB_WAVE_NOISE) continue;
+
+        sc = (scenario_t){.sweep = true};
+        snprintf(sc.name, sizeof(sc.name), "bias-%s", jb_wave_str[w]);
+
+        scenario_def(&sc, JB_DEF_ENV, "e: %s", envs[0][1]);
+        scenario_def(&sc, JB_DEF_OSC, "o: wave=%s vol=1.0", jb_wave_str[w]);
+        scenario_def(&sc, JB_DEF_INST, "i e: o");
+        scenario_def(&sc, JB_DEF_CHAN, "0: i");
+        scenario_def(&sc, JB_DEF_ROUTE, "0: 1 o.bias 0.0 0.8");
+        jb_buf_push(scs, sc);
+    }
+
+    // a longer chain, mixing modulations
+    sc = (scenario_t){.sweep = true, .retrigger = true};
+    snprintf(sc.name, sizeof(sc.name), "chain");
+
+    scenario_def(&sc, JB_DEF_ENV, "e: %s", envs[0][1]);
+    scenario_def(&sc, JB_DEF_OSC, "a: wave=sin vol=1.0");
+    scenario_def(&sc, JB_DEF_OSC, "b: wave=triangle vol=0.7 base=7");
+    scenario_def(&sc, JB_DEF_OSC, "c: wave=saw vol=0.3 base=-12");
+    scenario_def(&sc, JB_DEF_INST, "i e: a %% b + c - a");
+    scenario_def(&sc, JB_DEF_CHAN, "0: i");
+    jb_buf_push(scs, sc);
+
+    // an additive organ, with partials high enough to be culled, and its volume swept
+    sc = (scenario_t){.sweep = true, .retrigger = true};
+    snprintf(sc.name, sizeof(sc.name), "additive");
+
+    scenario_def(&sc, JB_DEF_ENV, "e: %s", envs[0][1]);
+    scenario_def(&sc,
+                 JB_DEF_OSC,
+                 "o: partials=0.5:0.6,1:1.0,2:0.8,3:0.5,4:0.4,6:0.3,8:0.3,80:0.1 vol=0.5");
+    scenario_def(&sc, JB_DEF_INST, "i e: o");
+    scenario_def(&sc, JB_DEF_CHAN, "0: i");
+    scenario_def(&sc, JB_DEF_ROUTE, "0: 1 o.vol 0.2 0.8");
+    jb_buf_push(scs, sc);
+
+    return scs;
+}
+
+static void script_cycle(const scenario_t *sc, size_t cycle, jack_port_t *in) {
+    static const uint8_t chord[] = {57, 64, 69};
+
+    if (sc->sweep) {
+        size_t t = (cycle * 4) % 254;
+        mock_midi_push(in, 0, (uint8_t[]){JB_CTRL, 1, t < 127 ? t : 254 - t}, 3);
+    }
+
+    // notes land part way through a cycle, so that rendering is split around them
+    for (size_t i = 0; i < sizeof(chord) && cycle == 0; i++)
+        mock_midi_push(in, 17 + i, (uint8_t[]){JB_NOTE_ON, chord[i], 100}, 3);
+
+    if (sc->retrigger && cycle == RENDER_RETRIGGER)
+        mock_midi_push(in, 100, (uint8_t[]){JB_NOTE_ON, chord[1], 100}, 3);
+
+    for (size_t i = 0; i < sizeof(chord) && cycle == RENDER_RELEASE; i++)
+        mock_midi_push(in, 5, (uint8_t[]){JB_NOTE_OFF, chord[i], 0}, 3);
+}
+
+// render a scenario as interleaved frames
+static jb_res_t scenario_render(const scenario_t *sc, float *out) {
+    jb_patch_t patch;
+    jb_patch_init(&patch);
+
+    mock_init(RENDER_SRATE, RENDER_FRAMES);
+
+    jb_def_t defs[SCENARIO_DEFS];
+    for (size_t i = 0; i < sc->n_defs; i++)
+        defs[i] = (jb_def_t){.kind = sc->kinds[i], .src = (char *)sc->srcs[i]};
+
+    jb_res_t res = jb_patch_compile(&patch, defs, sc->n_defs);
+    if (res JB_IS_ERR) {
+        jb_patch_free(&patch);
+        return res;
+    }
+
+    jb_engine_t eng;
+    res = jb_engine_init(&eng, &patch, JB_ENGINE_VOICES);
+    if (res JB_IS_ERR) {
+        jb_patch_free(&patch);
+        return res;
+    }
+
+    eng.accurate = true;
+
+    jb_client_t cl;
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = &eng,
+                              .midi_batch_cb = jb_engine_midi_batch,
+                              .audio_cb = jb_engine_audio,
+                              .prepare_cb = jb_engine_prepare};
+
+    res = jb_client_init(&cl, cfg);
+    if (res JB_IS_OK) {
+        res = jb_client_prepare(&cl);
+        if (res JB_IS_OK) res = jb_client_activate(&cl);
+
+        jack_port_t *in = mock_port("midid:midi_in");
+        jack_port_t *outs[JB_OUTS] = {mock_port("midid:audio_out_l"),
+                                      mock_port("midid:audio_out_r")};
+
+        for (size_t i = 0; i < RENDER_CYCLES && res JB_IS_OK; i++) {
+            script_cycle(sc, i, in);
+            mock_cycle();
+
+            for (size_t o = 0; o < JB_OUTS; o++)
+                for (size_t j = 0; j < RENDER_FRAMES; j++)
+                    out[(i * RENDER_FRAMES + j) * JB_OUTS + o] = mock_audio(outs[o])[j];
+        }
+
+        jb_client_close(&cl);
+    }
+
+    jb_engine_free(&eng);
+    jb_patch_free(&patch);
+
+    return res;
+}
+
+static jb_res_t golden_write(const char *path, const float *buf, size_t frames) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return JB_ERR(JB_ERR_LIBC, "failed to create '%s': %s", path, strerror(errno));
+
+    golden_hdr_t hdr = {.version = GOLDEN_VERSION, .srate = RENDER_SRATE, .frames = frames};
+    memcpy(hdr.magic, GOLDEN_MAGIC, sizeof(hdr.magic));
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+              fwrite(buf, sizeof(*buf) * JB_OUTS, frames, f) == frames;
+
+    if (fclose(f) != 0) ok = false;
+    if (!ok) return JB_ERR(JB_ERR_LIBC, "failed to write '%s'", path);
+
+    return JB_OK_VAL;
+}
+
+static jb_res_t golden_read(const char *path, float *buf, size_t frames) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    golden_hdr_t hdr;
+    bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1;
+
+    if (!ok || memcmp(hdr.magic, GOLDEN_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != GOLDEN_VERSION || hdr.srate != RENDER_SRATE || hdr.frames != frames) {
+        fclose(f);
+        return JB_ERR(JB_ERR_USER, "'%s' isn't a reference for this version of bench", path);
+    }
+
+    ok = fread(buf, sizeof(*buf) * JB_OUTS, frames, f) == frames;
+    fclose(f);
+
+    if (!ok) return JB_ERR(JB_ERR_USER, "'%s' is truncated", path);
+
+    return JB_OK_VAL;
+}
+
+// SNR of `out` against `ref`, in dB (infinite if they're identical)
+static double snr_db(const float *ref, const float *out, size_t len) {
+    double sig = 0.0, noise = 0.0;
+
+    for (size_t i = 0; i < len; i++) {
+        double d = (double)out[i] - ref[i];
+        sig += (double)ref[i] * ref[i];
+        noise += d * d;
+    }
+
+    if (noise == 0.0) return INFINITY;
+    if (sig == 0.0) return -INFINITY;
+
+    return 10 * log10(sig / noise);
+}
+
+// in-place radix 2 FFT of `len` complex values
+static void fft(double *re, double *im, size_t len) {
+    for (size_t i = 1, j = 0; i < len; i++) {
+        size_t bit = len >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+
+        if (i < j) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (size_t n = 2; n <= len; n <<= 1) {
+        double ang = -2 * M_PI / n;
+
+        for (size_t i = 0; i < len; i += n) {
+            for (size_t k = 0; k < n / 2; k++) {
+                double wr = cos(ang * k), wi = sin(ang * k);
+                double *ar = &re[i + k], *ai = &im[i + k];
+                double *br = &re[i + k + n / 2], *bi = &im[i + k + n / 2];
+
+                double tr = *br * wr - *bi * wi;
+                double ti = *br * wi + *bi * wr;
+
+                *br = *ar - tr;
+                *bi = *ai - ti;
+                *ar += tr;
+                *ai += ti;
+            }
+        }
+    }
+}
+
+// power spectrum of interleaved frames, averaged over Hann-windowed blocks of both channels
+static void spectrum(const float *buf, size_t frames, double *power) {
+    double re[SPECTRUM_LEN], im[SPECTRUM_LEN];
+    memset(power, 0, (SPECTRUM_LEN / 2 + 1) * sizeof(*power));
+
+    for (size_t start = 0; start + SPECTRUM_LEN <= frames; start += SPECTRUM_LEN) {
+        for (size_t o = 0; o < JB_OUTS; o++) {
+            for (size_t i = 0; i < SPECTRUM_LEN; i++) {
+                double win = 0.5 - 0.5 * cos(2 * M_PI * i / SPECTRUM_LEN);
+                re[i] = buf[(start + i) * JB_OUTS + o] * win;
+                im[i] = 0.0;
+            }
+
+            fft(re, im, SPECTRUM_LEN);
+
+            for (size_t k = 0; k <= SPECTRUM_LEN / 2; k++)
+                power[k] += re[k] * re[k] + im[k] * im[k];
+        }
+    }
+}
+
+// RMS difference between the averaged spectra of two renders, in dB, over the bins either one has
+// anything in
+static double spectral_db(const float *ref, const float *out, size_t frames) {
+    double pr[SPECTRUM_LEN / 2 + 1], po[SPECTRUM_LEN / 2 + 1];
+    spectrum(ref, frames, pr);
+    spectrum(out, frames, po);
+
+    double peak = 0.0;
+    for (size_t k = 0; k <= SPECTRUM_LEN / 2; k++) peak = fmax(peak, fmax(pr[k], po[k]));
+
+    double floor = peak * SPECTRUM_FLOOR, sum = 0.0;
+    size_t n = 0;
+
+    for (size_t k = 0; k <= SPECTRUM_LEN / 2; k++) {
+        if (pr[k] < floor && po[k] < floor) continue;
+
+        double d = 10 * log10((po[k] + floor) / (pr[k] + floor));
+        sum += d * d;
+        n++;
+    }
+
+    return n ? sqrt(sum / n) : 0.0;
+}
+
+// render every scenario, writing or comparing references, and count those that fail
+static jb_res_t scenarios_run(const golden_opts_t *opts, size_t *failed) {
+    scenario_t *scs = scenarios_build();
+    size_t frames = RENDER_CYCLES * RENDER_FRAMES;
+
+    float *out = calloc(frames * JB_OUTS, sizeof(*out));
+    float *ref = calloc(frames * JB_OUTS, sizeof(*ref));
+    jb_res_t res = JB_OK_VAL;
+
+    if (!out || !ref) res = JB_ERR(JB_ERR_OOM, "failed to allocate renders");
+
+    if (res JB_IS_OK && opts->write && mkdir(opts->dir, 0755) != 0 && errno != EEXIST)
+        res = JB_ERR(JB_ERR_LIBC, "failed to create '%s': %s", opts->dir, strerror(errno));
+
+    for (size_t i = 0; i < jb_buf_len(scs) && res JB_IS_OK; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s.f32", opts->dir, scs[i].name);
+
+        res = scenario_render(&scs[i], out);
+        if (res JB_IS_ERR) {
+            jb_error("failed to render '%s'", scs[i].name);
+            break;
+        }
+
+        if (opts->write) {
+            res = golden_write(path, out, frames);
+            continue;
+        }
+
+        res = golden_read(path, ref, frames);
+        if (res JB_IS_ERR) break;
+
+        double snr = snr_db(ref, out, frames * JB_OUTS);
+        double spec = spectral_db(ref, out, frames);
+        bool ok = (scs[i].stochastic || snr >= opts->snr) && spec <= opts->spectral;
+
+        printf("%-20s snr %7.1fdB%s  spectra %6.3fdB  %s\n",
+               scs[i].name,
+               snr,
+               scs[i].stochastic ? " (noise)" : "        ",
+               spec,
+               ok ? "ok" : "FAIL");
+
+        if (!ok) (*failed)++;
+    }
+
+    if (res JB_IS_OK && opts->write)
+        printf("wrote %zu references to '%s'\n", jb_buf_len(scs), opts->dir);
+
+    free(out);
+    free(ref);
+    jb_buf_free(scs);
+
+    return res;
+}
+
+// render a chain through both renderers, a note per lane, and compare them
+static double lanes_compare(const jb_osc_t *oscs, const jb_osc_link_t *chain, size_t len,
+                            float *max_err) {
+    static float scalar[JB_LANES][LANE_SAMPLES], vector[JB_LANES][LANE_SAMPLES];
+
+    float phase[JB_LANES][JB_CHAIN_MAX] = {0}, step[JB_LANES][JB_CHAIN_MAX];
+    jb_vf_t vphase[JB_CHAIN_MAX] = {0}, vstep[JB_CHAIN_MAX];
+    jb_vu_t noise;
+    jb_noise_init(&noise);
+
+    for (size_t l = 0; l < JB_LANES; l++) {
+        for (size_t i = 0; i < len; i++) {
+            step[l][i] = jb_osc_step(&oscs[chain[i].osc], JB_SEMIS(36 + 7 * l), RENDER_SRATE);
+            vstep[i][l] = step[l][i];
+        }
+    }
+
+    for (size_t j = 0; j < LANE_SAMPLES; j++) {
+        for (size_t l = 0; l < JB_LANES; l++)
+            scalar[l][j] = jb_chain_sample(oscs, chain, len, phase[l], step[l]);
+
+        jb_vf_t out;
+        jb_chain_sample_v(oscs, chain, len, vphase, vstep, &noise, &out);
+        for (size_t l = 0; l < JB_LANES; l++) vector[l][j] = out[l];
+    }
+
+    *max_err = 0.0;
+    for (size_t l = 0; l < JB_LANES; l++)
+        for (size_t j = 0; j < LANE_SAMPLES; j++)
+            *max_err = fmaxf(*max_err, fabsf(vector[l][j] - scalar[l][j]));
+
+    return snr_db(&scalar[0][0], &vector[0][0], JB_LANES * LANE_SAMPLES);
+}
+
+// compare the scalar and vector renderers on every wave, and every pair of waves modulating
+// eachother every way. noise is left out, since the two draw from different generators
+static size_t lanes_run(const golden_opts_t *opts) {
+    size_t failed = 0, n = 0;
+    float worst = 0.0;
+
+    for (size_t w = 0; w < JB_WAVE_MAX; w++) {
+        for (size_t m = 0; m <= JB_MOD_MAX; m++) {
+            for (size_t w2 = 0; w2 < JB_WAVE_MAX; w2++) {
+                if (w == JB_WAVE_NOISE || w2 == JB_WAVE_NOISE) continue;
+
+                // the last pass over modulations renders each wave alone
+                if (m == JB_MOD_MAX && w2 > 0) break;
+
+                jb_osc_t oscs[2] = {
+                    {.wave = w, .amp = 1.0, .bias = 0.25, .sample = JB_NONE,
+                     .partials = JB_NONE},
+                    {.wave = w2, .amp = 0.5, .bias = 0.001, .detune = JB_SEMIS(12),
+                     .sample = JB_NONE, .partials = JB_NONE},
+                };
+                jb_osc_link_t chain[2] = {{.osc = 0, .mod = m < JB_MOD_MAX ? m : 0}, {.osc = 1}};
+                size_t len = m < JB_MOD_MAX ? 2 : 1;
+
+                float max_err;
+                double snr = lanes_compare(oscs, chain, len, &max_err);
+                // a quiet chain (e.g. a saw with no bias) has a poor SNR for the smallest errors
+                bool ok = snr >= opts->lanes || max_err <= opts->error;
+
+                char name[32];
+                if (len == 2)
+                    snprintf(name, sizeof(name), "%s %c %s", jb_wave_str[w], jb_mod_char[m],
+                             jb_wave_str[w2]);
+                else
+                    snprintf(name, sizeof(name), "%s", jb_wave_str[w]);
+
+                if (!ok) {
+                    printf("lanes %-20s snr %7.1fdB  max error %.5f  FAIL\n", name, snr, max_err);
+                    failed++;
+                }
+
+                worst = fmaxf(worst, max_err);
+                n++;
+            }
+        }
+    }
+
+    printf("scalar and vector paths: %zu chains, max error %.5f, %zu failed\n", n, worst, failed);
+
+    return failed;
+}
+
+// render a bank of every harmonic under nyquist through the recurrence in vsynth.c, and compare it
+// with the same harmonics summed by libm
+static size_t partials_run(const golden_opts_t *opts) {
+    static float ref[LANE_SAMPLES], out[LANE_SAMPLES];
+
+    jb_vf_t ratio[PARTIAL_GROUPS], amp[PARTIAL_GROUPS];
+    jb_partials_v_t state[PARTIAL_GROUPS];
+
+    // a low note, so that every partial is audible and the rotations are as small as they get
+    float step = jb_cents_hz(JB_SEMIS(33)) * 2 * (float)M_PI / RENDER_SRATE;
+    float scale = 0.0;
+
+    for (size_t g = 0; g < PARTIAL_GROUPS; g++) {
+        for (size_t l = 0; l < JB_LANES; l++) {
+            size_t k = g * JB_LANES + l;
+
+            ratio[g][l] = k < JB_PARTIALS ? k + 1 : 0.0;
+            amp[g][l] = k < JB_PARTIALS ? 1.0f / (k + 1) : 0.0;
+            scale += amp[g][l];
+
+            state[g].re[l] = 1.0;
+            state[g].im[l] = 0.0;
+            state[g].amp[l] = amp[g][l];
+        }
+    }
+
+    memset(out, 0, sizeof(out));
+    for (size_t j = 0; j < LANE_SAMPLES; j += JB_PARTIAL_BLOCK) {
+        size_t len = JB_MIN(LANE_SAMPLES - j, JB_PARTIAL_BLOCK);
+        jb_partials_render_v(state, ratio, amp, PARTIAL_GROUPS, step, len, out + j);
+    }
+
+    float max_err = 0.0;
+    for (size_t j = 0; j < LANE_SAMPLES; j++) {
+        double sum = 0.0;
+
+        // each partial turns by the same (rounded) angle a frame as it does in the bank
+        for (size_t k = 0; k < JB_PARTIALS; k++) {
+            double w = (float)((k + 1) * step);
+            sum += sin(fmod(w * j, 2 * M_PI)) / (k + 1);
+        }
+
+        ref[j] = sum;
+        // errors are relative to the loudest the bank can get
+        max_err = fmaxf(max_err, fabsf(out[j] - ref[j]) / scale);
+    }
+
+    double snr = snr_db(ref, out, LANE_SAMPLES);
+    bool ok = snr >= opts->lanes || max_err <= opts->error;
+
+    printf("partial bank: %d partials, snr %.1fdB, max error %.5f, %s\n",
+           JB_PARTIALS,
+           snr,
+           max_err,
+           ok ? "ok" : "FAIL");
+
+    return !ok;
+}
+
+int golden_main(int argc, char **argv) {
+    golden_opts_t opts = {.snr = 60.0, .spectral = 0.5, .lanes = 60.0, .error = 1e-3};
+
+    int c;
+    while ((c = getopt(argc, argv, "ws:d:v:e:")) != -1) {
+        switch (c) {
+            case 'w':  // write references rather than compare
+                opts.write = true;
+                break;
+
+            case 's':  // least SNR against a reference
+                opts.snr = strtod(optarg, NULL);
+                break;
+
+            case 'd':  // most RMS difference between spectra
+                opts.spectral = strtod(optarg, NULL);
+                break;
+
+            case 'v':  // least SNR between scalar and vector paths
+                opts.lanes = strtod(optarg, NULL);
+                break;
+
+            case 'e':  // most error between scalar and vector paths, whatever the SNR
+                opts.error = strtof(optarg, NULL);
+                break;
+
+            default:
+                return 1;
+        }
+    }
+
+    if (optind < argc) opts.dir = argv[optind];
+
+    if (opts.write && !opts.dir) {
+        jb_error("expected a directory to write references to");
+        return 1;
+    }
+
+    size_t failed = 0;
+
+    if (opts.dir) {
+        jb_res_t res = scenarios_run(&opts, &failed);
+
+        if (res JB_IS_ERR) {
+            jb_report_result(res);
+            return 1;
+        }
+    }
+
+    if (!opts.write) failed += lanes_run(&opts) + partials_run(&opts);
+
+    return failed > 0;
+}
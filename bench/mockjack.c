@@ -0,0 +1,358 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// mockjack.c: in-memory stand-in for a JACK server
+//
+
+#include <mockjack.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jack/midiport.h"
+
+#define MOCK_CLIENTS 4
+#define MOCK_PORTS 32
+#define MOCK_MIDI_EVENTS 4096
+#define MOCK_MIDI_BYTES (MOCK_MIDI_EVENTS * 4)
+
+typedef struct {
+    uint32_t count;
+    jack_midi_event_t evs[MOCK_MIDI_EVENTS];
+    size_t used;
+    jack_midi_data_t data[MOCK_MIDI_BYTES];
+} midi_buf_t;
+
+struct _jack_client {
+    char name[64];
+    bool open;
+    bool active;
+
+    JackProcessCallback process;
+    void *process_arg;
+    JackFreewheelCallback freewheel;
+    void *freewheel_arg;
+};
+
+struct _jack_port {
+    jack_client_t *client;
+    char name[128];
+    unsigned long flags;
+    bool midi;
+
+    float audio[MOCK_MAX_FRAMES];
+    midi_buf_t midi_buf;
+};
+
+static jack_client_t clients[MOCK_CLIENTS];
+static jack_port_t ports[MOCK_PORTS];
+static size_t n_ports;
+
+static jack_nframes_t srate = 48000;
+static jack_nframes_t period = 256;
+static jack_nframes_t frames; // frame time at start of current cycle
+
+void mock_init(jack_nframes_t rate, jack_nframes_t nframes) {
+    srate = rate;
+    period = nframes < MOCK_MAX_FRAMES ? nframes : MOCK_MAX_FRAMES;
+    frames = 0;
+}
+
+jack_port_t *mock_port(const char *name) {
+    for (size_t i = 0; i < n_ports; i++)
+        if (strcmp(ports[i].name, name) == 0) return &ports[i];
+
+    return NULL;
+}
+
+float *mock_audio(jack_port_t *port) {
+    return port->audio;
+}
+
+int mock_midi_push(jack_port_t *port, jack_nframes_t frame, const uint8_t *data, size_t len) {
+    return jack_midi_event_write(&port->midi_buf, frame, data, len);
+}
+
+void mock_cycle(void) {
+    for (size_t i = 0; i < MOCK_CLIENTS; i++)
+        if (clients[i].active && clients[i].process)
+            clients[i].process(period, clients[i].process_arg);
+
+    for (size_t i = 0; i < n_ports; i++)
+        if (ports[i].midi && (ports[i].flags & JackPortIsInput))
+            jack_midi_clear_buffer(&ports[i].midi_buf);
+
+    frames += period;
+}
+
+//
+// clients
+//
+
+jack_client_t *jack_client_open(const char *client_name, jack_options_t options,
+                                jack_status_t *status, ...) {
+    (void)options;
+
+    for (size_t i = 0; i < MOCK_CLIENTS; i++) {
+        if (clients[i].open) continue;
+
+        memset(&clients[i], 0, sizeof(clients[i]));
+        snprintf(clients[i].name, sizeof(clients[i].name), "%s", client_name);
+        clients[i].open = true;
+
+        if (status) *status = 0;
+        return &clients[i];
+    }
+
+    if (status) *status = JackFailure;
+    return NULL;
+}
+
+int jack_client_close(jack_client_t *client) {
+    client->open = false;
+    client->active = false;
+
+    // ports go with their client; later ones shift down
+    size_t kept = 0;
+    for (size_t i = 0; i < n_ports; i++)
+        if (ports[i].client != client) memmove(&ports[kept++], &ports[i], sizeof(ports[i]));
+    n_ports = kept;
+
+    return 0;
+}
+
+int jack_activate(jack_client_t *client) {
+    client->active = true;
+    return 0;
+}
+
+int jack_deactivate(jack_client_t *client) {
+    client->active = false;
+    return 0;
+}
+
+int jack_set_process_callback(jack_client_t *client, JackProcessCallback process_callback,
+                              void *arg) {
+    client->process = process_callback;
+    client->process_arg = arg;
+    return 0;
+}
+
+int jack_set_freewheel_callback(jack_client_t *client, JackFreewheelCallback freewheel_callback,
+                                void *arg) {
+    client->freewheel = freewheel_callback;
+    client->freewheel_arg = arg;
+    return 0;
+}
+
+// like JACK, tells every client; cycles are run by mock_cycle() as fast as ever regardless
+int jack_set_freewheel(jack_client_t *client, int onoff) {
+    (void)client;
+
+    for (size_t i = 0; i < MOCK_CLIENTS; i++)
+        if (clients[i].open && clients[i].freewheel)
+            clients[i].freewheel(onoff, clients[i].freewheel_arg);
+
+    return 0;
+}
+
+// callbacks the mock never has reason to call
+int jack_set_sample_rate_callback(jack_client_t *client, JackSampleRateCallback srate_callback,
+                                  void *arg) {
+    (void)client, (void)srate_callback, (void)arg;
+    return 0;
+}
+
+int jack_set_xrun_callback(jack_client_t *client, JackXRunCallback xrun_callback, void *arg) {
+    (void)client, (void)xrun_callback, (void)arg;
+    return 0;
+}
+
+void jack_set_error_function(void (*func)(const char *)) {
+    (void)func;
+}
+
+void jack_set_info_function(void (*func)(const char *)) {
+    (void)func;
+}
+
+//
+// timing
+//
+
+jack_nframes_t jack_get_sample_rate(jack_client_t *client) {
+    (void)client;
+    return srate;
+}
+
+jack_nframes_t jack_get_buffer_size(jack_client_t *client) {
+    (void)client;
+    return period;
+}
+
+int jack_set_buffer_size(jack_client_t *client, jack_nframes_t nframes) {
+    (void)client;
+
+    if (nframes == 0 || nframes > MOCK_MAX_FRAMES) return -1;
+
+    period = nframes;
+    return 0;
+}
+
+jack_nframes_t jack_last_frame_time(const jack_client_t *client) {
+    (void)client;
+    return frames;
+}
+
+int jack_get_cycle_times(const jack_client_t *client, jack_nframes_t *current_frames,
+                         jack_time_t *current_usecs, jack_time_t *next_usecs,
+                         float *period_usecs) {
+    (void)client;
+
+    *current_frames = frames;
+    *current_usecs = (jack_time_t)frames * 1000000 / srate;
+    *next_usecs = (jack_time_t)(frames + period) * 1000000 / srate;
+    *period_usecs = (float)period * 1000000.f / srate;
+
+    return 0;
+}
+
+//
+// ports
+//
+
+jack_port_t *jack_port_register(jack_client_t *client, const char *port_name,
+                                const char *port_type, unsigned long flags,
+                                unsigned long buffer_size) {
+    (void)buffer_size;
+
+    if (n_ports == MOCK_PORTS) return NULL;
+
+    jack_port_t *port = &ports[n_ports++];
+    memset(port, 0, sizeof(*port));
+
+    port->client = client;
+    port->flags = flags;
+    port->midi = strcmp(port_type, JACK_DEFAULT_MIDI_TYPE) == 0;
+    snprintf(port->name, sizeof(port->name), "%s:%s", client->name, port_name);
+
+    return port;
+}
+
+void *jack_port_get_buffer(jack_port_t *port, jack_nframes_t nframes) {
+    (void)nframes;
+
+    if (port->midi) return &port->midi_buf;
+    return port->audio;
+}
+
+const char *jack_port_name(const jack_port_t *port) {
+    return port->name;
+}
+
+// patterns are matched as substrings rather than regular expressions
+const char **jack_get_ports(jack_client_t *client, const char *port_name_pattern,
+                            const char *type_name_pattern, unsigned long flags) {
+    (void)client;
+
+    const char **names = calloc(MOCK_PORTS + 1, sizeof(*names));
+    size_t len = 0;
+
+    if (!names) return NULL;
+
+    for (size_t i = 0; i < n_ports; i++) {
+        const char *type = ports[i].midi ? JACK_DEFAULT_MIDI_TYPE : JACK_DEFAULT_AUDIO_TYPE;
+
+        if (port_name_pattern && !strstr(ports[i].name, port_name_pattern)) continue;
+        if (type_name_pattern && *type_name_pattern && strcmp(type, type_name_pattern) != 0)
+            continue;
+        if ((ports[i].flags & flags) != flags) continue;
+
+        names[len++] = ports[i].name;
+    }
+
+    if (len == 0) {
+        free(names);
+        return NULL;
+    }
+
+    return names;
+}
+
+int jack_connect(jack_client_t *client, const char *source_port, const char *destination_port) {
+    (void)client, (void)source_port, (void)destination_port;
+    return 0;
+}
+
+void jack_free(void *ptr) {
+    free(ptr);
+}
+
+//
+// MIDI buffers
+//
+
+uint32_t jack_midi_get_event_count(void *port_buffer) {
+    return ((midi_buf_t *)port_buffer)->count;
+}
+
+int jack_midi_event_get(jack_midi_event_t *event, void *port_buffer, uint32_t event_index) {
+    midi_buf_t *buf = (midi_buf_t *)port_buffer;
+
+    if (event_index >= buf->count) return -1;
+
+    *event = buf->evs[event_index];
+    return 0;
+}
+
+void jack_midi_clear_buffer(void *port_buffer) {
+    midi_buf_t *buf = (midi_buf_t *)port_buffer;
+
+    buf->count = 0;
+    buf->used = 0;
+}
+
+jack_midi_data_t *jack_midi_event_reserve(void *port_buffer, jack_nframes_t time,
+                                          size_t data_size) {
+    midi_buf_t *buf = (midi_buf_t *)port_buffer;
+
+    // like JACK, events have to be written in order
+    if (buf->count == MOCK_MIDI_EVENTS || buf->used + data_size > MOCK_MIDI_BYTES ||
+        time >= period || (buf->count > 0 && time < buf->evs[buf->count - 1].time))
+        return NULL;
+
+    jack_midi_event_t *ev = &buf->evs[buf->count++];
+    ev->time = time;
+    ev->size = data_size;
+    ev->buffer = buf->data + buf->used;
+
+    buf->used += data_size;
+
+    return ev->buffer;
+}
+
+int jack_midi_event_write(void *port_buffer, jack_nframes_t time, const jack_midi_data_t *data,
+                          size_t data_size) {
+    jack_midi_data_t *dst = jack_midi_event_reserve(port_buffer, time, data_size);
+    if (!dst) return -1;
+
+    memcpy(dst, data, data_size);
+    return 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// mockjack.h: in-memory stand-in for a JACK server
+//
+// mockjack.c implements the parts of the JACK API that jbase uses on top of plain buffers, so that
+// the whole process callback can be driven (and timed) without a server. clients are run one
+// cycle at a time by mock_cycle(); MIDI is fed to input ports directly, and connections are
+// accepted but not followed
+//
+
+#pragma once
+
+#include <jack/jack.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MOCK_MAX_FRAMES 8192 // largest period size
+
+void mock_init(jack_nframes_t srate, jack_nframes_t nframes); // reset clock and set period size
+jack_port_t *mock_port(const char *name);                      // find port by full name ("client:port")
+float *mock_audio(jack_port_t *port);                          // audio buffer of a port
+
+// queue raw MIDI bytes on an input port for the next cycle, returning 0 on success
+int mock_midi_push(jack_port_t *port, jack_nframes_t frame, const uint8_t *data, size_t len);
+
+void mock_cycle(void); // run a process cycle of every active client, then clear MIDI inputs
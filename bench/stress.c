@@ -0,0 +1,525 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// stress.c: capacity finder
+//
+// `bench stress` finds how much load a patch takes before the process callback no longer fits in
+// a chosen share of its period: the most notes held at once, the largest chord struck every cycle,
+// and the most controller events per cycle. each is ramped up in doubling steps until a step's p99
+// cycle time goes over the limit, then narrowed down by bisection. every step runs a fresh engine
+// and client against mockjack.c, so that it doesn't inherit the voices of the step before
+//
+
+#include <bench.h>
+#include <mockjack.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STEP_SETTLE 32   // cycles run before a step is timed, once its held notes are struck
+#define STRIKE_BATCH 64  // most held notes struck in a cycle while a step settles
+#define SLOT_BASE 36     // note of the first slot on each channel
+#define SLOT_STRIDE 47   // notes between slots on a channel (coprime with JB_VOICES, so every note
+                         // gets used)
+
+// chain lengths stressed when no patch is given
+static const size_t ladder[] = {1, 2, 4, 8, JB_CHAIN_MAX};
+
+typedef enum {
+    DIM_POLY,  // notes held, one retriggered each cycle
+    DIM_CHORD, // notes struck together every cycle, releasing the last chord
+    DIM_CCS,   // controller events per cycle
+    DIM_MAX
+} dim_t;
+
+static const char *dim_str[DIM_MAX] = {
+    [DIM_POLY] = "polyphony",
+    [DIM_CHORD] = "chord",
+    [DIM_CCS] = "ccs/cycle",
+};
+
+// load put on an engine for a step
+typedef struct {
+    size_t dims[DIM_MAX];
+} load_t;
+
+// a patch to stress
+typedef struct {
+    char *name;
+    jb_def_t *defs;
+    bool owns_defs;         // definitions were read or generated (and are freed with the subject)
+} subject_t;
+
+typedef struct {
+    subject_t *subjects;
+    size_t cycles;          // cycles timed per step
+    jack_nframes_t frames;  // period size
+    jack_nframes_t srate;   // sample rate
+    double limit;           // share of the period a step's p99 cycle time has to stay under
+    size_t poly;            // notes held while flooding controllers
+    size_t gate;            // notes every patch has to hold within the limit (0 for no gate)
+} stress_opts_t;
+
+// where load is sent: channels of the first MIDI input that play something
+typedef struct {
+    uint8_t chans[JB_PORT_CHANS];
+    size_t n_chans;
+    uint8_t cc;             // controller flooded
+} target_t;
+
+// what a step measured
+typedef struct {
+    uint64_t p99_ns;
+    uint64_t max_ns;
+    double voices;          // mean voices sounding
+    bool dropped;           // MIDI events were dropped
+} step_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double budget_ns(const stress_opts_t *opts) {
+    return (double)opts->frames * 1e9 / opts->srate;
+}
+
+static int ns_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static jb_res_t target_find(const jb_patch_t *pt, target_t *tg) {
+    tg->n_chans = 0;
+
+    for (uint8_t c = 0; c < JB_PORT_CHANS; c++)
+        if (pt->chans[c].len > 0) tg->chans[tg->n_chans++] = c;
+
+    if (tg->n_chans == 0) return JB_ERR(JB_ERR_USER, "patch plays nothing on the first MIDI input");
+
+    // controllers go to the lowest one routed on the first channel (volume always is)
+    tg->cc = JB_VOL_CC;
+    for (size_t cc = 0; cc < JB_CCS; cc++) {
+        if (pt->chans[tg->chans[0]].ccs[cc] != JB_NONE) {
+            tg->cc = cc;
+            break;
+        }
+    }
+
+    return JB_OK_VAL;
+}
+
+// notes are played on slots, spread across the keyboard and dealt out between the channels
+static void slot_push(const target_t *tg, jack_port_t *in, uint8_t kind, size_t slot) {
+    uint8_t chan = tg->chans[slot % tg->n_chans];
+    uint8_t note = (SLOT_BASE + slot / tg->n_chans * SLOT_STRIDE) % JB_VOICES;
+
+    mock_midi_push(in, 0, (uint8_t[]){kind | chan, note, kind == JB_NOTE_ON ? 100 : 0}, 3);
+}
+
+static void load_cycle(const target_t *tg, load_t load, size_t cycle, jack_nframes_t frames,
+                       jack_port_t *in) {
+    size_t poly = load.dims[DIM_POLY], chord = load.dims[DIM_CHORD], ccs = load.dims[DIM_CCS];
+
+    // held notes are struck a batch at a time, then retriggered in turn
+    size_t struck = cycle * STRIKE_BATCH;
+    if (struck < poly) {
+        for (size_t i = struck; i < JB_MIN(struck + STRIKE_BATCH, poly); i++)
+            slot_push(tg, in, JB_NOTE_ON, i);
+    } else if (poly > 0) {
+        slot_push(tg, in, JB_NOTE_ON, cycle % poly);
+    }
+
+    // chords take the slots after the held notes
+    size_t room = tg->n_chans * JB_VOICES - poly;
+    for (size_t i = 0; i < chord && cycle > 0; i++)
+        slot_push(tg, in, JB_NOTE_OFF, poly + ((cycle - 1) * chord + i) % room);
+    for (size_t i = 0; i < chord; i++)
+        slot_push(tg, in, JB_NOTE_ON, poly + (cycle * chord + i) % room);
+
+    // controllers sweep up and down, spread evenly across the cycle after the notes
+    for (size_t i = 0; i < ccs; i++) {
+        size_t t = (cycle * ccs + i) % 254;
+        uint8_t val = t < 127 ? t : 254 - t;
+
+        mock_midi_push(in, i * frames / ccs, (uint8_t[]){JB_CTRL | tg->chans[0], tg->cc, val}, 3);
+    }
+}
+
+static jb_res_t step_run(const stress_opts_t *opts, const jb_patch_t *pt, const target_t *tg,
+                         load_t load, step_t *step) {
+    uint64_t *times = calloc(opts->cycles, sizeof(*times));
+    if (!times) return JB_ERR(JB_ERR_OOM, "failed to allocate step");
+
+    mock_init(opts->srate, opts->frames);
+
+    // enough voices for every note on every instrument played, so the pool never limits a step
+    jb_engine_t eng;
+    jb_res_t res = jb_engine_init(&eng, pt, tg->n_chans * JB_CHAN_INSTS * JB_VOICES);
+    if (res JB_IS_ERR) {
+        free(times);
+        return res;
+    }
+
+    jb_client_t cl;
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = &eng,
+                              .midi_batch_cb = jb_engine_midi_batch,
+                              .audio_cb = jb_engine_audio,
+                              .prepare_cb = jb_engine_prepare};
+
+    res = jb_client_init(&cl, cfg);
+    if (res JB_IS_ERR) {
+        jb_engine_free(&eng);
+        free(times);
+        return res;
+    }
+
+    res = jb_client_prepare(&cl);
+    if (res JB_IS_OK) res = jb_client_activate(&cl);
+
+    if (res JB_IS_OK) {
+        jack_port_t *in = mock_port("midid:midi_in");
+        size_t settle = (load.dims[DIM_POLY] + STRIKE_BATCH - 1) / STRIKE_BATCH + STEP_SETTLE;
+        double voices = 0.0;
+
+        for (size_t i = 0; i < settle + opts->cycles; i++) {
+            load_cycle(tg, load, i, opts->frames, in);
+
+            uint64_t start = now_ns();
+            mock_cycle();
+            uint64_t ns = now_ns() - start;
+
+            if (i < settle) continue;
+
+            times[i - settle] = ns;
+            voices += eng.voices;
+        }
+
+        qsort(times, opts->cycles, sizeof(*times), ns_cmp);
+
+        step->p99_ns = times[(opts->cycles * 99 + 99) / 100 - 1];
+        step->max_ns = times[opts->cycles - 1];
+        step->voices = voices / opts->cycles;
+        step->dropped = atomic_load(&cl.metrics.midi_drops) > 0;
+    }
+
+    jb_client_close(&cl);
+    jb_engine_free(&eng);
+    free(times);
+
+    return res;
+}
+
+static bool step_ok(const stress_opts_t *opts, const step_t *step) {
+    return !step->dropped && step->p99_ns <= opts->limit * budget_ns(opts);
+}
+
+// find the largest value of one dimension of `load`, up to `cap`, whose step stays within the
+// limit (0 if none do), and the step it was found with
+static jb_res_t search(const stress_opts_t *opts, const jb_patch_t *pt, const target_t *tg,
+                       load_t load, dim_t dim, size_t cap, size_t *best, step_t *at) {
+    // `lo` is the largest value seen within the limit, and `hi` the smallest over it
+    size_t lo = 0, hi = cap + 1;
+    size_t val = 1;
+
+    while (hi - lo > 1) {
+        step_t step;
+        load.dims[dim] = val;
+        JB_TRY(step_run(opts, pt, tg, load, &step));
+
+        // a step over the limit is run again before it counts, in case it was preempted
+        if (!step_ok(opts, &step)) JB_TRY(step_run(opts, pt, tg, load, &step));
+
+        bool ok = step_ok(opts, &step);
+        printf("  %-9s %5zu: p99 %8.2fus  max %8.2fus  %7.1f voices  %s\n",
+               dim_str[dim],
+               val,
+               step.p99_ns / 1e3,
+               step.max_ns / 1e3,
+               step.voices,
+               step.dropped ? "dropped events" : ok ? "ok" : "over");
+
+        if (ok) {
+            lo = val;
+            *at = step;
+        } else {
+            hi = val;
+        }
+
+        // double until a step goes over, then bisect
+        val = hi > cap ? JB_MIN(val * 2, cap) : lo + (hi - lo) / 2;
+    }
+
+    *best = lo;
+
+    return JB_OK_VAL;
+}
+
+typedef struct {
+    size_t best[DIM_MAX];
+    size_t cap[DIM_MAX];
+    step_t at[DIM_MAX];
+} capacity_t;
+
+static jb_res_t subject_run(const stress_opts_t *opts, const subject_t *sub, capacity_t *cap) {
+    jb_patch_t pt;
+    jb_patch_init(&pt);
+
+    target_t tg;
+    jb_res_t res = jb_patch_compile(&pt, sub->defs, jb_buf_len(sub->defs));
+    if (res JB_IS_OK) res = target_find(&pt, &tg);
+
+    if (res JB_IS_ERR) {
+        jb_patch_free(&pt);
+        return res;
+    }
+
+    printf("%s:\n", sub->name);
+
+    // every event of a cycle has to fit in what the client decodes; chords need a note off and on
+    cap->cap[DIM_POLY] = tg.n_chans * JB_VOICES;
+    cap->cap[DIM_CHORD] = JB_MIN(tg.n_chans * JB_VOICES, JB_MIDI_EVENTS / 2);
+    cap->cap[DIM_CCS] = JB_MIDI_EVENTS - STRIKE_BATCH;
+
+    load_t load = {0};
+
+    for (dim_t d = 0; d < DIM_MAX && res JB_IS_OK; d++) {
+        // controllers are flooded while notes are held, as they would be when played, but well
+        // short of the most the patch can hold, which would leave no room for them
+        if (d == DIM_CCS) load.dims[DIM_POLY] = JB_MIN(opts->poly, cap->best[DIM_POLY] / 2);
+
+        memset(&cap->at[d], 0, sizeof(cap->at[d]));
+        res = search(opts, &pt, &tg, load, d, cap->cap[d], &cap->best[d], &cap->at[d]);
+    }
+
+    jb_patch_free(&pt);
+
+    return res;
+}
+
+static void report(const stress_opts_t *opts, const capacity_t *caps) {
+    printf("# %u frames at %u Hz; %zu cycle steps, p99 within %.0f%% of %.2fus\n",
+           opts->frames,
+           opts->srate,
+           opts->cycles,
+           opts->limit * 100,
+           budget_ns(opts) / 1e3);
+    printf("%-24s %10s %8s %8s %10s\n", "patch", "polyphony", "voices", "chord", "ccs/cycle");
+
+    for (size_t i = 0; i < jb_buf_len(opts->subjects); i++) {
+        const capacity_t *cap = &caps[i];
+        char cols[DIM_MAX][32];
+
+        // a value at its cap is as far as a step could go, rather than where it hit the limit
+        for (size_t d = 0; d < DIM_MAX; d++)
+            snprintf(cols[d],
+                     sizeof(cols[d]),
+                     "%zu%s",
+                     cap->best[d],
+                     cap->best[d] == cap->cap[d] ? "+" : "");
+
+        printf("%-24s %10s %8.1f %8s %10s\n",
+               opts->subjects[i].name,
+               cols[DIM_POLY],
+               cap->at[DIM_POLY].voices,
+               cols[DIM_CHORD],
+               cols[DIM_CCS]);
+    }
+}
+
+// patch of a single instrument, chaining `len` oscillators by FM
+static jb_res_t ladder_subject(size_t len, subject_t *sub) {
+    char chain[16 + 4 * JB_CHAIN_MAX] = "stack pad: o";
+    for (size_t i = 1; i < len; i++) {
+        size_t n = strlen(chain);
+        snprintf(chain + n, sizeof(chain) - n, " %c o", jb_mod_char[JB_MOD_FM]);
+    }
+
+    const jb_def_t defs[] = {
+        {JB_DEF_ENV, "pad: 0.01s1.0 -> 0.1s0.7 -> SUST -> 0.2s0.0"},
+        {JB_DEF_OSC, "o: wave=sin vol=1.0"},
+        {JB_DEF_INST, chain},
+        {JB_DEF_CHAN, "0: stack"},
+        {JB_DEF_ROUTE, "0: 1 o.bias 0.0 0.8"},
+    };
+
+    char name[32];
+    snprintf(name, sizeof(name), "chain-%zu", len);
+
+    *sub = (subject_t){.name = strdup(name), .owns_defs = true};
+    if (!sub->name) return JB_ERR(JB_ERR_OOM, "failed to allocate patch");
+
+    for (size_t i = 0; i < sizeof(defs) / sizeof(*defs); i++) {
+        char *src = strdup(defs[i].src);
+        if (!src) return JB_ERR(JB_ERR_OOM, "failed to allocate patch");
+
+        jb_buf_push(sub->defs, ((jb_def_t){.kind = defs[i].kind, .src = src}));
+    }
+
+    return JB_OK_VAL;
+}
+
+static void subject_free(subject_t *sub) {
+    if (sub->owns_defs) {
+        jb_defs_free(sub->defs);
+        free(sub->name);
+    } else {
+        jb_buf_free(sub->defs);
+    }
+}
+
+static jb_res_t stress_run(stress_opts_t *opts, capacity_t **caps) {
+    if (jb_buf_len(opts->subjects) == 0) {
+        for (size_t i = 0; i < sizeof(ladder) / sizeof(*ladder); i++) {
+            subject_t sub;
+            jb_res_t res = ladder_subject(ladder[i], &sub);
+            jb_buf_push(opts->subjects, sub);
+
+            JB_TRY(res);
+        }
+    }
+
+    *caps = calloc(jb_buf_len(opts->subjects), sizeof(**caps));
+    if (!*caps) return JB_ERR(JB_ERR_OOM, "failed to allocate results");
+
+    for (size_t i = 0; i < jb_buf_len(opts->subjects); i++) {
+        jb_res_t res = subject_run(opts, &opts->subjects[i], &(*caps)[i]);
+
+        if (res JB_IS_ERR) {
+            jb_error("failed to stress '%s'", opts->subjects[i].name);
+            return res;
+        }
+    }
+
+    return JB_OK_VAL;
+}
+
+int stress_main(int argc, char **argv) {
+    stress_opts_t opts = {.cycles = 500,
+                          .frames = 256,
+                          .srate = 48000,
+                          .limit = 0.5,
+                          .poly = 16};
+
+    capacity_t *caps = NULL;
+    int status = 0;
+
+    // definitions given inline make up a patch of their own
+    size_t inline_idx = JB_NONE;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:f:r:L:n:g:p:I:E:O:C:R:")) != -1) {
+        switch (c) {
+            case 'c':  // cycles timed per step
+                opts.cycles = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'f':  // period size
+                opts.frames = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':  // sample rate
+                opts.srate = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'L':  // share of the period to stay within
+                opts.limit = strtod(optarg, NULL);
+                break;
+
+            case 'n':  // notes held while flooding controllers
+                opts.poly = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'g':  // fail unless every patch holds this many notes
+                opts.gate = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'p': {  // stress the patch in a file of definitions
+                subject_t sub = {.name = strdup(optarg), .owns_defs = true};
+                jb_res_t res = sub.name ? jb_defs_read(optarg, &sub.defs)
+                                        : JB_ERR(JB_ERR_OOM, "failed to read '%s'", optarg);
+                jb_buf_push(opts.subjects, sub);
+
+                if (res JB_IS_ERR) {
+                    jb_report_result(res);
+                    status = 1;
+                    goto done;
+                }
+            } break;
+
+            case 'I':  // patch to stress (notes are played on the first input's channels)
+            case 'E':
+            case 'O':
+            case 'C':
+            case 'R':
+                if (inline_idx == JB_NONE) {
+                    inline_idx = jb_buf_len(opts.subjects);
+                    jb_buf_push(opts.subjects, ((subject_t){.name = "inline"}));
+                }
+
+                jb_buf_push(opts.subjects[inline_idx].defs, ((jb_def_t){.kind = c, .src = optarg}));
+                break;
+
+            default:
+                status = 1;
+                goto done;
+        }
+    }
+
+    if (opts.cycles == 0 || opts.srate == 0 || opts.frames == 0 || opts.frames > MOCK_MAX_FRAMES ||
+        opts.limit <= 0.0) {
+        jb_error("cycles, limit, sample rate and period size (up to %d) must be positive",
+                 MOCK_MAX_FRAMES);
+        status = 1;
+        goto done;
+    }
+
+    jb_res_t res = stress_run(&opts, &caps);
+
+    if (res JB_IS_ERR) {
+        jb_report_result(res);
+        status = 1;
+        goto done;
+    }
+
+    report(&opts, caps);
+
+    for (size_t i = 0; i < jb_buf_len(opts.subjects); i++) {
+        if (caps[i].best[DIM_POLY] < opts.gate) {
+            printf("error: %s holds %zu notes, under the %zu required\n",
+                   opts.subjects[i].name,
+                   caps[i].best[DIM_POLY],
+                   opts.gate);
+            status = 1;
+        }
+    }
+
+done:
+    free(caps);
+    for (size_t i = 0; i < jb_buf_len(opts.subjects); i++) subject_free(&opts.subjects[i]);
+    jb_buf_free(opts.subjects);
+
+    return status;
+}
@@ -23,6 +23,9 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 #include "jack/types.h"
 
 //
@@ -61,6 +64,8 @@ typedef enum {
     JB_ERR_JACK,  // JACK operation failed
     JB_ERR_LIBC,  // libc operation failed
     JB_ERR_OOM,   // out of memory (currently unused)
+    JB_ERR_PARSE, // failed to parse patch definition
+    JB_ERR_IMAGE, // patch image missing, stale or malformed
     JB_ERR_USER   // user-defined error info, for users of library
 } jb_err_t;
 
@@ -115,6 +120,13 @@ typedef struct {
 //
 
 #define JB_MAX(x, y) ((x) >= (y) ? (x) : (y))
+#define JB_MIN(x, y) ((x) <= (y) ? (x) : (y))
+
+// initial state for jb_hash
+#define JB_HASH_INIT 0xcbf29ce484222325ull
+
+// 64-bit FNV-1a hash of a buffer, continuing on from `hash`
+uint64_t jb_hash(uint64_t hash, const void *buf, size_t len);
 
 typedef struct {
 	size_t len;
@@ -138,6 +150,229 @@ typedef struct {
 
 void *jb_buf_grow(const void *buf, size_t new_len, size_t elem_size);
 
+//
+// memory arenas: arena.c
+//
+
+#define JB_KiB(n) ((size_t)(n) * 1024)
+#define JB_MiB(n) (JB_KiB(n) * 1024)
+#define JB_GiB(n) (JB_MiB(n) * 1024)
+
+enum {
+    JB_ARENA_HUGE = 1 << 0 // back arena with transparent huge pages where possible
+};
+
+// bump allocator over a reserved range of address space. pages are only committed as allocations
+// reach them, so an arena can reserve far more than it will ever use
+typedef struct {
+    uint8_t *base;    // start of reserved range
+    size_t reserved;  // size of reserved range
+    size_t committed; // bytes committed from start of range
+    size_t dirty;     // high water mark of allocations (memory above this is still zeroed)
+    size_t pos;       // offset of next allocation
+    size_t gran;      // granularity pages are committed in
+    int flags;        // JB_ARENA_* flags
+} jb_arena_t;
+
+// position in an arena to reset back to
+typedef size_t jb_arena_mark_t;
+
+// a nested scope of allocations, freed all at once when the scope ends
+typedef struct {
+    jb_arena_t *arena;
+    jb_arena_mark_t mark;
+} jb_arena_scope_t;
+
+jb_res_t jb_arena_init(jb_arena_t *a, size_t reserve, int flags); // reserve address space for arena
+void jb_arena_free(jb_arena_t *a);                                // release arena's address space
+
+// allocate zeroed memory, returning NULL if the arena's reservation is exhausted
+void *jb_arena_alloc(jb_arena_t *a, size_t size, size_t align);
+
+// allocate `n` zeroed values of type `T`
+#define JB_ARENA_NEW(a, T, n) ((T *)jb_arena_alloc((a), sizeof(T) * (n), _Alignof(T)))
+
+jb_arena_mark_t jb_arena_mark(jb_arena_t *a);            // get current position of arena
+void jb_arena_reset_to(jb_arena_t *a, jb_arena_mark_t m); // free everything allocated after mark
+void jb_arena_reset(jb_arena_t *a);                      // free everything in arena
+void jb_arena_decommit(jb_arena_t *a);                   // return unused committed pages to the OS
+
+jb_arena_scope_t jb_arena_scope_begin(jb_arena_t *a); // begin a nested scope
+void jb_arena_scope_end(jb_arena_scope_t scope);      // free everything allocated in scope
+
+jb_res_t jb_arena_lock(jb_arena_t *a);               // fault in and lock arena's committed memory
+jb_res_t jb_mem_lock(const void *ptr, size_t len);   // fault in and lock a range of memory into RAM
+
+//
+// object pools: pool.c
+//
+
+#define JB_CACHE_LINE 64 // size of a cache line
+#define JB_POOL_CACHE 32 // max free slots held by a pool cache
+
+// fixed-size pool of preallocated slots. allocating and freeing are O(1) and lock-free, so pools
+// can be used from realtime threads. the shared free list is a tagged index, so freeing from one
+// thread while allocating from another is safe
+typedef struct {
+    uint8_t *slots;          // slot storage
+    size_t size;             // size of each slot (a multiple of JB_CACHE_LINE)
+    size_t cap;              // number of slots
+    _Atomic uint64_t head;   // free list: index of first free slot (low 32 bits) and tag
+} jb_pool_t;
+
+// per-thread cache of free slots, letting a thread allocate and free without touching the shared
+// free list most of the time. a cache must only be used from one thread at a time
+typedef struct {
+    jb_pool_t *pool;
+    uint32_t len;
+    uint32_t free[JB_POOL_CACHE];
+} jb_pool_cache_t;
+
+// allocate pool storage for `cap` slots of `size` bytes from an arena
+jb_res_t jb_pool_init(jb_pool_t *pool, jb_arena_t *arena, size_t size, size_t cap);
+
+void *jb_pool_alloc(jb_pool_t *pool);                 // take a slot (NULL if exhausted); not zeroed
+void jb_pool_free(jb_pool_t *pool, void *ptr);        // return a slot
+uint32_t jb_pool_index(jb_pool_t *pool, void *ptr);   // index of slot in pool
+void *jb_pool_at(jb_pool_t *pool, uint32_t idx);      // slot at index
+
+void jb_pool_cache_init(jb_pool_cache_t *cache, jb_pool_t *pool);
+void *jb_pool_cache_alloc(jb_pool_cache_t *cache);          // take a slot, via cache
+void jb_pool_cache_free(jb_pool_cache_t *cache, void *ptr); // return a slot, via cache
+void jb_pool_cache_flush(jb_pool_cache_t *cache);           // return all cached slots to pool
+
+// typed wrappers
+#define JB_POOL_INIT(pool, arena, T, cap) jb_pool_init((pool), (arena), sizeof(T), (cap))
+#define JB_POOL_ALLOC(pool, T) ((T *)jb_pool_alloc((pool)))
+#define JB_POOL_CACHE_ALLOC(cache, T) ((T *)jb_pool_cache_alloc((cache)))
+
+//
+// zone profiler: prof.c
+//
+
+#define JB_PROF_EVENTS 16384 // zones buffered per thread between dumps (a power of two)
+#define JB_PROF_THREADS 8    // threads that can record zones
+
+// a zone being timed
+typedef struct {
+    const char *name; // name of zone (must outlive the profiler, e.g. a string literal)
+    uint32_t arg;     // argument shown with the zone
+    uint64_t start;   // timestamp zone started at
+} jb_zone_t;
+
+// cheap timestamp, in an unspecified unit (calibrated when profiling starts)
+static inline uint64_t jb_prof_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// record a zone into the calling thread's ring (RT-safe; dropped if the ring is full, or the
+// profiler isn't running)
+void jb_prof_record(const char *name, uint32_t arg, uint64_t start, uint64_t end);
+
+static inline void jb_zone_end(jb_zone_t *zone) {
+    jb_prof_record(zone->name, zone->arg, zone->start, jb_prof_ticks());
+}
+
+jb_res_t jb_prof_start(const char *path); // start dumping zones to a Chrome trace at `path`
+void jb_prof_stop(void);                  // dump remaining zones and finish trace
+
+#define JB_ZONE_CAT(a, b) a##b
+#define JB_ZONE_VAR(line) JB_ZONE_CAT(jb_zone_, line)
+
+// time from here to the end of the enclosing scope as a zone, with an argument. only built with
+// JB_PROFILE defined (`make PROFILE=1`); otherwise zones compile to nothing
+#ifdef JB_PROFILE
+#define JB_ZONE_ARG(name, arg)                                                \
+    jb_zone_t JB_ZONE_VAR(__LINE__) __attribute__((cleanup(jb_zone_end))) = { \
+        (name), (arg), jb_prof_ticks()}
+#else
+#define JB_ZONE_ARG(name, arg) (void)0
+#endif
+
+#define JB_ZONE(name) JB_ZONE_ARG((name), 0)
+
+//
+// realtime safety audit: rtcheck.c
+//
+
+#define JB_RT_SITES 256 // distinct call sites reported, at most
+
+// built with JB_RTCHECK defined (`make RTCHECK=1`), calls that may allocate, block or take a lock
+// (malloc and friends, mutexes and condition variables, stdio, sleeps, read/write, mmap, localtime,
+// rand) are interposed, and any made by a thread between jb_rt_enter() and jb_rt_leave() is
+// reported with a backtrace, once per call site. the process callback marks itself (unless JACK is
+// freewheeling), as should anything else rendering on its behalf. otherwise these do nothing
+void jb_rt_enter(void);       // mark the calling thread as realtime (calls nest)
+void jb_rt_leave(void);       // end the innermost jb_rt_enter()
+size_t jb_rt_violations(void); // call sites reported so far
+
+//
+// local sockets: sock.c
+//
+
+// a listening socket
+typedef struct {
+    int fd;         // -1 if closed
+    char path[108]; // path of UNIX socket, removed on close (empty for TCP)
+} jb_sock_t;
+
+// listen on a UNIX socket if `addr` is a path (contains '/'), or otherwise on localhost TCP port
+// `addr`
+jb_res_t jb_sock_listen(jb_sock_t *sock, const char *addr);
+void jb_sock_wake(jb_sock_t *sock);  // wake a thread blocked accepting on socket, failing accept()
+void jb_sock_close(jb_sock_t *sock);
+
+//
+// metrics: metrics.c
+//
+
+#define JB_METRIC_BUCKETS 16 // callback time histogram buckets, doubling from 1μs (last is +Inf)
+
+// statistics kept by the audio thread. they're only updated with relaxed atomic adds and stores,
+// so that another thread can read them at any time without the audio thread ever waiting
+typedef struct {
+    _Atomic uint64_t cycles;       // process cycles run
+    _Atomic uint64_t xruns;        // xruns reported by JACK
+    _Atomic uint64_t midi_events;  // MIDI events decoded
+    _Atomic uint64_t midi_drops;   // MIDI events dropped for want of room
+    _Atomic uint64_t nan_mutes;    // cycles muted for rendering NaNs
+    _Atomic uint64_t cmd_drops;    // control commands dropped
+    _Atomic uint64_t underruns;    // sample streams that ran dry, or couldn't start (no stream free)
+    _Atomic uint64_t voice_drops;  // notes that couldn't start (no voice free)
+    _Atomic uint64_t shard_misses; // cycles a worker wasn't done in time for (front ends only)
+    _Atomic uint64_t voices;       // voices sounding at end of last cycle
+    _Atomic uint64_t freewheel;    // whether JACK is freewheeling (cycles aren't timed meanwhile)
+    _Atomic uint64_t period_ns;    // length of last cycle, i.e. the callback's time budget
+    _Atomic uint64_t time_ns;      // total time spent in callback
+    _Atomic uint64_t time_hist[JB_METRIC_BUCKETS]; // callback times (bucket i: up to 2^i μs)
+} jb_metrics_t;
+
+// thread serving metrics in Prometheus' text format
+typedef struct {
+    const jb_metrics_t *metrics;
+    const char *name;  // value of `client` label
+    jb_sock_t sock;    // listening socket (closed if not serving)
+    pthread_t thread;
+} jb_metrics_server_t;
+
+void jb_metrics_init(jb_metrics_t *m);
+void jb_metrics_time(jb_metrics_t *m, uint64_t ns); // record time spent in a callback
+
+// write metrics as Prometheus text to `buf`, returning the length (truncated to fit)
+size_t jb_metrics_format(const jb_metrics_t *m, const char *name, char *buf, size_t len);
+
+// serve metrics from a new thread, on a socket at `addr` (see jb_sock_listen). each connection is
+// answered with a HTTP response
+jb_res_t jb_metrics_serve(jb_metrics_server_t *srv, const jb_metrics_t *m, const char *name,
+                          const char *addr);
+void jb_metrics_stop(jb_metrics_server_t *srv); // stop serving and join thread
+
 // 
 // audio client 
 //
@@ -145,28 +380,73 @@ void *jb_buf_grow(const void *buf, size_t new_len, size_t elem_size);
 // individual audio sample
 typedef jack_default_audio_sample_t jb_sample_t;
 
+#define JB_OUTS 2  // audio outputs in a pair (left, right)
+#define JB_PAIRS 8 // max pairs of audio outputs
+
 // constants to access MIDI event params 
 enum {
     // note event
     JB_NOTE = 0,
     JB_VELOCITY = 1,
 
+    // polyphonic aftertouch (note is JB_NOTE)
+    JB_PRESSURE = 1,
+
     // control event
     JB_CONTROLLER = 0,
-    JB_VALUE = 1
+    JB_VALUE = 1,
+
+    // program change
+    JB_PROGRAM = 0,
+
+    // channel aftertouch
+    JB_CHAN_PRESSURE = 0,
+
+    // pitch bend (see JB_BEND_VALUE)
+    JB_BEND_LSB = 0,
+    JB_BEND_MSB = 1
 };
 
-typedef struct {
-    enum {
-        JB_NOTE_OFF = 0x80,
-        JB_NOTE_ON = 0x90,
-        JB_CTRL = 0xB0
-    } kind;          // MIDI event kind (first 4 bits of status byte)
+typedef enum {
+    JB_NOTE_OFF = 0x80,
+    JB_NOTE_ON = 0x90,
+    JB_POLY_TOUCH = 0xA0,
+    JB_CTRL = 0xB0,
+    JB_PROG_CHANGE = 0xC0,
+    JB_CHAN_TOUCH = 0xD0,
+    JB_PITCH_BEND = 0xE0
+} jb_midi_kind_t;
 
-    uint8_t chan;    // MIDI channel
-    uint8_t args[2]; // 2 argument bytes
+typedef struct {
+    uint32_t frame;  // frame within the cycle that the event arrived on
+    uint8_t kind;    // MIDI event kind (jb_midi_kind_t; first 4 bits of status byte)
+    uint8_t chan;    // logical channel (port * JB_PORT_CHANS + MIDI channel)
+    uint8_t args[2]; // argument bytes (unused ones are 0)
 } jb_midi_t;
 
+// signed pitch bend amount of a JB_PITCH_BEND event (-8192 -> 8191)
+#define JB_BEND_VALUE(ev) ((int)(((ev).args[JB_BEND_MSB] << 7) | (ev).args[JB_BEND_LSB]) - 8192)
+
+#define JB_MIDI_EVENTS 1024 // max MIDI events decoded per cycle
+#define JB_MIDI_PORTS 8      // max MIDI input ports
+#define JB_PORT_CHANS 16     // MIDI channels per port
+
+// MIDI byte stream decoder. running status carries over between calls, so one decoder should be
+// kept for each input
+typedef struct {
+    uint8_t status;  // current status byte (0 if there is none to run on)
+    uint8_t need;    // data bytes needed by status
+    uint8_t have;    // data bytes received so far
+    uint8_t data[2]; // data bytes received so far
+    bool sysex;      // inside a system exclusive message
+    uint8_t base;    // logical channel of the input's first MIDI channel
+} jb_midi_decoder_t;
+
+// decode raw MIDI bytes arriving on `frame` into up to `cap` events, returning the number decoded.
+// events past `cap` are added to `dropped`
+size_t jb_midi_decode(jb_midi_decoder_t *dec, uint32_t frame, const uint8_t *buf, size_t len,
+                      jb_midi_t *out, size_t cap, size_t *dropped);
+
 typedef struct {
     size_t srate;              // sample rate
     size_t cur_sample;         // current base sample (samples processed up to start of current cycle)
@@ -178,34 +458,69 @@ typedef struct {
 } jb_ctx_t;
 
 // MIDI event processing callback
-typedef void (*jb_midi_fn_t)(void *state, jb_midi_t ev);
-// audio buffer generating callback
-typedef void (*jb_audio_fn_t)(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t *buf);
+typedef void (*jb_midi_fn_t)(void *state, jb_ctx_t ctx, jb_midi_t ev);
+// MIDI processing callback, given every event of a cycle in frame order
+typedef void (*jb_midi_batch_fn_t)(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len);
+// audio buffer generating callback; `bufs` holds JB_OUTS buffers for each pair of outputs, a pair
+// after another
+typedef void (*jb_audio_fn_t)(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs);
+// callback to get state ready for realtime use (lock memory, warm caches), run before activation
+typedef void (*jb_prepare_fn_t)(void *state, jb_ctx_t ctx, size_t nframes);
+// callback told when JACK starts or stops freewheeling (running cycles back to back, with no
+// deadline, e.g. to bounce a session). it's run on the process thread, before the first cycle
+// either way, and again for a state swapped in while freewheeling
+typedef void (*jb_freewheel_fn_t)(void *state, bool on);
 
 typedef struct {
     char *name;             // name of JACK client
     void *state;            // pointer to user-supplied state (accessible in callbacks)
 
     jb_midi_fn_t midi_cb;   // callback to process MIDI events
+    jb_midi_batch_fn_t midi_batch_cb; // callback to process a cycle's MIDI events (used over midi_cb)
+
+    size_t midi_ports;      // number of MIDI input ports (at most JB_MIDI_PORTS; 0 means 1)
+    size_t out_pairs;       // number of audio output pairs (at most JB_PAIRS; 0 means 1)
     jb_audio_fn_t audio_cb; // callback to generate audio
+    jb_prepare_fn_t prepare_cb; // callback to prepare state for realtime use (optional)
+    jb_freewheel_fn_t freewheel_cb; // callback to switch state in and out of freewheeling
+                                    // (optional)
 } jb_client_config_t;
 
 typedef struct {
     jb_client_config_t cfg; // client configuration
     
     jack_client_t *jack;    // JACK client
-    jack_port_t *midi_in;   //  MIDI input port
-    jack_port_t *audio_out; // audio output port
+    jack_port_t *midi_in[JB_MIDI_PORTS]; // MIDI input ports
+    size_t n_midi_in;       // number of MIDI input ports
+    jack_port_t *audio_out[JB_PAIRS * JB_OUTS]; // audio output ports, a pair after another
+    size_t n_audio_out;     // number of audio output ports
 
     jb_ctx_t ctx;           // current context (timing information)
+
+    jb_midi_decoder_t dec[JB_MIDI_PORTS]; // decoder state of each MIDI input
+    jb_midi_t events[JB_MIDI_EVENTS];     // events decoded in current cycle, merged in frame order
+
+    jb_metrics_t metrics;   // statistics of process callback
+    _Atomic(void *) next_state; // state to switch the callbacks to (see jb_client_swap)
+    _Atomic bool freewheel; // whether JACK is freewheeling (set from JACK's notification thread)
+    bool freewheeling;      // whether the state has been told it's freewheeling (process thread)
 } jb_client_t;
 
 jb_res_t jb_client_init(jb_client_t *cl, jb_client_config_t cfg); // initialise client with config
+jb_res_t jb_client_prepare(jb_client_t *cl);                      // prepare for realtime use (before connecting)
 
-jb_res_t jb_client_connect_midi(jb_client_t *cl, char *pat);      // connect MIDI input to ports matching pattern
-jb_res_t jb_client_connect_audio(jb_client_t *cl, char *pat);     // connect audio output to ports matching pattern
+jb_res_t jb_client_connect_midi(jb_client_t *cl, size_t port, char *pat); // connect MIDI input to ports matching pattern
+jb_res_t jb_client_connect_audio(jb_client_t *cl, char *pat);     // connect every pair of audio outputs to ports matching pattern, alternating
 
-jb_res_t jb_client_start(jb_client_t *cl);                        // activate JACK client
+jb_res_t jb_client_list(jb_client_t *cl);                         // log available MIDI/audio ports
+jb_res_t jb_client_activate(jb_client_t *cl);                     // activate JACK client
+jb_res_t jb_client_start(jb_client_t *cl);                        // activate JACK client, and run until enter is pressed
+void jb_client_close(jb_client_t *cl);                            // deactivate and disconnect from JACK
+
+// prepare a new state for the callbacks, and hand it over to them. once this returns, the old state
+// is no longer in use and can be freed. fails if the process callback doesn't pick it up (e.g.
+// because the client isn't active), in which case the old state stays in use
+jb_res_t jb_client_swap(jb_client_t *cl, void *state);
 
 // 
 // audio synthesis: synth.c
@@ -214,6 +529,15 @@ jb_res_t jb_client_start(jb_client_t *cl);                        // activate JA
 typedef float (*jb_wave_fn_t)(float x, float bias); // wave function (0 <= x < 2pi)
 typedef int32_t jb_cents_t;                         // 1 cent = 1/100th of a semitone
 
+typedef enum {
+    JB_WAVE_SIN,
+    JB_WAVE_SQUARE,
+    JB_WAVE_TRIANGLE,
+    JB_WAVE_SAW,
+    JB_WAVE_NOISE,
+    JB_WAVE_MAX
+} jb_wave_t;
+
 typedef enum {
     JB_MOD_AM, // amplitude modulation
     JB_MOD_FM, // frequency modulation
@@ -222,17 +546,38 @@ typedef enum {
     JB_MOD_MAX
 } jb_mod_t;
 
+extern const jb_wave_fn_t jb_wave_fns[JB_WAVE_MAX]; // maps wave kind -> wave function
+extern const char *jb_wave_str[JB_WAVE_MAX];        // maps wave kind -> name used in patches
+extern const char jb_mod_char[JB_MOD_MAX];          // maps modulation kind -> operator in patches
+
 typedef struct {
-    jb_wave_fn_t fn;   // wave function
+    jb_wave_t wave;    // wave kind
     jb_cents_t detune; // detune (in cents)
     float amp;         // wave amplitude
     float bias;        // amount of folding, or pulse width
+    float hz;          // fixed frequency in Hz (0 = follow note)
+    uint32_t sample;   // sample file played instead of a wave, as an offset into the patch set's
+                       // string table (JB_NONE if none; see sampler.c)
+    jb_cents_t root;   // note the sample plays at its own pitch (in cents)
+    uint32_t partials; // first partial played instead of a wave, as an index into the patch set's
+                       // partial table (JB_NONE if none; see vsynth.c)
+    uint32_t n_partials; // number of partials
 } jb_osc_t;
 
-typedef struct jb_osc_link {
-    jb_osc_t *osc;            // oscillator
-    jb_mod_t mod;             // type of modulation
-    struct jb_osc_link *next; // next in chain
+#define JB_PARTIALS 256 // max partials of an additive oscillator
+
+// a partial of an additive oscillator. an oscillator's partials are sorted by ratio, so that those
+// above nyquist for a note are all at the end
+typedef struct {
+    float ratio; // frequency, as a multiple of the note's
+    float amp;   // amplitude
+} jb_partial_t;
+
+// oscillator chains are stored as contiguous arrays of links; the rest of the chain after a link
+// modulates that link's oscillator
+typedef struct {
+    uint32_t osc;      // index of oscillator
+    jb_mod_t mod;      // type of modulation applied by the rest of the chain
 } jb_osc_link_t;
 
 // macro to convert semitones to cents
@@ -243,9 +588,15 @@ typedef struct jb_osc_link {
 // A4 note in Hz
 #define JB_A4_HZ 440.f
 
-float jb_cents_hz(jb_cents_t cents);                                                   // convert cents (in MIDI space) to Hz 
-float jb_osc_sample(jb_osc_t *osc, jb_cents_t note, size_t idx, size_t srate);         // sample an oscillator at a given note in cents
-float jb_chain_sample(jb_osc_link_t *link, jb_cents_t note, size_t idx, size_t srate); // sample a chain of oscillators modulating eachother
+#define JB_CHAIN_MAX 16 // max oscillators in a chain
+
+float jb_cents_hz(jb_cents_t cents);                                   // convert cents (in MIDI space) to Hz 
+float jb_osc_step(const jb_osc_t *osc, jb_cents_t note, size_t srate); // phase step per sample at a note in cents
+
+// sample a chain of `len` oscillators modulating eachother, advancing the phase of each link by
+// its step
+float jb_chain_sample(const jb_osc_t *oscs, const jb_osc_link_t *chain, size_t len, float *phase,
+                      const float *step);
 
 float jb_wave_sin(float x, float bias);
 float jb_wave_square(float x, float bias);
@@ -253,6 +604,646 @@ float jb_wave_triangle(float x, float bias);
 float jb_wave_saw(float x, float bias);
 float jb_wave_noise(float x, float bias);
 
+//
+// vectorised synthesis: vsynth.c
+//
+
+// voices rendered in lockstep. with AVX available (e.g. `make ARCH=native`) a lane vector is a
+// single register; otherwise the compiler splits each operation across narrower registers
+#ifndef JB_LANES
+#define JB_LANES 8
+#endif
+
+typedef float jb_vf_t __attribute__((vector_size(JB_LANES * sizeof(float))));
+typedef int32_t jb_vi_t __attribute__((vector_size(JB_LANES * sizeof(int32_t))));
+typedef uint32_t jb_vu_t __attribute__((vector_size(JB_LANES * sizeof(uint32_t))));
+
+// seed a noise generator, a lane of xorshift state per voice. each caller keeps its own, so that
+// what one renders doesn't depend on what anything else has played
+void jb_noise_init(jb_vu_t *noise);
+
+// vectors are passed by pointer, so that the ABI doesn't depend on whether AVX is enabled. `noise`
+// is stepped by noise waves
+void jb_vwave(jb_wave_t wave, const jb_vf_t *x, const jb_vf_t *bias, jb_vu_t *noise,
+              jb_vf_t *out);
+
+// jb_chain_sample for JB_LANES voices at once; `phase` and `step` hold a vector per link
+void jb_chain_sample_v(const jb_osc_t *oscs, const jb_osc_link_t *chain, size_t len,
+                       jb_vf_t *phase, const jb_vf_t *step, jb_vu_t *noise, jb_vf_t *out);
+
+#define JB_PARTIAL_BLOCK 64 // most frames rendered by a partial bank at once
+
+// JB_LANES partials of a voice, each a point on the unit circle rotated once per frame, and the
+// amplitude each had reached at the end of the last block
+typedef struct {
+    jb_vf_t re, im, amp;
+} jb_partials_v_t;
+
+// add up to JB_PARTIAL_BLOCK frames of `groups` groups of partials to `out`. each partial turns
+// by `ratio * step` radians a frame, while its amplitude moves linearly to `amp` (or to nothing,
+// if it has moved above nyquist)
+void jb_partials_render_v(jb_partials_v_t *state, const jb_vf_t *ratio, const jb_vf_t *amp,
+                          size_t groups, float step, size_t nframes, float *out);
+
+//
+// patches: patch.c, sym.c, parse.c, image.c
+//
+
+#define JB_CHANS (JB_MIDI_PORTS * JB_PORT_CHANS) // number of logical channels (a set per MIDI input)
+#define JB_CHAN_INSTS 4     // max instruments assigned to a channel
+#define JB_CCS 128          // number of MIDI controllers
+#define JB_NONE UINT32_MAX  // null index into a patch table
+
+#define JB_ENV_SUSTAIN 0    // stage length marking a sustain stage
+
+typedef struct {
+    uint32_t time; // length of stage in usecs (JB_ENV_SUSTAIN to hold until note off)
+    float amp;     // level reached at end of stage
+} jb_env_stage_t;
+
+typedef struct {
+    uint32_t start;   // index of first stage
+    uint32_t len;     // number of stages
+    uint32_t release; // index of first stage after sustain (JB_NONE if no release)
+} jb_env_t;
+
+typedef struct {
+    uint32_t env;   // index of envelope
+    uint32_t chain; // index of first link in oscillator chain
+    uint32_t len;   // number of links in chain
+    uint32_t glide; // time taken to glide from the last note played (usecs; 0 for none)
+    bool legato;    // whether a note played while another is held takes over its voice, gliding
+                    // without restarting the envelope (and only then gliding)
+} jb_inst_t;
+
+// parameters a controller can be routed to
+typedef enum {
+    JB_TARGET_VOL,  // channel volume
+    JB_TARGET_PAN,  // channel pan (0 = left, 1 = right)
+    JB_TARGET_AMP,  // oscillator amplitude
+    JB_TARGET_BIAS, // oscillator bias
+    JB_TARGET_WAVE, // oscillator wave kind
+    JB_TARGET_MAX
+} jb_target_t;
+
+// curves controller values are mapped through before being scaled onto a route's range
+typedef enum {
+    JB_CURVE_LIN, // linear
+    JB_CURVE_EXP, // quadratic; finer control at the bottom of the range (e.g. volume)
+    JB_CURVE_LOG, // inverse of JB_CURVE_EXP; finer control at the top of the range
+    JB_CURVE_MAX
+} jb_curve_t;
+
+extern const char *jb_target_str[JB_TARGET_MAX]; // maps target -> name used in patches
+extern const char *jb_curve_str[JB_CURVE_MAX];   // maps curve -> name used in patches
+
+// a controller routed to a parameter
+typedef struct {
+    jb_target_t target; // parameter controlled
+    uint32_t idx;       // channel (for channel targets) or oscillator (for oscillator targets)
+    float lo, hi;       // range controller values are mapped onto
+    jb_curve_t curve;   // curve controller values are mapped through
+} jb_route_t;
+
+#define JB_VOL_CC 7  // controller routed to channel volume by default
+#define JB_PAN_CC 10 // controller routed to channel pan by default
+
+typedef struct {
+    uint32_t len;                  // number of instruments on channel
+    uint32_t insts[JB_CHAN_INSTS]; // indices of instruments
+    uint32_t ccs[JB_CCS];          // route of each controller (JB_NONE if unrouted)
+    jb_cents_t bend;               // pitch bend range, either side of centre
+} jb_chan_t;
+
+#define JB_BEND_RANGE JB_SEMIS(2) // pitch bend range of channels that don't set one
+
+typedef enum {
+    JB_SYM_OSC,
+    JB_SYM_ENV,
+    JB_SYM_INST,
+    JB_SYM_MAX
+} jb_sym_kind_t;
+
+extern const char *jb_sym_str[JB_SYM_MAX];
+
+typedef struct {
+    jb_sym_kind_t kind; // kind of object named
+    uint32_t idx;       // index of object in its table
+    uint32_t name;      // offset of interned name in string table
+    uint32_t len;       // length of name
+} jb_sym_t;
+
+// slot in the symbol index, an open-addressing (Robin Hood) hash table over the symbol table
+typedef struct {
+    uint32_t hash; // hash of symbol's name
+    uint32_t sym;  // index of symbol (JB_NONE for an empty slot)
+} jb_sym_slot_t;
+
+// kinds of patch definitions (named after the CLI flag used to declare them)
+typedef enum {
+    JB_DEF_ENV = 'E',
+    JB_DEF_OSC = 'O',
+    JB_DEF_INST = 'I',
+    JB_DEF_CHAN = 'C',
+    JB_DEF_ROUTE = 'R'
+} jb_def_kind_t;
+
+typedef struct {
+    jb_def_kind_t kind; // kind of object defined
+    char *src;          // source of definition
+} jb_def_t;
+
+// read a file of definitions into a buffer, a line each, written as on the command line (e.g.
+// `-O o: wave=sin vol=1.0`); blank lines and `#` comments are skipped
+jb_res_t jb_defs_read(const char *path, jb_def_t **defs);
+void jb_defs_free(jb_def_t *defs); // free definitions read by jb_defs_read
+
+// a compiled set of patches. tables only refer to eachother by index, so a compiled patch set can
+// be written to disk as-is and mapped back in by later runs (see image.c). while compiling, tables
+// are jb_buf_* buffers; when loaded from an image, they point into a read-only mapping
+typedef struct {
+    jb_osc_t *oscs;         // oscillators
+    jb_env_stage_t *stages; // envelope stages, contiguous per envelope
+    jb_env_t *envs;         // envelopes
+    jb_osc_link_t *links;   // oscillator chain links, contiguous per instrument
+    jb_inst_t *insts;       // instruments
+    jb_chan_t *chans;       // channels (always JB_CHANS entries)
+    jb_route_t *routes;     // controller routes
+    jb_partial_t *partials; // partials of additive oscillators, contiguous per oscillator
+    jb_sym_t *syms;         // names of oscillators, envelopes and instruments
+    jb_sym_slot_t *slots;   // symbol index (power of 2 sized, or NULL when empty)
+    char *strs;             // string table (NUL-terminated names, each stored once)
+
+    size_t n_oscs, n_stages, n_envs, n_links, n_insts, n_routes, n_partials, n_syms, n_slots,
+        n_strs;
+
+    void *image;            // mapped image (NULL if compiled from source)
+    size_t image_len;       // length of mapped image
+} jb_patch_t;
+
+void jb_patch_init(jb_patch_t *pt);                                         // initialise empty patch set
+void jb_patch_free(jb_patch_t *pt);                                         // free or unmap patch set
+uint64_t jb_patch_hash(const jb_def_t *defs, size_t len);                   // hash patch source
+jb_res_t jb_patch_compile(jb_patch_t *pt, const jb_def_t *defs, size_t len); // parse definitions into patch set
+void jb_patch_log(const jb_patch_t *pt);                                    // log contents of patch set
+jb_res_t jb_patch_lock(const jb_patch_t *pt);                               // fault in and lock tables
+// check every index the engine and symbol lookups follow without bounds checks, in case the patch
+// set came from a damaged image
+jb_res_t jb_patch_check(const jb_patch_t *pt);
+
+// look up a named object, returning NULL if not found
+const jb_sym_t *jb_patch_find(const jb_patch_t *pt, jb_sym_kind_t kind, const char *name, size_t len);
+// define (or redefine) a named object
+jb_res_t jb_patch_define(jb_patch_t *pt, jb_sym_kind_t kind, const char *name, size_t len, uint32_t idx);
+// find the name of an object, returning NULL if it is unnamed
+const char *jb_patch_name(const jb_patch_t *pt, jb_sym_kind_t kind, uint32_t idx);
+
+jb_res_t jb_parse_env(jb_patch_t *pt, const char *src);  // parse an envelope definition
+jb_res_t jb_parse_osc(jb_patch_t *pt, const char *src);  // parse an oscillator definition
+jb_res_t jb_parse_inst(jb_patch_t *pt, const char *src); // parse an instrument definition
+jb_res_t jb_parse_chan(jb_patch_t *pt, const char *src); // parse a channel assignment
+jb_res_t jb_parse_route(jb_patch_t *pt, const char *src); // parse a controller route
+// parse a parameter and a value to set it to, as a route's target (in `param`)
+jb_res_t jb_parse_param(jb_patch_t *pt, const char *src, jb_route_t *param, float *val);
+
+jb_res_t jb_image_write(const jb_patch_t *pt, const char *path, uint64_t hash); // write patch set image
+jb_res_t jb_image_load(jb_patch_t *pt, const char *path, uint64_t hash);        // map image matching hash
+
+//
+// sample streaming: sampler.c
+//
+
+#define JB_STREAMS 64 // sample streams per engine (voices of sampler instruments sounding at once)
+
+// a WAV file, mapped read-only. only its attack is kept resident; the rest is streamed
+typedef struct {
+    const char *path;
+    void *map;              // mapping of whole file
+    size_t map_len;
+
+    const uint8_t *data;    // first frame in mapping
+    size_t frames;          // frames in file
+    uint16_t chans;         // channels per frame (mixed down to mono)
+    uint16_t bytes;         // bytes per sample
+    bool is_float;          // samples are IEEE floats (otherwise signed integers)
+    float srate;            // sample rate of file
+
+    float *attack;          // first `n_attack` frames, as mono floats
+    size_t n_attack;
+} jb_wav_t;
+
+typedef enum {
+    JB_STREAM_FREE,    // unused (the audio thread may start it)
+    JB_STREAM_START,   // started by the audio thread, waiting for the I/O thread
+    JB_STREAM_RUNNING, // being filled by the I/O thread
+    JB_STREAM_STOP,    // stopped by the audio thread, waiting for the I/O thread to let go
+} jb_stream_state_t;
+
+// a voice playing a WAV file: its first frames come from the attack, and the rest from a ring
+// the I/O thread keeps filled. ring frame `i` holds the file's frame `n_attack + i`
+typedef struct {
+    _Atomic int state;          // jb_stream_state_t
+    uint32_t wav;               // file being played
+    float *ring;
+    _Atomic uint64_t written;   // frames written into the ring (by the I/O thread)
+    _Atomic uint64_t done;      // frames the audio thread no longer needs
+
+    // only touched by the audio thread
+    uint64_t pos;               // frame being played
+    float frac;                 // position between `pos` and the next frame
+    float rate;                 // frames to advance per output frame
+} jb_stream_t;
+
+// sample files of a patch set, streamed for an engine by a background I/O thread
+typedef struct {
+    jb_wav_t *wavs;             // each distinct file played by the patch set
+    size_t n_wavs;
+    uint32_t *osc_wav;          // file of each oscillator (JB_NONE if not a sampler)
+
+    jb_stream_t streams[JB_STREAMS];
+    size_t ring_len;            // frames in each stream's ring (a power of two; 0 until prepared)
+    bool freewheel;             // wait for the I/O thread rather than run dry (audio thread only)
+
+    pthread_t thread;           // I/O thread (if running)
+    bool running;
+    _Atomic bool quit;
+    _Atomic uint64_t latency_ns; // slowest read from disk seen
+} jb_sampler_t;
+
+// map the sample files of a patch set, loading their attacks into `arena`
+jb_res_t jb_sampler_init(jb_sampler_t *smp, const jb_patch_t *pt, jb_arena_t *arena);
+void jb_sampler_free(jb_sampler_t *smp); // stop I/O thread and unmap files
+
+// size stream rings for cycles of `nframes` at `srate` and the disk latency seen so far, allocate
+// them from `arena`, and start the I/O thread
+void jb_sampler_prepare(jb_sampler_t *smp, jb_arena_t *arena, size_t nframes, size_t srate);
+
+// start a stream playing a file at `rate` frames per output frame (audio thread), returning its
+// index, or JB_NONE if none are free
+uint32_t jb_stream_start(jb_sampler_t *smp, uint32_t wav, float rate);
+void jb_stream_stop(jb_sampler_t *smp, uint32_t idx); // stop a stream (audio thread)
+// change the rate a stream plays at (audio thread), e.g. as its note is bent
+void jb_stream_rate(jb_sampler_t *smp, uint32_t idx, float rate);
+
+// read the next `len` frames of a stream into `out` (audio thread). returns false once the file has
+// ended; frames the I/O thread hasn't caught up to are silent, and set `*underrun`
+bool jb_stream_read(jb_sampler_t *smp, uint32_t idx, float *out, size_t len, bool *underrun);
+
+//
+// meters: meter.c
+//
+
+#define JB_METER_MAGIC "JBMETER"
+#define JB_TAP_LEN 1024    // waveform tap samples published per output
+#define JB_METER_FRESH 0x4 // set on `middle` once the writer has published into it
+
+// level of a signal over a cycle, on each output
+typedef struct {
+    float peak[JB_OUTS]; // largest magnitude
+    float rms[JB_OUTS];  // RMS level (a sum of squares until published)
+} jb_level_t;
+
+// an engine's levels over one cycle
+typedef struct {
+    uint64_t cycle;                 // cycles published before this one
+    uint32_t srate;                 // sample rate
+    uint32_t nframes;               // frames in the cycle
+    uint32_t decimate;              // frames averaged into each tap sample (0 if there's no tap)
+    jb_level_t out;                 // levels of the outputs
+    jb_level_t chans[JB_CHANS];     // level each channel mixes into the outputs (after volume
+                                    // and pan)
+    float tap[JB_OUTS][JB_TAP_LEN]; // most recent tap samples, oldest first
+} jb_meter_frame_t;
+
+// a POSIX shared memory object holding a triple buffer of frames. the writer fills its buffer and
+// exchanges it for `middle`; the reader exchanges its buffer for `middle` whenever it's fresh. so
+// neither ever waits on the other, but there can only be one reader at a time
+typedef struct {
+    char magic[8];            // JB_METER_MAGIC
+    uint32_t version;
+    _Atomic uint32_t middle;  // index of buffer passed between them, and JB_METER_FRESH
+    _Atomic uint32_t front;   // index of reader's buffer, kept here so that readers can restart
+    jb_meter_frame_t bufs[3];
+} jb_meter_shm_t;
+
+// publishing side of a meter, given to an engine, which meters every cycle it renders
+typedef struct {
+    jb_meter_shm_t *shm;
+    char name[64];              // name of shared memory object, unlinked on close
+
+    // only touched by the audio thread
+    uint64_t cycles;            // frames published
+    uint32_t back;              // index of buffer being written
+    uint32_t decimate;          // frames averaged into each tap sample (0 for no tap)
+    uint32_t tap_count;         // frames averaged into the next tap sample so far
+    uint32_t tap_pos;           // next position in tap ring
+    float tap_sum[JB_OUTS];     // sum of frames averaged into the next tap sample so far
+    float tap[JB_OUTS][JB_TAP_LEN]; // ring of tap samples
+} jb_meter_t;
+
+// reading side of a meter
+typedef struct {
+    jb_meter_shm_t *shm;
+} jb_meter_reader_t;
+
+// create a shared memory object `name` (e.g. "/midid") to publish into, with a waveform tap
+// averaging every `decimate` frames (0 for no tap). the object is locked into RAM
+jb_res_t jb_meter_create(jb_meter_t *m, const char *name, uint32_t decimate);
+void jb_meter_close(jb_meter_t *m); // unmap and unlink shared memory object
+
+// start metering a cycle (audio thread), returning the frame to meter into, with levels cleared
+jb_meter_frame_t *jb_meter_begin(jb_meter_t *m);
+// add `nframes` of each output in `bufs` to a level (audio thread)
+void jb_meter_level(jb_level_t *lvl, jb_sample_t *const *bufs, size_t nframes);
+// meter the outputs of a cycle and feed the tap, then publish the frame (audio thread)
+void jb_meter_publish(jb_meter_t *m, jb_sample_t *const *bufs, size_t nframes, size_t srate);
+
+jb_res_t jb_meter_open(jb_meter_reader_t *r, const char *name); // map a meter published elsewhere
+void jb_meter_reader_close(jb_meter_reader_t *r);
+// latest frame published, which stays as it is until the next call (NULL if none has been yet)
+const jb_meter_frame_t *jb_meter_read(jb_meter_reader_t *r);
+
+//
+// synth engine: engine.c
+//
+
+#define JB_VOICES 128        // voices per instrument (one per MIDI note)
+#define JB_ENGINE_VOICES 256 // voices an engine sounds at once, unless told otherwise
+
+// a controlled parameter, moved towards its target once per cycle so that controller changes don't
+// cause zipper noise. block renderers interpolate between `prev` and `cur` across each cycle
+typedef struct {
+    jb_target_t target; // parameter being controlled
+    uint32_t idx;       // channel or oscillator
+    float prev;         // value at start of current cycle
+    float cur;          // value at end of current cycle
+    float goal;         // value being moved towards
+    float step;         // change per cycle
+    bool moving;        // whether ramp is on the engine's list of moving ramps
+} jb_ramp_t;
+
+typedef struct {
+    jb_ramp_t vol; // channel volume
+    jb_ramp_t pan; // channel pan
+    float bend;    // pitch bend (in cents)
+} jb_mix_t;
+
+#define JB_CMDS 256 // commands queued for the audio thread (a power of two)
+
+typedef enum {
+    JB_CMD_MIDI, // play a MIDI event
+    JB_CMD_SET,  // set a parameter
+} jb_cmd_kind_t;
+
+// command sent to the engine from outside the audio thread
+typedef struct {
+    jb_cmd_kind_t kind;
+    jb_midi_t midi;     // event to play (JB_CMD_MIDI)
+    jb_target_t target; // parameter to set (JB_CMD_SET)
+    uint32_t idx;       // channel or oscillator of parameter
+    float val;          // value to set parameter to
+} jb_cmd_t;
+
+// a note sounding on an instrument. voices come from a pool shared by every instrument in the
+// engine, and belong to an instrument only while they sound, so memory follows polyphony rather
+// than the size of the patch set
+typedef struct {
+    uint32_t next;                // next voice of the instrument (JB_NONE if last)
+    uint8_t note;                 // MIDI note
+    uint8_t velocity;             // MIDI velocity
+    uint32_t stage;               // index of current envelope stage (JB_NONE once silent)
+    jack_time_t time;             // time current stage started (usecs)
+    float start_ramp;             // envelope level at start of current stage
+    float ramp;                   // current envelope level
+    float cents;                  // pitch offset reached at the end of the last span (in cents)
+    float glide;                  // pitch offset the current glide started from (in cents)
+    jack_time_t glide_time;       // time current glide started (usecs)
+    uint32_t stream;              // sample stream (JB_NONE if none)
+    float phase[JB_CHAIN_MAX];    // phase of each link in the chain
+    float step[JB_CHAIN_MAX];     // phase step per sample of each link in the chain, before bend
+                                  // and glide (for samplers, the stream's rate)
+    uint32_t partials;            // partials under nyquist when the note started (additive
+                                  // instruments)
+} jb_voice_t;
+
+// voices an instrument has sounding
+typedef struct {
+    uint32_t voices; // pool index of first voice (JB_NONE if none)
+    uint32_t last;   // note last played, which glides start from (JB_NONE if none)
+} jb_voice_bank_t;
+
+typedef struct {
+    const jb_patch_t *patch;        // patch set being played
+    jb_arena_t arena;               // engine state
+    jb_voice_bank_t *banks;         // voices of each instrument in patch set
+    jb_pool_t pool;                 // voices shared by every instrument (jb_voice_t)
+
+    jb_osc_t *oscs;                 // oscillators, as modified by controllers
+    jb_ramp_t *ramps;               // ramp for each route to an oscillator
+    jb_mix_t *mix;                  // volume and pan of each channel
+    jb_ramp_t **moving;             // ramps still moving towards their target
+    size_t n_moving;
+
+    bool accurate;                  // apply MIDI events on the frame they arrive on, rather than
+                                    // at the start of the cycle
+    bool freewheel;                 // whether JACK is freewheeling (see jb_engine_freewheel)
+    const jb_midi_t *pending;       // events waiting for their frame (when accurate)
+    size_t n_pending;
+
+    jb_sampler_t sampler;           // sample files being streamed
+    jb_vu_t *noise;                 // noise generator of the voices being rendered
+    jb_partials_v_t *partials;      // partial bank of each voice in the pool (additive instruments)
+    size_t partial_groups;          // groups of partials per voice (0 if nothing is additive)
+
+    jb_metrics_t *metrics;          // metrics to report to (optional)
+    jb_meter_t *meter;              // meter to publish levels to (optional; set before preparing)
+    jb_sample_t *chan_bufs[JB_OUTS]; // channel being rendered on its own, to be metered
+    size_t chan_len;                // frames in `chan_bufs` (0 if not metering channels)
+    size_t voices;                  // voices sounding at the end of the last cycle
+    bool in_rack;                   // whether voices sounding are reported by a rack instead
+
+    // commands waiting for the next cycle; one thread queues, the audio thread takes
+    jb_cmd_t cmds[JB_CMDS];
+    _Atomic uint32_t cmd_head;      // commands queued
+    _Atomic uint32_t cmd_tail;      // commands taken
+} jb_engine_t;
+
+// initialise engine for patch set, able to sound `voices` notes at once (e.g. JB_ENGINE_VOICES)
+jb_res_t jb_engine_init(jb_engine_t *eng, const jb_patch_t *patch, size_t voices);
+void jb_engine_free(jb_engine_t *eng);                             // free engine state
+
+void jb_engine_midi(void *state, jb_ctx_t ctx, jb_midi_t ev); // jb_midi_fn_t; state is jb_engine_t
+void jb_engine_midi_batch(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len); // jb_midi_batch_fn_t
+void jb_engine_audio(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs); // jb_audio_fn_t
+void jb_engine_prepare(void *state, jb_ctx_t ctx, size_t nframes); // jb_prepare_fn_t
+// jb_freewheel_fn_t. with no deadline to meet, events are applied on the frame they arrive on, and
+// sample streams wait for the disk rather than running dry
+void jb_engine_freewheel(void *state, bool on);
+
+// queue a command for the start of the next cycle, from a thread other than the audio thread (one
+// at a time). returns false, and counts a dropped command, if the queue is full
+bool jb_engine_command(jb_engine_t *eng, jb_cmd_t cmd);
+
+//
+// engine rack: rack.c
+//
+
+#define JB_RACK_PARTS JB_MIDI_PORTS // max engines in a rack (one per MIDI input)
+
+// several engines played by one client, each with a MIDI input and a pair of outputs of its own
+// (the first engine gets `midi_in`, `audio_out_l` and `audio_out_r`, the second `midi_in_1`,
+// `audio_out_l_1` and `audio_out_r_1`, ...). each engine sees its input's channels as 0 to 15. the
+// engines render one after another on the client's process thread, so hosting another costs the
+// time to render it, rather than another JACK client and realtime thread
+typedef struct {
+    jb_engine_t *engs[JB_RACK_PARTS];
+    size_t len;
+
+    jb_metrics_t *metrics;            // metrics to report voices sounding to (optional)
+    jb_midi_t events[JB_MIDI_EVENTS]; // cycle's events, grouped by engine
+} jb_rack_t;
+
+void jb_rack_init(jb_rack_t *rack);
+// add an engine to the rack, which must only use the first MIDI input's channels
+jb_res_t jb_rack_add(jb_rack_t *rack, jb_engine_t *eng);
+
+// client callbacks; state is jb_rack_t, which needs `len` MIDI inputs and output pairs
+void jb_rack_midi_batch(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len);
+void jb_rack_audio(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs);
+void jb_rack_prepare(void *state, jb_ctx_t ctx, size_t nframes);
+void jb_rack_freewheel(void *state, bool on);
+
+//
+// shards: shard.c
+//
+
+#define JB_SHARD_MAGIC "JBSHARD"
+#define JB_SHARDS 8           // max workers attached to a front end
+#define JB_SHARD_EVENTS 1024  // events queued for each worker (a power of two)
+#define JB_SHARD_FRAMES 8192  // largest period a front end can run with
+
+// states of a shard
+enum {
+    JB_SHARD_FREE,     // no worker attached
+    JB_SHARD_CLAIMED,  // a worker is attaching
+    JB_SHARD_ATTACHED, // a worker is attached, and rendering the cycles it's posted
+};
+
+// a worker's slot in a front end. the front end posts a cycle by queueing its events, filling in
+// its context and waking the worker through `go`; the worker renders into `out`, then stores the
+// cycle in `done` and wakes the front end through `ready`
+typedef struct {
+    _Atomic uint32_t state;     // JB_SHARD_*
+    _Atomic int32_t pid;        // process attached, so that a crashed one's slot can be reclaimed
+    bool chans[JB_CHANS];       // channels the worker plays, whose events are queued for it
+
+    sem_t go;                   // posted by the front end for each cycle
+    sem_t ready;                // posted by the worker as it finishes each cycle
+    _Atomic uint64_t cycle;     // last cycle posted
+    _Atomic uint64_t done;      // last cycle rendered
+
+    // set by the front end along with `cycle`
+    jb_ctx_t ctx;               // context of cycle
+    uint32_t nframes;           // frames in cycle
+    uint32_t first;             // ring index of cycle's first event (earlier ones are late)
+    uint32_t last;              // ring index after cycle's last event
+    bool freewheel;             // whether JACK is freewheeling
+
+    _Atomic uint32_t head;      // ring index after the last event queued (front end)
+    _Atomic uint32_t tail;      // ring index of the next event to take (worker)
+    jb_midi_t ring[JB_SHARD_EVENTS];
+
+    jb_sample_t out[JB_OUTS][JB_SHARD_FRAMES];
+} jb_shard_t;
+
+// a POSIX shared memory object holding a front end's shards
+typedef struct {
+    char magic[8];              // JB_SHARD_MAGIC, set once the front end is prepared
+    uint32_t version;
+    uint32_t srate;             // sample rate
+    uint32_t nframes;           // expected frames per cycle
+    int32_t priority;           // realtime priority of the front end's process thread (0 for none)
+    jb_shard_t shards[JB_SHARDS];
+} jb_shard_shm_t;
+
+// front end, which owns the JACK ports and hands each cycle to the workers attached to it. each
+// worker's events are the channels it plays; its output is summed in if it's done by the timeout,
+// and left out otherwise. a worker still busy with an earlier cycle is skipped (and its events
+// kept queued), so one that crashes or falls behind costs the others at most one timeout
+typedef struct {
+    jb_shard_shm_t *shm;
+    char name[64];              // name of shared memory object, unlinked on close
+    uint64_t timeout_ns;        // time given to workers each cycle (0 for 3/4 of the period)
+    jb_metrics_t *metrics;      // metrics to count misses and dropped events to (optional)
+
+    // only touched by the process thread
+    bool freewheel;             // whether JACK is freewheeling (workers get as long as they need)
+    uint32_t first[JB_SHARDS];  // ring index of current cycle's first event, for each shard
+    bool posted[JB_SHARDS];     // whether each shard has been posted the current cycle
+} jb_front_t;
+
+// create a shared memory object `name` (e.g. "/midid") for workers to attach to. workers get
+// `timeout` μs each cycle (0 for 3/4 of the period), and run at realtime priority `priority`
+// (0 for none). the object is locked into RAM
+jb_res_t jb_front_create(jb_front_t *f, const char *name, uint64_t timeout, int priority);
+void jb_front_close(jb_front_t *f); // unmap and unlink shared memory object
+
+// client callbacks; state is jb_front_t, which needs a single pair of outputs. the object is only
+// opened to workers once prepared
+void jb_front_midi_batch(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len);
+void jb_front_audio(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs);
+void jb_front_prepare(void *state, jb_ctx_t ctx, size_t nframes);
+void jb_front_freewheel(void *state, bool on);
+
+// worker, which runs a client's callbacks on a thread of its own for every cycle a front end posts,
+// in place of a JACK client
+typedef struct {
+    jb_client_config_t cfg;     // callbacks to run (only the first pair of outputs is used)
+    bool chans[JB_CHANS];       // channels to render
+    jb_shard_shm_t *shm;
+    jb_shard_t *shard;          // slot claimed (NULL if not attached)
+    size_t idx;                 // index of slot
+
+    jb_metrics_t metrics;       // statistics of cycles rendered
+    pthread_t thread;
+    _Atomic bool quit;
+    bool freewheeling;          // whether the state has been told it's freewheeling
+    jb_midi_t events[JB_MIDI_EVENTS]; // events taken for current cycle
+} jb_worker_t;
+
+// map the front end at `name`, to render the given channels with `cfg`
+jb_res_t jb_worker_init(jb_worker_t *w, const char *name, jb_client_config_t cfg,
+                        const bool chans[JB_CHANS]);
+// prepare the state, claim a free shard (or one whose worker has died) and start rendering
+jb_res_t jb_worker_start(jb_worker_t *w);
+void jb_worker_stop(jb_worker_t *w); // stop rendering, give up the shard and unmap front end
+
+//
+// control server: control.c
+//
+
+// thread taking commands, a line at a time, over a local socket; see doc/README.md for the
+// protocol. commands reach the engine through its command queue, and patch sets are swapped in
+// with jb_client_swap(), so the audio thread never waits on the control thread
+typedef struct {
+    jb_client_t *cl;
+    jb_engine_t *eng;     // engine being played
+    jb_patch_t *patch;    // its patch set
+    bool owned;           // whether engine and patch set were loaded (and are freed) by the server
+
+    jb_sock_t sock;       // listening socket (closed if not serving)
+    pthread_t thread;
+    _Atomic int conn;     // connection being served (-1 if none)
+    _Atomic bool quit;    // whether a `quit` command has been received
+} jb_control_t;
+
+// serve commands from a new thread on a socket at `addr` (see jb_sock_listen), playing `eng`
+// (with patch set `patch`) on an active client
+jb_res_t jb_control_serve(jb_control_t *ctl, jb_client_t *cl, jb_engine_t *eng, jb_patch_t *patch,
+                          const char *addr);
+void jb_control_wait(jb_control_t *ctl); // wait for a `quit` command
+void jb_control_stop(jb_control_t *ctl); // stop serving, freeing anything the server loaded
+
 // terminal control
 //
 
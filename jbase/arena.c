@@ -0,0 +1,161 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// arena.c: memory arenas
+//
+// arenas reserve a range of address space up front with no access, and make pages accessible in
+// chunks as allocations reach them. nothing is touched or zeroed until it's used, and an arena can
+// grow to its full reservation without ever moving
+//
+
+#include <errno.h>
+#include <jbase.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define COMMIT_CHUNK JB_KiB(64) // minimum amount committed at once
+#define HUGE_PAGE JB_MiB(2)     // size of a transparent huge page
+
+static size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+jb_res_t jb_arena_init(jb_arena_t *a, size_t reserve, int flags) {
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    memset(a, 0, sizeof(*a));
+    a->flags = flags;
+    a->gran = JB_MAX(page, (flags & JB_ARENA_HUGE) ? HUGE_PAGE : COMMIT_CHUNK);
+    a->reserved = align_up(reserve, a->gran);
+
+    void *base = mmap(NULL, a->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                      -1, 0);
+
+    if (base == MAP_FAILED)
+        return JB_ERR(
+            JB_ERR_LIBC, "failed to reserve %zu bytes for arena: %s", a->reserved, strerror(errno));
+
+    a->base = base;
+
+#ifdef MADV_HUGEPAGE
+    if (flags & JB_ARENA_HUGE) madvise(a->base, a->reserved, MADV_HUGEPAGE);
+#endif
+
+    return JB_OK_VAL;
+}
+
+void jb_arena_free(jb_arena_t *a) {
+    if (a->base) munmap(a->base, a->reserved);
+    memset(a, 0, sizeof(*a));
+}
+
+// make sure the first `len` bytes of the arena are accessible
+static bool commit(jb_arena_t *a, size_t len) {
+    if (len <= a->committed) return true;
+    if (len > a->reserved) return false;
+
+    size_t to = JB_MIN(align_up(len, a->gran), a->reserved);
+
+    if (mprotect(a->base + a->committed, to - a->committed, PROT_READ | PROT_WRITE) != 0) {
+        jb_error("failed to commit %zu bytes of arena: %s", to - a->committed, strerror(errno));
+        return false;
+    }
+
+    a->committed = to;
+
+    return true;
+}
+
+void *jb_arena_alloc(jb_arena_t *a, size_t size, size_t align) {
+    size_t start = align_up(a->pos, align);
+
+    if (start < a->pos || size > a->reserved - start) return NULL;
+    if (!commit(a, start + size)) return NULL;
+
+    uint8_t *ptr = a->base + start;
+
+    // memory that has been used before a reset needs zeroing; anything past that is fresh from the
+    // kernel and already zeroed
+    if (start < a->dirty) memset(ptr, 0, JB_MIN(size, a->dirty - start));
+
+    a->pos = start + size;
+    a->dirty = JB_MAX(a->dirty, a->pos);
+
+    return ptr;
+}
+
+jb_arena_mark_t jb_arena_mark(jb_arena_t *a) {
+    return a->pos;
+}
+
+void jb_arena_reset_to(jb_arena_t *a, jb_arena_mark_t m) {
+    if (m < a->pos) a->pos = m;
+}
+
+void jb_arena_reset(jb_arena_t *a) {
+    a->pos = 0;
+}
+
+void jb_arena_decommit(jb_arena_t *a) {
+    size_t keep = align_up(a->pos, a->gran);
+    if (keep >= a->committed) return;
+
+    // remapping over the range drops its pages and leaves it reserved but inaccessible again
+    void *res = mmap(a->base + keep, a->committed - keep, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+
+    if (res == MAP_FAILED) {
+        jb_warn("failed to decommit arena: %s", strerror(errno));
+        return;
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (a->flags & JB_ARENA_HUGE) madvise(a->base + keep, a->committed - keep, MADV_HUGEPAGE);
+#endif
+
+    a->committed = keep;
+    a->dirty = JB_MIN(a->dirty, keep);
+}
+
+jb_res_t jb_arena_lock(jb_arena_t *a) {
+    return jb_mem_lock(a->base, a->committed);
+}
+
+jb_res_t jb_mem_lock(const void *ptr, size_t len) {
+    if (len == 0) return JB_OK_VAL;
+
+    // mlock works on whole pages
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)ptr & ~(page - 1);
+    uintptr_t end = align_up((uintptr_t)ptr + len, page);
+
+    if (mlock((void *)start, end - start) != 0)
+        return JB_ERR(JB_ERR_LIBC, "failed to lock %zu bytes: %s", end - start, strerror(errno));
+
+    return JB_OK_VAL;
+}
+
+jb_arena_scope_t jb_arena_scope_begin(jb_arena_t *a) {
+    return (jb_arena_scope_t){.arena = a, .mark = jb_arena_mark(a)};
+}
+
+void jb_arena_scope_end(jb_arena_scope_t scope) {
+    jb_arena_reset_to(scope.arena, scope.mark);
+}
@@ -18,12 +18,19 @@
 
 #include <jack/jack.h>
 #include <jbase.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "jack/midiport.h"
 
+#define SWAP_POLL_USECS 1000
+#define SWAP_TIMEOUT_USECS 2000000 // time given to the process callback to pick up a new state
+
 static void jack_error_report(const char *msg) {
     jb_error("JACK: %s", msg);
 }
@@ -33,49 +40,175 @@ static void jack_info_report(const char *msg) {
 }
 
 static int jack_xrun(void *arg) {
-    (void)arg;
+    jb_client_t *cl = (jb_client_t *)arg;
+    atomic_fetch_add_explicit(&cl->metrics.xruns, 1, memory_order_relaxed);
+
     jb_warn("xrun detected");
     return 0;
 }
 
-enum { MIDI_STATUS = 0, MIDI_ARG0 = 1, MIDI_ARG1 = 2 };
+// JACK runs this on its notification thread; the state is switched over by the process callback
+static void jack_freewheel(int starting, void *arg) {
+    jb_client_t *cl = (jb_client_t *)arg;
+    atomic_store_explicit(&cl->freewheel, starting != 0, memory_order_relaxed);
+
+    jb_info("JACK %s freewheeling", starting ? "started" : "stopped");
+}
+
+static const char *out_names[JB_OUTS] = {"audio_out_l", "audio_out_r"};
+
+// an input's events for the current cycle
+typedef struct {
+    void *buf;              // JACK MIDI buffer
+    size_t count;           // events in buffer
+    size_t next;            // next event to decode
+    jack_midi_event_t ev;   // next event (if next < count)
+} midi_input_t;
+
+static void input_advance(midi_input_t *in) {
+    // skip events JACK fails to hand over
+    while (in->next < in->count && jack_midi_event_get(&in->ev, in->buf, in->next) != 0) in->next++;
+}
+
+// decode every input's MIDI for the cycle into `cl->events`, merged in frame order. each input is
+// already in order, so it's enough to keep taking the earliest next event of any input; ties go
+// to the lower numbered input. events that don't fit are counted in `dropped`
+static size_t midi_merge(jb_client_t *cl, jack_nframes_t nframes, size_t *dropped) {
+    JB_ZONE("midi decode");
+
+    midi_input_t ins[JB_MIDI_PORTS];
+
+    for (size_t p = 0; p < cl->n_midi_in; p++) {
+        ins[p].buf = jack_port_get_buffer(cl->midi_in[p], nframes);
+        ins[p].count = jack_midi_get_event_count(ins[p].buf);
+        ins[p].next = 0;
+        input_advance(&ins[p]);
+    }
+
+    size_t len = 0;
+
+    for (;;) {
+        midi_input_t *first = NULL;
+        size_t port = 0;
+
+        for (size_t p = 0; p < cl->n_midi_in; p++) {
+            if (ins[p].next >= ins[p].count) continue;
+
+            if (!first || ins[p].ev.time < first->ev.time) {
+                first = &ins[p];
+                port = p;
+            }
+        }
+
+        if (!first) break;
+
+        len += jb_midi_decode(&cl->dec[port],
+                              first->ev.time,
+                              first->ev.buffer,
+                              first->ev.size,
+                              cl->events + len,
+                              JB_MIDI_EVENTS - len,
+                              dropped);
+
+        first->next++;
+        input_advance(first);
+    }
+
+    return len;
+}
+
+// NaNs would poison anything mixed with them downstream, so cycles that render any are silenced
+static void sanitise(jb_client_t *cl, jb_sample_t **bufs, jack_nframes_t nframes) {
+    JB_ZONE("sanitise");
+
+    bool is_nan = false;
+    for (size_t o = 0; o < cl->n_audio_out; o++)
+        for (size_t i = 0; i < nframes; i++)
+            // check for NaN (NaN comparisons should always be false; IEEE floats will fail this
+            // condition if NaN)
+            if (bufs[o][i] != bufs[o][i]) is_nan = true;
+
+    // counted rather than logged; the logger takes locks (see rtcheck.c)
+    if (is_nan) {
+        atomic_fetch_add_explicit(&cl->metrics.nan_mutes, 1, memory_order_relaxed);
+
+        for (size_t o = 0; o < cl->n_audio_out; o++)
+            memset(bufs[o], 0, nframes * sizeof(*bufs[o]));
+    }
+}
 
 static int jack_process(jack_nframes_t nframes, void *arg) {
-    jb_client_t *cl = (jb_client_t *)arg;
+    JB_ZONE("process");
 
-    void *midi_buf = jack_port_get_buffer(cl->midi_in, nframes);
-    jb_sample_t *audio_buf = (jb_sample_t *)jack_port_get_buffer(cl->audio_out, nframes);
+    jb_client_t *cl = (jb_client_t *)arg;
+    jb_metrics_t *m = &cl->metrics;
 
-    jb_midi_t ev;
-    jack_midi_event_t raw_ev;
-    size_t ev_count = jack_midi_get_event_count(midi_buf);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    for (size_t i = 0; i < ev_count && cl->cfg.midi_cb; i++) {
-        jack_midi_event_get(&raw_ev, midi_buf, i);
+    // the old state is no longer touched from here on, which jb_client_swap() waits for
+    bool swapped = false;
+    if (atomic_load_explicit(&cl->next_state, memory_order_relaxed)) {
+        cl->cfg.state = atomic_exchange_explicit(&cl->next_state, NULL, memory_order_acq_rel);
+        swapped = true;
+    }
 
-        ev.kind = raw_ev.buffer[MIDI_STATUS] & 0xf0;
-        ev.chan = raw_ev.buffer[MIDI_STATUS] & 0x0f;
-        ev.args[0] = raw_ev.buffer[MIDI_ARG0];
-        ev.args[1] = raw_ev.buffer[MIDI_ARG1];
+    // states start out with realtime settings, so one swapped in while freewheeling is told too
+    bool freewheel = atomic_load_explicit(&cl->freewheel, memory_order_relaxed);
+    if (freewheel != cl->freewheeling || (swapped && freewheel)) {
+        cl->freewheeling = freewheel;
+        atomic_store_explicit(&m->freewheel, freewheel, memory_order_relaxed);
 
-        cl->cfg.midi_cb(cl->cfg.state, ev);
+        if (cl->cfg.freewheel_cb) cl->cfg.freewheel_cb(cl->cfg.state, freewheel);
     }
 
+    // freewheeling cycles aren't realtime, and are free to wait (see jb_stream_read)
+    bool rt = !cl->freewheeling;
+    if (rt) jb_rt_enter();
+
+    jb_sample_t *audio_bufs[JB_PAIRS * JB_OUTS];
+
+    for (size_t o = 0; o < cl->n_audio_out; o++)
+        audio_bufs[o] = (jb_sample_t *)jack_port_get_buffer(cl->audio_out[o], nframes);
+
+    // timing is needed by both MIDI and audio callbacks, so fetch it first
     jack_get_cycle_times(
         cl->jack, &cl->ctx.cur_frames, &cl->ctx.time, &cl->ctx.next_usecs, &cl->ctx.period_usecs);
 
-    if (cl->cfg.audio_cb) cl->cfg.audio_cb(cl->cfg.state, cl->ctx, nframes, audio_buf);
+    // decode the whole cycle's MIDI up front, so that it's handed over in one go
+    size_t dropped = 0;
+    size_t len = midi_merge(cl, nframes, &dropped);
 
-    bool is_nan = false;
-    for (size_t i = 0; i < nframes; i++)
-        // check for NaN (NaN comparisons should always be false; IEEE floats will fail this
-        // condition if NaN)
-        if (audio_buf[i] != audio_buf[i]) is_nan = true;
+    if (dropped) atomic_fetch_add_explicit(&m->midi_drops, dropped, memory_order_relaxed);
 
-    if (is_nan) jb_warn("NaN samples detected");
+    atomic_fetch_add_explicit(&m->midi_events, len, memory_order_relaxed);
+
+    if (cl->cfg.midi_batch_cb) {
+        cl->cfg.midi_batch_cb(cl->cfg.state, cl->ctx, cl->events, len);
+    } else if (cl->cfg.midi_cb) {
+        for (size_t i = 0; i < len; i++) cl->cfg.midi_cb(cl->cfg.state, cl->ctx, cl->events[i]);
+    }
+
+    if (cl->cfg.audio_cb) cl->cfg.audio_cb(cl->cfg.state, cl->ctx, nframes, audio_bufs);
+
+    sanitise(cl, audio_bufs, nframes);
 
     cl->ctx.cur_sample += nframes;
 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    atomic_fetch_add_explicit(&m->cycles, 1, memory_order_relaxed);
+
+    // freewheeling cycles have no budget, and would only skew the callback's times
+    if (rt) {
+        uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+
+        atomic_store_explicit(
+            &m->period_ns, (uint64_t)nframes * 1000000000 / cl->ctx.srate, memory_order_relaxed);
+        jb_metrics_time(m, ns);
+    }
+
+    if (rt) jb_rt_leave();
     return 0;
 }
 
@@ -95,17 +228,43 @@ jb_res_t jb_client_init(jb_client_t *cl, jb_client_config_t cfg) {
 
     if (!cl->jack) return JB_ERR(JB_ERR_JACK, "failed  to open connection to JACK");
 
-    jb_debug("opening MIDI input port");
-    cl->midi_in =
-        jack_port_register(cl->jack, "midi_in", JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+    cl->n_midi_in = cfg.midi_ports ? cfg.midi_ports : 1;
+    if (cl->n_midi_in > JB_MIDI_PORTS)
+        return JB_ERR(JB_ERR_JACK, "at most %d MIDI input ports are supported", JB_MIDI_PORTS);
+
+    jb_debug("opening %zu MIDI input port(s)", cl->n_midi_in);
+    for (size_t p = 0; p < cl->n_midi_in; p++) {
+        // the first port keeps its old name, so existing connections still apply
+        char name[32] = "midi_in";
+        if (p > 0) snprintf(name, sizeof(name), "midi_in_%zu", p);
+
+        cl->midi_in[p] =
+            jack_port_register(cl->jack, name, JACK_DEFAULT_MIDI_TYPE, JackPortIsInput, 0);
+
+        if (!cl->midi_in[p]) return JB_ERR(JB_ERR_JACK, "failed to open MIDI input port '%s'", name);
+    }
+
+    size_t pairs = cfg.out_pairs ? cfg.out_pairs : 1;
+    if (pairs > JB_PAIRS)
+        return JB_ERR(JB_ERR_JACK, "at most %d pairs of audio outputs are supported", JB_PAIRS);
+
+    cl->n_audio_out = pairs * JB_OUTS;
 
-    if (!cl->midi_in) return JB_ERR(JB_ERR_JACK, "failed to open MIDI input port");
+    jb_debug("opening %zu pair(s) of audio output ports", pairs);
+    for (size_t o = 0; o < cl->n_audio_out; o++) {
+        // as with MIDI inputs, the first pair keeps the old names
+        char name[32];
+        if (o < JB_OUTS)
+            snprintf(name, sizeof(name), "%s", out_names[o]);
+        else
+            snprintf(name, sizeof(name), "%s_%zu", out_names[o % JB_OUTS], o / JB_OUTS);
 
-    jb_debug("opening audio output port");
-    cl->audio_out =
-        jack_port_register(cl->jack, "audio_out", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+        cl->audio_out[o] =
+            jack_port_register(cl->jack, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
 
-    if (!cl->audio_out) return JB_ERR(JB_ERR_JACK, "failed to open audio output port");
+        if (!cl->audio_out[o])
+            return JB_ERR(JB_ERR_JACK, "failed to open audio output port '%s'", name);
+    }
 
     jb_debug("installing callbacks");
 
@@ -114,19 +273,81 @@ jb_res_t jb_client_init(jb_client_t *cl, jb_client_config_t cfg) {
 
     jack_set_process_callback(cl->jack, jack_process, (void *)cl);
     jack_set_sample_rate_callback(cl->jack, jack_srate, (void *)cl);
-    jack_set_xrun_callback(cl->jack, jack_xrun, NULL);
+    jack_set_xrun_callback(cl->jack, jack_xrun, (void *)cl);
+    jack_set_freewheel_callback(cl->jack, jack_freewheel, (void *)cl);
 
+    cl->ctx.srate = jack_get_sample_rate(cl->jack);
     cl->ctx.cur_frames = 0;
     cl->ctx.cur_sample = 0;
     cl->ctx.next_usecs = 0;
     cl->ctx.period_usecs = 0;
     cl->ctx.time = 0;
 
+    // each input's channels map onto their own set of logical channels
+    memset(cl->dec, 0, sizeof(cl->dec));
+    for (size_t p = 0; p < JB_MIDI_PORTS; p++) cl->dec[p].base = p * JB_PORT_CHANS;
+
+    jb_metrics_init(&cl->metrics);
+    atomic_init(&cl->next_state, NULL);
+    atomic_init(&cl->freewheel, false);
+    cl->freewheeling = false;
+
+    return JB_OK_VAL;
+}
+
+// run the prepare callback on a state. `cl->ctx` belongs to the process callback once the client
+// is active, so the context is made up afresh
+static void prepare_state(jb_client_t *cl, void *state) {
+    if (!cl->cfg.prepare_cb) return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // best guess at what cycles will look like once activated
+    jack_nframes_t nframes = jack_get_buffer_size(cl->jack);
+    jb_ctx_t ctx = {.srate = jack_get_sample_rate(cl->jack)};
+    ctx.period_usecs = (float)nframes * 1000000.f / (float)ctx.srate;
+
+    cl->cfg.prepare_cb(state, ctx, nframes);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    jb_info("prepared for realtime use in %.2fms (%u frames/cycle)", ms, nframes);
+}
+
+jb_res_t jb_client_prepare(jb_client_t *cl) {
+    prepare_state(cl, cl->cfg.state);
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_client_swap(jb_client_t *cl, void *state) {
+    prepare_state(cl, state);
+
+    // the process callback picks the new state up at the start of its next cycle
+    atomic_store_explicit(&cl->next_state, state, memory_order_release);
+
+    for (long waited = 0; atomic_load(&cl->next_state); waited += SWAP_POLL_USECS) {
+        if (waited < SWAP_TIMEOUT_USECS) {
+            usleep(SWAP_POLL_USECS);
+            continue;
+        }
+
+        // take the state back, unless the callback got to it in the meantime
+        void *expected = state;
+        if (atomic_compare_exchange_strong(&cl->next_state, &expected, NULL))
+            return JB_ERR(JB_ERR_JACK, "process callback isn't running");
+    }
+
     return JB_OK_VAL;
 }
 
-jb_res_t jb_client_connect_midi(jb_client_t *cl, char *pat) {
-    const char *in_port_name = jack_port_name(cl->midi_in);
+jb_res_t jb_client_connect_midi(jb_client_t *cl, size_t port, char *pat) {
+    if (port >= cl->n_midi_in)
+        return JB_ERR(JB_ERR_JACK, "no MIDI input port %zu (%zu open)", port, cl->n_midi_in);
+
+    const char *in_port_name = jack_port_name(cl->midi_in[port]);
     const char **ports = jack_get_ports(cl->jack, pat, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput);
 
     if (!ports) return JB_ERR(JB_ERR_JACK, "failed to enumerate MIDI ports (pat = %s)", pat);
@@ -139,13 +360,18 @@ jb_res_t jb_client_connect_midi(jb_client_t *cl, char *pat) {
 }
 
 jb_res_t jb_client_connect_audio(jb_client_t *cl, char *pat) {
-    const char *out_port_name = jack_port_name(cl->audio_out);
     const char **ports = jack_get_ports(cl->jack, pat, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput);
 
     if (!ports) return JB_ERR(JB_ERR_JACK, "failed to enumerate audio ports (pat = %s)", pat);
 
+    // matching ports take turns between left and right, so `system:playback_*` gets left on 1,
+    // right on 2. every pair is connected the same way, and JACK mixes them
+    size_t o = 0;
     for (const char **cur = ports; *cur; cur++) {
-        jack_connect(cl->jack, out_port_name, *cur);
+        for (size_t p = 0; p < cl->n_audio_out; p += JB_OUTS)
+            jack_connect(cl->jack, jack_port_name(cl->audio_out[p + o]), *cur);
+
+        o = (o + 1) % JB_OUTS;
     }
 
     free(ports);
@@ -153,10 +379,47 @@ jb_res_t jb_client_connect_audio(jb_client_t *cl, char *pat) {
     return JB_OK_VAL;
 }
 
-jb_res_t jb_client_start(jb_client_t *cl) {
+// log the names of all ports of a given type and direction
+static jb_res_t list_ports(jb_client_t *cl, const char *type, unsigned long flags) {
+    const char **ports = jack_get_ports(cl->jack, "", type, flags);
+
+    if (!ports) return JB_ERR(JB_ERR_JACK, "failed to enumerate ports (type = %s)", type);
+
+    for (const char **cur = ports; *cur; cur++) jb_log_line(" * %s", *cur);
+
+    jack_free(ports);
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_client_list(jb_client_t *cl) {
+    jb_info("MIDI ports:");
+    JB_TRY(list_ports(cl, JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput));
+
+    jb_info("audio ports:");
+    JB_TRY(list_ports(cl, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput));
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_client_activate(jb_client_t *cl) {
     if (jack_activate(cl->jack) != 0) return JB_ERR(JB_ERR_JACK, "failed to activate JACK client");
 
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_client_start(jb_client_t *cl) {
+    JB_TRY(jb_client_activate(cl));
+
     getc(stdin);
 
     return JB_OK_VAL;
 }
+
+void jb_client_close(jb_client_t *cl) {
+    if (!cl->jack) return;
+
+    jack_deactivate(cl->jack);
+    jack_client_close(cl->jack);
+    cl->jack = NULL;
+}
@@ -0,0 +1,354 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// control.c: control server
+//
+// a line protocol over a local socket, for changing a running instance: each line is a command,
+// answered with a line starting `ok` or `error:`. connections are served one at a time, by a
+// thread of their own; nothing here runs on the audio thread
+//
+
+#include <errno.h>
+#include <jbase.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LINE_MAX 1024        // longest command line
+#define WAIT_USECS 50000     // time between checks for a `quit` command
+
+// a command's reply
+typedef struct {
+    char buf[LINE_MAX];
+} reply_t;
+
+#define REPLY(r, ...) snprintf((r)->buf, sizeof((r)->buf), __VA_ARGS__)
+
+// reply to a failed command, freeing the error
+static void reply_err(reply_t *r, jb_res_t res) {
+    REPLY(r, "error: %s", res.msg);
+    free(res.msg);
+}
+
+// `[PORT].[CHAN]` or a logical channel
+static bool parse_chan(const char *str, uint8_t *out) {
+    unsigned port = 0, chan;
+    char end;
+
+    if (sscanf(str, "%u.%u%c", &port, &chan, &end) == 2) {
+        if (port >= JB_MIDI_PORTS || chan >= JB_PORT_CHANS) return false;
+        chan += port * JB_PORT_CHANS;
+    } else if (sscanf(str, "%u%c", &chan, &end) != 1 || chan >= JB_CHANS) {
+        return false;
+    }
+
+    *out = chan;
+    return true;
+}
+
+// MIDI data byte
+static bool parse_byte(const char *str, uint8_t *out) {
+    unsigned val;
+    char end;
+
+    if (sscanf(str, "%u%c", &val, &end) != 1 || val > 127) return false;
+
+    *out = val;
+    return true;
+}
+
+static void queue(jb_control_t *ctl, jb_cmd_t cmd, reply_t *r) {
+    if (jb_engine_command(ctl->eng, cmd))
+        REPLY(r, "ok");
+    else
+        REPLY(r, "error: command queue full");
+}
+
+// `note [CHAN] [NOTE] [VEL]?`, `off [CHAN] [NOTE]` and `cc [CHAN] [CC] [VAL]`
+static void cmd_midi(jb_control_t *ctl, uint8_t kind, char **args, size_t len, reply_t *r) {
+    jb_midi_t ev = {.kind = kind};
+
+    size_t want = kind == JB_NOTE_OFF ? 2 : 3;
+    bool ok = len == want || (kind == JB_NOTE_ON && len == 2);
+
+    ok = ok && parse_chan(args[0], &ev.chan) && parse_byte(args[1], &ev.args[0]);
+    if (ok && len == 3) ok = parse_byte(args[2], &ev.args[1]);
+
+    if (!ok) {
+        REPLY(r, "error: bad arguments");
+        return;
+    }
+
+    if (kind == JB_NOTE_ON && len == 2) ev.args[JB_VELOCITY] = 100;
+
+    queue(ctl, (jb_cmd_t){.kind = JB_CMD_MIDI, .midi = ev}, r);
+}
+
+// `set ([CHAN]:)? [TARGET] [VALUE]`
+static void cmd_set(jb_control_t *ctl, const char *src, reply_t *r) {
+    jb_route_t param;
+    float val;
+
+    jb_res_t res = jb_parse_param(ctl->patch, src, &param, &val);
+    if (res JB_IS_ERR) {
+        reply_err(r, res);
+        return;
+    }
+
+    jb_cmd_t cmd = {.kind = JB_CMD_SET, .target = param.target, .idx = param.idx, .val = val};
+    queue(ctl, cmd, r);
+}
+
+// play a freshly compiled patch set in place of the current one
+static jb_res_t load(jb_control_t *ctl, const char *path) {
+    jb_def_t *defs = NULL;
+    jb_res_t res = jb_defs_read(path, &defs);
+
+    jb_patch_t *patch = malloc(sizeof(*patch));
+    jb_engine_t *eng = malloc(sizeof(*eng));
+    bool have_eng = false;
+
+    if (res JB_IS_OK && (!patch || !eng)) res = JB_ERR(JB_ERR_OOM, "failed to allocate engine");
+
+    if (res JB_IS_OK) {
+        jb_patch_init(patch);
+        res = jb_patch_compile(patch, defs, jb_buf_len(defs));
+    }
+
+    if (res JB_IS_OK) {
+        res = jb_engine_init(eng, patch, ctl->eng->pool.cap);
+        have_eng = res JB_IS_OK;
+    }
+
+    if (res JB_IS_OK) {
+        eng->accurate = ctl->eng->accurate;
+        eng->metrics = ctl->eng->metrics;
+        eng->meter = ctl->eng->meter;
+
+        res = jb_client_swap(ctl->cl, eng);
+    }
+
+    jb_defs_free(defs);
+
+    if (res JB_IS_ERR) {
+        if (have_eng) jb_engine_free(eng);
+        if (patch) jb_patch_free(patch);
+        free(eng);
+        free(patch);
+        return res;
+    }
+
+    // the audio thread has let go of the old engine
+    if (ctl->owned) {
+        jb_engine_free(ctl->eng);
+        jb_patch_free(ctl->patch);
+        free(ctl->eng);
+        free(ctl->patch);
+    }
+
+    ctl->eng = eng;
+    ctl->patch = patch;
+    ctl->owned = true;
+
+    jb_info("loaded patch set from '%s'", path);
+    jb_patch_log(patch);
+
+    return JB_OK_VAL;
+}
+
+static void cmd_status(jb_control_t *ctl, reply_t *r) {
+    const jb_metrics_t *m = &ctl->cl->metrics;
+
+    REPLY(r,
+          "ok cycles=%llu xruns=%llu voices=%llu insts=%zu oscs=%zu accurate=%d",
+          (unsigned long long)atomic_load(&m->cycles),
+          (unsigned long long)atomic_load(&m->xruns),
+          (unsigned long long)atomic_load(&m->voices),
+          ctl->patch->n_insts,
+          ctl->patch->n_oscs,
+          ctl->eng->accurate);
+}
+
+static void command(jb_control_t *ctl, char *line, reply_t *r) {
+    char *rest = line + strspn(line, " \t");
+    char *name = strsep(&rest, " \t");
+
+    // `set` hands the rest of the line to the patch parser; everything else takes plain words
+    if (strcmp(name, "set") == 0) {
+        cmd_set(ctl, rest ? rest : "", r);
+        return;
+    }
+
+    char *args[4];
+    size_t len = 0;
+
+    for (char *tok; rest && len < 4 && (tok = strsep(&rest, " \t"));)
+        if (*tok) args[len++] = tok;
+
+    if (strcmp(name, "note") == 0) {
+        cmd_midi(ctl, JB_NOTE_ON, args, len, r);
+    } else if (strcmp(name, "off") == 0) {
+        cmd_midi(ctl, JB_NOTE_OFF, args, len, r);
+    } else if (strcmp(name, "cc") == 0) {
+        cmd_midi(ctl, JB_CTRL, args, len, r);
+    } else if (strcmp(name, "load") == 0 && len == 1) {
+        jb_res_t res = load(ctl, args[0]);
+
+        if (res JB_IS_OK)
+            REPLY(r, "ok");
+        else
+            reply_err(r, res);
+    } else if (strcmp(name, "status") == 0) {
+        cmd_status(ctl, r);
+    } else if (strcmp(name, "quit") == 0) {
+        atomic_store(&ctl->quit, true);
+        REPLY(r, "ok");
+    } else {
+        REPLY(r, "error: unknown command '%s'", name);
+    }
+}
+
+static bool send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+// answer each line on a connection until it's closed
+static void serve_conn(jb_control_t *ctl, int fd) {
+    char buf[LINE_MAX];
+    size_t len = 0;
+
+    while (!atomic_load(&ctl->quit)) {
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        len += n;
+
+        char *line = buf;
+        char *end;
+
+        while ((end = memchr(line, '\n', buf + len - line))) {
+            *end = '\0';
+            if (end > line && end[-1] == '\r') end[-1] = '\0';
+
+            reply_t r = {.buf = ""};
+            if (line[strspn(line, " \t")] != '\0') command(ctl, line, &r);
+
+            if (r.buf[0] != '\0') {
+                size_t rlen = strlen(r.buf);
+                r.buf[rlen] = '\n';
+
+                if (!send_all(fd, r.buf, rlen + 1)) return;
+            }
+
+            line = end + 1;
+        }
+
+        // keep any partial line for the next read
+        len = buf + len - line;
+        memmove(buf, line, len);
+
+        if (len == sizeof(buf)) {
+            const char *msg = "error: line too long\n";
+            send_all(fd, msg, strlen(msg));
+            return;
+        }
+    }
+}
+
+static void *serve(void *arg) {
+    jb_control_t *ctl = arg;
+
+    for (;;) {
+        int fd = accept(ctl->sock.fd, NULL, NULL);
+
+        if (fd < 0 && errno == EINTR) continue;
+        if (fd < 0) break; // socket shut down by jb_control_stop()
+
+        atomic_store(&ctl->conn, fd);
+        serve_conn(ctl, fd);
+        atomic_store(&ctl->conn, -1);
+
+        close(fd);
+    }
+
+    return NULL;
+}
+
+jb_res_t jb_control_serve(jb_control_t *ctl, jb_client_t *cl, jb_engine_t *eng, jb_patch_t *patch,
+                          const char *addr) {
+    ctl->cl = cl;
+    ctl->eng = eng;
+    ctl->patch = patch;
+    ctl->owned = false;
+
+    atomic_init(&ctl->conn, -1);
+    atomic_init(&ctl->quit, false);
+
+    JB_TRY(jb_sock_listen(&ctl->sock, addr));
+
+    int err = pthread_create(&ctl->thread, NULL, serve, ctl);
+    if (err != 0) {
+        jb_sock_close(&ctl->sock);
+        return JB_ERR(JB_ERR_LIBC, "failed to start control server: %s", strerror(err));
+    }
+
+    jb_info("serving control commands on '%s'", addr);
+
+    return JB_OK_VAL;
+}
+
+void jb_control_wait(jb_control_t *ctl) {
+    while (!atomic_load(&ctl->quit)) usleep(WAIT_USECS);
+}
+
+void jb_control_stop(jb_control_t *ctl) {
+    if (ctl->sock.fd < 0) return;
+
+    atomic_store(&ctl->quit, true);
+
+    jb_sock_wake(&ctl->sock);
+
+    int conn = atomic_load(&ctl->conn);
+    if (conn >= 0) shutdown(conn, SHUT_RDWR);
+
+    pthread_join(ctl->thread, NULL);
+    jb_sock_close(&ctl->sock);
+
+    if (ctl->owned) {
+        jb_engine_free(ctl->eng);
+        jb_patch_free(ctl->patch);
+        free(ctl->eng);
+        free(ctl->patch);
+        ctl->owned = false;
+    }
+}
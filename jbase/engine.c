@@ -0,0 +1,1069 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// engine.c: synth engine
+//
+// plays a compiled patch set: gives each note sounding on an instrument a voice from a shared pool,
+// steps voices through their envelopes, and mixes every instrument assigned to a channel into the output buffer.
+// sounding voices of an instrument are rendered JB_LANES at a time by vsynth.c. controllers are
+// routed by the patch set's per-channel tables onto ramps that move once per cycle
+//
+
+#include <jbase.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// address space reserved for engine state; only what's used is ever committed
+#define ENGINE_RESERVE JB_GiB(1)
+
+// cycles rendered through each instrument while preparing the engine
+#define WARMUP_CYCLES 4
+// note played through each instrument while warming up (A4)
+#define WARMUP_NOTE 69
+
+// time taken for a controlled parameter to reach a new value
+#define RAMP_USECS 10000
+
+// frames of a sample read from its stream at once
+#define STREAM_BLOCK 256
+
+// groups of JB_LANES partials needed for `n` partials
+#define PARTIAL_GROUPS(n) (((n) + JB_LANES - 1) / JB_LANES)
+
+// give a voice back to the pool, along with its stream
+static void voice_free(jb_engine_t *eng, jb_voice_t *voice) {
+    if (voice->stream != JB_NONE) jb_stream_stop(&eng->sampler, voice->stream);
+    jb_pool_free(&eng->pool, voice);
+}
+
+// silence every voice
+static void voices_reset(jb_engine_t *eng) {
+    for (size_t i = 0; i < eng->patch->n_insts; i++) {
+        jb_voice_bank_t *bank = &eng->banks[i];
+
+        for (uint32_t idx = bank->voices; idx != JB_NONE;) {
+            jb_voice_t *voice = jb_pool_at(&eng->pool, idx);
+            idx = voice->next;
+            voice_free(eng, voice);
+        }
+
+        bank->voices = JB_NONE;
+        bank->last = JB_NONE;
+    }
+}
+
+// whether an instrument plays a sample (which is then its whole chain)
+static bool inst_is_sampler(const jb_patch_t *pt, const jb_inst_t *inst) {
+    return pt->oscs[pt->links[inst->chain].osc].sample != JB_NONE;
+}
+
+// whether an instrument plays partials (which are then its whole chain)
+static bool inst_is_additive(const jb_patch_t *pt, const jb_inst_t *inst) {
+    return pt->oscs[pt->links[inst->chain].osc].partials != JB_NONE;
+}
+
+static jb_ramp_t ramp_init(jb_target_t target, uint32_t idx, float val) {
+    return (jb_ramp_t){.target = target, .idx = idx, .prev = val, .cur = val, .goal = val};
+}
+
+// put every controlled parameter back to its value in the patch set
+static void params_reset(jb_engine_t *eng) {
+    const jb_patch_t *pt = eng->patch;
+
+    memcpy(eng->oscs, pt->oscs, pt->n_oscs * sizeof(*eng->oscs));
+
+    for (uint32_t i = 0; i < JB_CHANS; i++) {
+        eng->mix[i].vol = ramp_init(JB_TARGET_VOL, i, 1.0);
+        eng->mix[i].pan = ramp_init(JB_TARGET_PAN, i, 0.5);
+        eng->mix[i].bend = 0.0;
+    }
+
+    for (size_t i = 0; i < pt->n_routes; i++) {
+        const jb_route_t *route = &pt->routes[i];
+        const jb_osc_t *osc = &pt->oscs[route->idx];
+
+        switch (route->target) {
+            case JB_TARGET_AMP:
+                eng->ramps[i] = ramp_init(route->target, route->idx, osc->amp);
+                break;
+            case JB_TARGET_BIAS:
+                eng->ramps[i] = ramp_init(route->target, route->idx, osc->bias);
+                break;
+            case JB_TARGET_WAVE:
+                eng->ramps[i] = ramp_init(route->target, route->idx, osc->wave);
+                break;
+            default:
+                // channel routes use the channel's ramps
+                break;
+        }
+    }
+
+    eng->n_moving = 0;
+}
+
+jb_res_t jb_engine_init(jb_engine_t *eng, const jb_patch_t *patch, size_t voices) {
+    eng->patch = patch;
+    eng->accurate = false;
+    eng->freewheel = false;
+    eng->metrics = NULL;
+    eng->meter = NULL;
+    eng->chan_len = 0;
+    eng->voices = 0;
+    eng->in_rack = false;
+    eng->pending = NULL;
+    eng->n_pending = 0;
+    atomic_init(&eng->cmd_head, 0);
+    atomic_init(&eng->cmd_tail, 0);
+
+    JB_TRY(jb_patch_check(patch));
+
+    JB_TRY(jb_arena_init(&eng->arena, ENGINE_RESERVE, 0));
+
+    eng->banks = JB_ARENA_NEW(&eng->arena, jb_voice_bank_t, patch->n_insts);
+    if (!eng->banks && patch->n_insts) goto oom;
+
+    for (size_t i = 0; i < patch->n_insts; i++)
+        eng->banks[i] = (jb_voice_bank_t){.voices = JB_NONE, .last = JB_NONE};
+
+    eng->oscs = JB_ARENA_NEW(&eng->arena, jb_osc_t, patch->n_oscs);
+    eng->ramps = JB_ARENA_NEW(&eng->arena, jb_ramp_t, patch->n_routes);
+    eng->mix = JB_ARENA_NEW(&eng->arena, jb_mix_t, JB_CHANS);
+    eng->noise = JB_ARENA_NEW(&eng->arena, jb_vu_t, 1);
+    // a ramp can only be on the moving list once
+    eng->moving = JB_ARENA_NEW(&eng->arena, jb_ramp_t *, patch->n_routes + 2 * JB_CHANS);
+
+    if ((!eng->oscs && patch->n_oscs) || (!eng->ramps && patch->n_routes) || !eng->mix ||
+        !eng->noise || !eng->moving)
+        goto oom;
+
+    jb_noise_init(eng->noise);
+
+    // every voice gets room for the most partials any oscillator has, so that a voice can go to
+    // any instrument; patch sets with nothing additive don't pay for it
+    eng->partial_groups = 0;
+    for (size_t i = 0; i < patch->n_oscs; i++)
+        if (patch->oscs[i].partials != JB_NONE)
+            eng->partial_groups =
+                JB_MAX(eng->partial_groups, PARTIAL_GROUPS(patch->oscs[i].n_partials));
+
+    eng->partials = NULL;
+    if (eng->partial_groups) {
+        eng->partials = JB_ARENA_NEW(&eng->arena, jb_partials_v_t, eng->partial_groups * voices);
+        if (!eng->partials) goto oom;
+    }
+
+    jb_res_t res = JB_POOL_INIT(&eng->pool, &eng->arena, jb_voice_t, voices);
+    if (res JB_IS_OK) res = jb_sampler_init(&eng->sampler, patch, &eng->arena);
+
+    if (res JB_IS_ERR) {
+        jb_arena_free(&eng->arena);
+        return res;
+    }
+
+    params_reset(eng);
+
+    return JB_OK_VAL;
+
+oom:
+    jb_arena_free(&eng->arena);
+    return JB_ERR(JB_ERR_OOM, "failed to allocate voices");
+}
+
+void jb_engine_free(jb_engine_t *eng) {
+    jb_sampler_free(&eng->sampler);
+    jb_arena_free(&eng->arena);
+    eng->banks = NULL;
+    eng->oscs = NULL;
+    eng->ramps = NULL;
+    eng->mix = NULL;
+    eng->moving = NULL;
+    eng->noise = NULL;
+    eng->partials = NULL;
+}
+
+// move a voice onto a new envelope stage
+static void voice_enter(jb_voice_t *voice, uint32_t stage, jack_time_t time) {
+    voice->stage = stage;
+    voice->time = time;
+    voice->start_ramp = voice->ramp;
+}
+
+// voice of an instrument playing a note, if any
+static jb_voice_t *voice_find(jb_engine_t *eng, const jb_voice_bank_t *bank, uint32_t note) {
+    for (uint32_t idx = bank->voices; idx != JB_NONE;) {
+        jb_voice_t *voice = jb_pool_at(&eng->pool, idx);
+        if (voice->note == note) return voice;
+
+        idx = voice->next;
+    }
+
+    return NULL;
+}
+
+// link to the voice after `idx` in an instrument's list
+static uint32_t *voice_next(jb_engine_t *eng, uint32_t idx) {
+    return &((jb_voice_t *)jb_pool_at(&eng->pool, idx))->next;
+}
+
+// add a voice to an instrument, keeping its voices in note order (the order they're mixed in)
+static void voice_link(jb_engine_t *eng, jb_voice_bank_t *bank, jb_voice_t *voice) {
+    uint32_t *link = &bank->voices;
+    while (*link != JB_NONE && ((jb_voice_t *)jb_pool_at(&eng->pool, *link))->note < voice->note)
+        link = voice_next(eng, *link);
+
+    voice->next = *link;
+    *link = jb_pool_index(&eng->pool, voice);
+}
+
+static void voice_unlink(jb_engine_t *eng, jb_voice_bank_t *bank, jb_voice_t *voice) {
+    uint32_t idx = jb_pool_index(&eng->pool, voice);
+    uint32_t *link = &bank->voices;
+
+    while (*link != idx) link = voice_next(eng, *link);
+
+    *link = voice->next;
+}
+
+// partial bank of a voice (additive instruments)
+static jb_partials_v_t *voice_partials(jb_engine_t *eng, jb_voice_t *voice) {
+    return eng->partials + jb_pool_index(&eng->pool, voice) * eng->partial_groups;
+}
+
+// take a voice for a note from the pool. returns NULL, and counts a dropped voice, if the pool is
+// empty
+static jb_voice_t *voice_alloc(jb_engine_t *eng, jb_voice_bank_t *bank, uint8_t note) {
+    jb_voice_t *voice = JB_POOL_ALLOC(&eng->pool, jb_voice_t);
+
+    if (!voice) {
+        if (eng->metrics)
+            atomic_fetch_add_explicit(&eng->metrics->voice_drops, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    voice->note = note;
+    voice->stage = JB_NONE;
+    voice->ramp = 0.0;
+    voice->stream = JB_NONE;
+    voice->partials = 0;
+    voice_link(eng, bank, voice);
+
+    return voice;
+}
+
+static void note_off(jb_engine_t *eng, jb_ctx_t ctx, uint32_t inst, uint8_t note) {
+    const jb_env_t *env = &eng->patch->envs[eng->patch->insts[inst].env];
+    jb_voice_t *voice = voice_find(eng, &eng->banks[inst], note);
+
+    if (voice && env->release != JB_NONE && voice->stage != JB_NONE)
+        voice_enter(voice, env->release, ctx.time);
+}
+
+// whether a voice is sounding and hasn't been released
+static bool voice_held(const jb_env_t *env, const jb_voice_t *voice) {
+    return voice->stage != JB_NONE && (env->release == JB_NONE || voice->stage < env->release);
+}
+
+// pitch offset of a voice's glide at `now`, moving linearly in cents (so exponentially in
+// frequency) from where it started to nothing
+static float glide_offset(const jb_inst_t *inst, const jb_voice_t *voice, jack_time_t now) {
+    if (voice->glide == 0.0 || inst->glide == 0) return 0.0;
+    if (now <= voice->glide_time) return voice->glide;
+
+    float t = (float)(now - voice->glide_time) / (float)inst->glide;
+    return t >= 1.0f ? 0.0 : voice->glide * (1.0f - t);
+}
+
+// start a note on an instrument, on a channel bent by `bend` cents
+static void note_on(jb_engine_t *eng, jb_ctx_t ctx, uint32_t inst, uint8_t note, uint8_t vel,
+                    float bend) {
+    const jb_patch_t *pt = eng->patch;
+    const jb_inst_t *in = &pt->insts[inst];
+    const jb_env_t *env = &pt->envs[in->env];
+    jb_voice_bank_t *bank = &eng->banks[inst];
+
+    // a note on with no velocity is treated as a note off
+    if (vel == 0) {
+        note_off(eng, ctx, inst, note);
+        return;
+    }
+
+    jb_voice_t *voice = voice_find(eng, bank, note);
+
+    // glides start from wherever the last note played had got to. legato instruments only glide
+    // between overlapping notes, which share a voice
+    jb_voice_t *last = bank->last != JB_NONE ? voice_find(eng, bank, bank->last) : NULL;
+    bool held = last && voice_held(env, last);
+    bool legato = in->legato && held && last != voice;
+    float from = 0.0;
+
+    if (in->glide && bank->last != JB_NONE && (!in->legato || held))
+        from = JB_SEMIS((float)bank->last - note) +
+               (last ? glide_offset(in, last, ctx.time) : 0.0);
+
+    if (legato) {
+        // the held voice moves to the new note, its envelope and phases carrying on where they
+        // had got to
+        if (voice) {
+            voice_unlink(eng, bank, voice);
+            voice_free(eng, voice);
+        }
+
+        voice = last;
+        voice_unlink(eng, bank, voice);
+        voice->note = note;
+        voice_link(eng, bank, voice);
+    } else if (!voice) {
+        voice = voice_alloc(eng, bank, note);
+        if (!voice) return;
+    }
+
+    voice->velocity = vel;
+
+    if (inst_is_sampler(pt, in)) {
+        const jb_osc_t *osc = &eng->oscs[pt->links[in->chain].osc];
+        uint32_t wav = eng->sampler.osc_wav[pt->links[in->chain].osc];
+
+        // samplers keep their unbent rate where chains keep their phase steps
+        float rate = jb_cents_hz(JB_SEMIS(note) + osc->detune) / jb_cents_hz(osc->root) *
+                     eng->sampler.wavs[wav].srate / ctx.srate;
+        voice->step[0] = rate;
+
+        if (!legato) {
+            // a retriggered sample starts again from its beginning
+            if (voice->stream != JB_NONE) jb_stream_stop(&eng->sampler, voice->stream);
+
+            float bent = rate * exp2f((from + bend) / 1200);
+            voice->stream = jb_stream_start(&eng->sampler, wav, bent);
+        }
+
+        if (voice->stream == JB_NONE) {
+            if (eng->metrics)
+                atomic_fetch_add_explicit(&eng->metrics->underruns, 1, memory_order_relaxed);
+            voice->stage = JB_NONE;
+            return;
+        }
+    } else if (inst_is_additive(pt, in)) {
+        const jb_osc_t *osc = &eng->oscs[pt->links[in->chain].osc];
+        const jb_partial_t *partials = &pt->partials[osc->partials];
+
+        // partials that would be over nyquist for the note are never rendered. those that a bend
+        // or glide later takes over it fade out instead (see jb_partials_render_v)
+        float step = jb_osc_step(osc, JB_SEMIS(note), ctx.srate);
+        uint32_t n = osc->n_partials;
+        while (n > 0 && partials[n - 1].ratio * step >= (float)M_PI) n--;
+
+        // a retriggered voice carries on from the partials it was already playing, to avoid a
+        // click; the rest start from zero phase and amplitude
+        jb_partials_v_t *state = voice_partials(eng, voice);
+        uint32_t held = voice->stage == JB_NONE ? 0 : voice->partials;
+        jb_vf_t zero = {0};
+
+        for (size_t g = PARTIAL_GROUPS(held); g < PARTIAL_GROUPS(n); g++)
+            state[g] = (jb_partials_v_t){.re = zero + 1, .im = zero, .amp = zero};
+
+        voice->step[0] = step;
+        voice->partials = JB_MAX(n, held);
+    } else {
+        // a retriggered voice carries on from its current phase, to avoid a click
+        for (size_t i = 0; i < in->len; i++) {
+            const jb_osc_t *osc = &eng->oscs[pt->links[in->chain + i].osc];
+
+            if (voice->stage == JB_NONE) voice->phase[i] = 0.0;
+            voice->step[i] = jb_osc_step(osc, JB_SEMIS(note), ctx.srate);
+        }
+    }
+
+    if (!legato) voice_enter(voice, env->start, ctx.time);
+
+    voice->glide = from;
+    voice->glide_time = ctx.time;
+    voice->cents = from + bend;
+    bank->last = note;
+}
+
+// start moving a ramp towards a new value, reaching it after RAMP_USECS
+static void ramp_set(jb_engine_t *eng, jb_ctx_t ctx, jb_ramp_t *ramp, float val) {
+    float cycles = ctx.period_usecs > 0 ? RAMP_USECS / ctx.period_usecs : 1;
+
+    // wave kinds can't be blended, so they change in one go
+    if (cycles < 1 || ramp->target == JB_TARGET_WAVE) cycles = 1;
+
+    ramp->goal = val;
+    ramp->step = (ramp->goal - ramp->cur) / cycles;
+
+    if (!ramp->moving) {
+        ramp->moving = true;
+        eng->moving[eng->n_moving++] = ramp;
+    }
+}
+
+static void control(jb_engine_t *eng, jb_ctx_t ctx, uint8_t chan, uint8_t cc, uint8_t val) {
+    uint32_t idx = eng->patch->chans[chan].ccs[cc];
+    if (idx == JB_NONE) return;
+
+    const jb_route_t *route = &eng->patch->routes[idx];
+    float x = (float)val / 127.f;
+
+    switch (route->curve) {
+        case JB_CURVE_EXP:
+            x = x * x;
+            break;
+        case JB_CURVE_LOG:
+            x = 1 - (1 - x) * (1 - x);
+            break;
+        default:
+            break;
+    }
+
+    jb_ramp_t *ramp;
+    switch (route->target) {
+        case JB_TARGET_VOL:
+            ramp = &eng->mix[route->idx].vol;
+            break;
+        case JB_TARGET_PAN:
+            ramp = &eng->mix[route->idx].pan;
+            break;
+        default:
+            ramp = &eng->ramps[idx];
+    }
+
+    ramp_set(eng, ctx, ramp, route->lo + (route->hi - route->lo) * x);
+}
+
+void jb_engine_midi(void *state, jb_ctx_t ctx, jb_midi_t ev) {
+    jb_engine_t *eng = (jb_engine_t *)state;
+    const jb_chan_t *chan = &eng->patch->chans[ev.chan];
+
+    // controllers and pitch bend apply to the channel as a whole
+    if (ev.kind == JB_CTRL) {
+        control(eng, ctx, ev.chan, ev.args[JB_CONTROLLER] & 0x7f, ev.args[JB_VALUE] & 0x7f);
+        return;
+    }
+
+    // voices pick the new bend up over the next span they render
+    if (ev.kind == JB_PITCH_BEND) {
+        eng->mix[ev.chan].bend = (float)JB_BEND_VALUE(ev) * chan->bend / 8192;
+        return;
+    }
+
+    for (size_t i = 0; i < chan->len; i++) {
+        switch (ev.kind) {
+            case JB_NOTE_ON:
+                note_on(eng,
+                        ctx,
+                        chan->insts[i],
+                        ev.args[JB_NOTE] & 0x7f,
+                        ev.args[JB_VELOCITY],
+                        eng->mix[ev.chan].bend);
+                break;
+
+            case JB_NOTE_OFF:
+                note_off(eng, ctx, chan->insts[i], ev.args[JB_NOTE] & 0x7f);
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+void jb_engine_midi_batch(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len) {
+    JB_ZONE_ARG("midi", len);
+
+    jb_engine_t *eng = (jb_engine_t *)state;
+
+    // sample-accurate events are applied by jb_engine_audio() as it reaches their frame. the
+    // client keeps the batch around until the next cycle
+    if (eng->accurate || eng->freewheel) {
+        eng->pending = evs;
+        eng->n_pending = len;
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) jb_engine_midi(state, ctx, evs[i]);
+}
+
+bool jb_engine_command(jb_engine_t *eng, jb_cmd_t cmd) {
+    uint32_t head = atomic_load_explicit(&eng->cmd_head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&eng->cmd_tail, memory_order_acquire) == JB_CMDS) {
+        if (eng->metrics)
+            atomic_fetch_add_explicit(&eng->metrics->cmd_drops, 1, memory_order_relaxed);
+        return false;
+    }
+
+    eng->cmds[head & (JB_CMDS - 1)] = cmd;
+    atomic_store_explicit(&eng->cmd_head, head + 1, memory_order_release);
+
+    return true;
+}
+
+// set a parameter outright. oscillator parameters that are routed move along their route's ramp,
+// so that a controller picks up from the new value; others change in one go
+static void param_set(jb_engine_t *eng, jb_ctx_t ctx, jb_target_t target, uint32_t idx, float val) {
+    switch (target) {
+        case JB_TARGET_VOL:
+            ramp_set(eng, ctx, &eng->mix[idx].vol, val);
+            return;
+        case JB_TARGET_PAN:
+            ramp_set(eng, ctx, &eng->mix[idx].pan, val);
+            return;
+        default:
+            break;
+    }
+
+    bool routed = false;
+    for (size_t i = 0; i < eng->patch->n_routes; i++) {
+        if (eng->ramps[i].target == target && eng->ramps[i].idx == idx) {
+            ramp_set(eng, ctx, &eng->ramps[i], val);
+            routed = true;
+        }
+    }
+
+    if (routed) return;
+
+    jb_osc_t *osc = &eng->oscs[idx];
+    switch (target) {
+        case JB_TARGET_AMP:
+            osc->amp = val;
+            break;
+        case JB_TARGET_BIAS:
+            osc->bias = val;
+            break;
+        case JB_TARGET_WAVE: {
+            long wave = lrintf(val);
+            osc->wave = wave < 0 ? 0 : wave >= JB_WAVE_MAX ? JB_WAVE_MAX - 1 : wave;
+        } break;
+        default:
+            break;
+    }
+}
+
+// apply commands queued since the last cycle
+static void commands_process(jb_engine_t *eng, jb_ctx_t ctx) {
+    uint32_t head = atomic_load_explicit(&eng->cmd_head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&eng->cmd_tail, memory_order_relaxed);
+
+    for (; tail != head; tail++) {
+        const jb_cmd_t *cmd = &eng->cmds[tail & (JB_CMDS - 1)];
+
+        switch (cmd->kind) {
+            case JB_CMD_MIDI:
+                jb_engine_midi(eng, ctx, cmd->midi);
+                break;
+            case JB_CMD_SET:
+                param_set(eng, ctx, cmd->target, cmd->idx, cmd->val);
+                break;
+        }
+    }
+
+    atomic_store_explicit(&eng->cmd_tail, tail, memory_order_release);
+}
+
+// context as of a frame into the current cycle
+static jb_ctx_t ctx_at(jb_ctx_t ctx, size_t frame) {
+    if (ctx.srate) ctx.time += (jack_time_t)frame * 1000000 / ctx.srate;
+    ctx.cur_sample += frame;
+
+    return ctx;
+}
+
+// step a voice's envelope forward to the current time
+static void env_process(const jb_patch_t *pt, const jb_env_t *env, jb_voice_t *voice,
+                        jack_time_t now) {
+    if (voice->stage == JB_NONE) {
+        voice->ramp = 0.0;
+        return;
+    }
+
+    const jb_env_stage_t *stage = &pt->stages[voice->stage];
+
+    if (stage->time == JB_ENV_SUSTAIN) {
+        voice->ramp = voice->start_ramp;
+        return;
+    }
+
+    float t = JB_MIN((float)(now - voice->time) / (float)stage->time, 1.0f);
+    voice->ramp = (1.0 - t) * voice->start_ramp + t * stage->amp;
+
+    if (voice->time + stage->time < now) {
+        uint32_t next = voice->stage + 1;
+        voice_enter(voice, next < env->start + env->len ? next : JB_NONE, now);
+    }
+}
+
+// step every moving ramp forward a cycle, and apply oscillator parameters. ramps that have reached
+// their goal stay on the list for one more cycle, so that `prev` catches up with `cur`
+static void params_process(jb_engine_t *eng) {
+    JB_ZONE_ARG("params", eng->n_moving);
+
+    for (size_t i = 0; i < eng->n_moving;) {
+        jb_ramp_t *ramp = eng->moving[i];
+        ramp->prev = ramp->cur;
+
+        if (ramp->cur == ramp->goal) {
+            ramp->moving = false;
+            eng->moving[i] = eng->moving[--eng->n_moving];
+            continue;
+        }
+
+        ramp->cur += ramp->step;
+
+        if (ramp->step == 0 || (ramp->step > 0 && ramp->cur > ramp->goal) ||
+            (ramp->step < 0 && ramp->cur < ramp->goal))
+            ramp->cur = ramp->goal;
+
+        jb_osc_t *osc = &eng->oscs[ramp->idx];
+
+        switch (ramp->target) {
+            case JB_TARGET_AMP:
+                osc->amp = ramp->cur;
+                break;
+            case JB_TARGET_BIAS:
+                osc->bias = ramp->cur;
+                break;
+            case JB_TARGET_WAVE: {
+                long wave = lrintf(ramp->cur);
+                osc->wave = wave < 0 ? 0 : wave >= JB_WAVE_MAX ? JB_WAVE_MAX - 1 : wave;
+            } break;
+            default:
+                // channel parameters are read by the renderer
+                break;
+        }
+
+        i++;
+    }
+}
+
+// gain applied to each output, interpolated across a cycle
+typedef struct {
+    float start[JB_OUTS]; // gain at first frame
+    float step[JB_OUTS];  // change per frame
+} gain_t;
+
+// constant-power pan of a channel
+static void pan_gains(float vol, float pan, float out[JB_OUTS]) {
+    out[0] = vol * cosf(pan * (float)M_PI / 2);
+    out[1] = vol * sinf(pan * (float)M_PI / 2);
+}
+
+static gain_t mix_gain(const jb_mix_t *mix, size_t nframes) {
+    float start[JB_OUTS], end[JB_OUTS];
+    pan_gains(mix->vol.prev, mix->pan.prev, start);
+    pan_gains(mix->vol.cur, mix->pan.cur, end);
+
+    gain_t gain;
+    for (size_t i = 0; i < JB_OUTS; i++) {
+        gain.start[i] = start[i];
+        gain.step[i] = nframes ? (end[i] - start[i]) / nframes : 0;
+    }
+
+    return gain;
+}
+
+// pitch offset a voice should reach by `now` (in cents), on a channel bent by `bend` cents
+static float voice_cents(const jb_inst_t *inst, const jb_voice_t *voice, jack_time_t now,
+                         float bend) {
+    return glide_offset(inst, voice, now) + bend;
+}
+
+// render up to JB_LANES voices of an instrument in lockstep. a voice's pitch moves from where the
+// last span left it to where it should be by `now`, as a ratio its phase steps are multiplied by
+// each frame; a bent chord costs a couple of exp2f() calls per voice per span, and a multiply per
+// link per frame
+static void lanes_render(const jb_engine_t *eng, const jb_inst_t *inst, jb_voice_t **voices,
+                         size_t lanes, jack_time_t now, float bend, gain_t gain, size_t nframes,
+                         jb_sample_t **bufs) {
+    const jb_osc_link_t *chain = &eng->patch->links[inst->chain];
+
+    // spare lanes are left silent, with a zero phase and step
+    jb_vf_t phase[JB_CHAIN_MAX] = {0};
+    jb_vf_t step[JB_CHAIN_MAX] = {0};
+    jb_vf_t mul[JB_CHAIN_MAX] = {0};
+    jb_vf_t level = {0};
+    bool gliding = false;
+
+    for (size_t l = 0; l < lanes; l++) {
+        jb_voice_t *voice = voices[l];
+        float from = voice->cents;
+        float to = voice_cents(inst, voice, now, bend);
+        float ratio = 1.0, per_frame = 1.0;
+
+        if (from != 0.0) ratio = exp2f(from / 1200);
+        if (to != from) {
+            per_frame = exp2f((to - from) / (1200.f * nframes));
+            gliding = true;
+        }
+
+        voice->cents = to;
+
+        for (size_t i = 0; i < inst->len; i++) {
+            // fixed frequencies don't follow the note
+            bool fixed = eng->oscs[chain[i].osc].hz != 0;
+
+            phase[i][l] = voice->phase[i];
+            step[i][l] = voice->step[i] * (fixed ? 1.0f : ratio);
+            mul[i][l] = fixed ? 1.0f : per_frame;
+        }
+
+        level[l] = 0.5 * voice->ramp;
+    }
+
+    for (size_t j = 0; j < nframes; j++) {
+        jb_vf_t out;
+        jb_chain_sample_v(eng->oscs, chain, inst->len, phase, step, eng->noise, &out);
+
+        if (gliding)
+            for (size_t i = 0; i < inst->len; i++) step[i] *= mul[i];
+
+        out *= level;
+
+        float samp = 0.0;
+        for (size_t l = 0; l < JB_LANES; l++) samp += out[l];
+
+        for (size_t o = 0; o < JB_OUTS; o++)
+            bufs[o][j] += samp * (gain.start[o] + gain.step[o] * j);
+    }
+
+    for (size_t l = 0; l < lanes; l++)
+        for (size_t i = 0; i < inst->len; i++) voices[l]->phase[i] = phase[i][l];
+}
+
+// render the voices of a sampler instrument, silencing those whose files have ended. returns the
+// number still playing. a voice's pitch moves towards where it should be by `now` a block at a time
+static size_t streams_render(jb_engine_t *eng, const jb_inst_t *inst, jb_voice_t **voices,
+                             size_t n_voices, jack_time_t now, float bend, gain_t gain,
+                             size_t nframes, jb_sample_t **bufs) {
+    const jb_osc_t *osc = &eng->oscs[eng->patch->links[inst->chain].osc];
+    float block[STREAM_BLOCK];
+    size_t n_playing = n_voices;
+
+    for (size_t i = 0; i < n_voices; i++) {
+        jb_voice_t *voice = voices[i];
+        float level = 0.5 * voice->ramp * osc->amp;
+        bool playing = true, underrun = false;
+
+        float from = voice->cents;
+        float to = voice_cents(inst, voice, now, bend);
+        voice->cents = to;
+
+        for (size_t j = 0; j < nframes && playing; j += STREAM_BLOCK) {
+            size_t len = JB_MIN(nframes - j, STREAM_BLOCK);
+
+            // each block plays at the pitch reached by its end, so the last lands on `to`
+            if (from != 0.0 || to != 0.0) {
+                float cents = from + (to - from) * (j + len) / nframes;
+                jb_stream_rate(&eng->sampler, voice->stream, voice->step[0] * exp2f(cents / 1200));
+            }
+
+            playing = jb_stream_read(&eng->sampler, voice->stream, block, len, &underrun);
+
+            for (size_t k = 0; k < len; k++)
+                for (size_t o = 0; o < JB_OUTS; o++)
+                    bufs[o][j + k] += block[k] * level * (gain.start[o] + gain.step[o] * (j + k));
+        }
+
+        if (underrun && eng->metrics)
+            atomic_fetch_add_explicit(&eng->metrics->underruns, 1, memory_order_relaxed);
+
+        // the voice goes back to the pool on the next span
+        if (!playing) {
+            voice->stage = JB_NONE;
+            n_playing--;
+        }
+    }
+
+    return n_playing;
+}
+
+// render the voices of an additive instrument, JB_PARTIAL_BLOCK frames at a time. as with samples,
+// each block plays at the pitch reached by its end; every partial's amplitude moves across the
+// block from where the last one left it to its level in the patch, scaled by the voice's envelope
+static void partials_render(jb_engine_t *eng, const jb_inst_t *inst, jb_voice_t **voices,
+                            size_t n_voices, jack_time_t now, float bend, gain_t gain,
+                            size_t nframes, jb_sample_t **bufs) {
+    const jb_osc_t *osc = &eng->oscs[eng->patch->links[inst->chain].osc];
+    const jb_partial_t *partials = &eng->patch->partials[osc->partials];
+    bool fixed = osc->hz != 0;
+
+    jb_vf_t ratio[PARTIAL_GROUPS(JB_PARTIALS)], amp[PARTIAL_GROUPS(JB_PARTIALS)];
+    float block[JB_PARTIAL_BLOCK];
+
+    for (size_t i = 0; i < n_voices; i++) {
+        jb_voice_t *voice = voices[i];
+        jb_partials_v_t *state = voice_partials(eng, voice);
+        size_t groups = PARTIAL_GROUPS(voice->partials);
+        float level = 0.5 * voice->ramp * osc->amp;
+
+        // lanes past the partials the note started with stay still and silent
+        for (size_t g = 0; g < groups; g++) {
+            for (size_t l = 0; l < JB_LANES; l++) {
+                size_t k = g * JB_LANES + l;
+                bool live = k < voice->partials;
+
+                ratio[g][l] = live ? partials[k].ratio : 0.0;
+                amp[g][l] = live ? partials[k].amp * level : 0.0;
+            }
+        }
+
+        float from = voice->cents;
+        float to = voice_cents(inst, voice, now, bend);
+        voice->cents = to;
+
+        for (size_t j = 0; j < nframes; j += JB_PARTIAL_BLOCK) {
+            size_t len = JB_MIN(nframes - j, JB_PARTIAL_BLOCK);
+            float step = voice->step[0];
+
+            if (!fixed && (from != 0.0 || to != 0.0)) {
+                float cents = from + (to - from) * (j + len) / nframes;
+                step *= exp2f(cents / 1200);
+            }
+
+            memset(block, 0, len * sizeof(*block));
+            jb_partials_render_v(state, ratio, amp, groups, step, len, block);
+
+            for (size_t k = 0; k < len; k++)
+                for (size_t o = 0; o < JB_OUTS; o++)
+                    bufs[o][j + k] += block[k] * (gain.start[o] + gain.step[o] * (j + k));
+        }
+    }
+}
+
+// render a span of frames for an instrument, on a channel bent by `bend` cents, returning the
+// number of voices sounding. envelopes and glides are evaluated at `now`, the end of the span, so
+// that a note is heard in the span it starts in
+static size_t inst_render(jb_engine_t *eng, jack_time_t now, uint32_t idx, float bend, gain_t gain,
+                          size_t nframes, jb_sample_t **bufs) {
+    const jb_patch_t *pt = eng->patch;
+    const jb_inst_t *inst = &pt->insts[idx];
+    const jb_env_t *env = &pt->envs[inst->env];
+    jb_voice_bank_t *bank = &eng->banks[idx];
+
+    // envelopes are stepped once per cycle; whatever is still sounding afterwards gets rendered,
+    // and the rest go back to the pool (an instrument has at most one voice per note)
+    jb_voice_t *active[JB_VOICES];
+    size_t n_active = 0;
+
+    {
+        JB_ZONE_ARG("envelopes", idx);
+
+        for (uint32_t *link = &bank->voices; *link != JB_NONE;) {
+            jb_voice_t *voice = jb_pool_at(&eng->pool, *link);
+            env_process(pt, env, voice, now);
+
+            if (voice->stage == JB_NONE) {
+                *link = voice->next;
+                voice_free(eng, voice);
+                continue;
+            }
+
+            active[n_active++] = voice;
+            link = &voice->next;
+        }
+    }
+
+    if (inst_is_sampler(pt, inst)) {
+        JB_ZONE_ARG("samples", idx);
+        return streams_render(eng, inst, active, n_active, now, bend, gain, nframes, bufs);
+    }
+
+    if (inst_is_additive(pt, inst)) {
+        JB_ZONE_ARG("partials", idx);
+        partials_render(eng, inst, active, n_active, now, bend, gain, nframes, bufs);
+        return n_active;
+    }
+
+    // the chain is mixed into the outputs as it's rendered, so mixing is counted here too
+    JB_ZONE_ARG("chain", idx);
+
+    for (size_t i = 0; i < n_active; i += JB_LANES) {
+        size_t lanes = JB_MIN(n_active - i, JB_LANES);
+        lanes_render(eng, inst, active + i, lanes, now, bend, gain, nframes, bufs);
+    }
+
+    return n_active;
+}
+
+// render frames `start` to `end` of a cycle of `nframes`, returning the number of voices sounding.
+// when metering into `frame`, each channel is rendered on its own, metered, then mixed in
+static size_t span_render(jb_engine_t *eng, jb_ctx_t ctx, size_t start, size_t end, size_t nframes,
+                          jb_sample_t **bufs, jb_meter_frame_t *frame) {
+    jb_sample_t *span[JB_OUTS];
+    for (size_t o = 0; o < JB_OUTS; o++) span[o] = bufs[o] + start;
+
+    jb_sample_t **dst = frame ? eng->chan_bufs : span;
+    size_t len = end - start;
+
+    JB_ZONE_ARG("span", start);
+
+    jack_time_t now = ctx_at(ctx, end).time;
+    size_t voices = 0;
+
+    for (size_t c = 0; c < JB_CHANS; c++) {
+        const jb_chan_t *chan = &eng->patch->chans[c];
+        if (chan->len == 0) continue;
+
+        // channel gains ramp across the whole cycle; pick up where the span starts
+        gain_t gain = mix_gain(&eng->mix[c], nframes);
+        for (size_t o = 0; o < JB_OUTS; o++) gain.start[o] += gain.step[o] * start;
+
+        if (frame)
+            for (size_t o = 0; o < JB_OUTS; o++) memset(dst[o], 0, len * sizeof(*dst[o]));
+
+        for (size_t i = 0; i < chan->len; i++)
+            voices += inst_render(eng, now, chan->insts[i], eng->mix[c].bend, gain, len, dst);
+
+        if (frame) {
+            JB_ZONE_ARG("meter", c);
+            jb_meter_level(&frame->chans[c], dst, len);
+
+            for (size_t o = 0; o < JB_OUTS; o++)
+                for (size_t j = 0; j < len; j++) span[o][j] += dst[o][j];
+        }
+    }
+
+    return voices;
+}
+
+void jb_engine_audio(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs) {
+    JB_ZONE("audio");
+
+    jb_engine_t *eng = (jb_engine_t *)state;
+
+    for (size_t o = 0; o < JB_OUTS; o++) memset(bufs[o], 0, nframes * sizeof(*bufs[o]));
+
+    commands_process(eng, ctx);
+    params_process(eng);
+
+    // the frame is cleared every cycle, since it's published every cycle; channels are only
+    // metered if they can be rendered on their own, and otherwise read as silent
+    jb_meter_frame_t *frame = NULL;
+    if (eng->meter) {
+        frame = jb_meter_begin(eng->meter);
+        if (nframes > eng->chan_len) frame = NULL;
+    }
+
+    // split the cycle at each pending event, so that it takes effect on the frame it arrived on
+    size_t pos = 0;
+    size_t next = 0;
+    size_t voices = 0;
+
+    while (pos < nframes) {
+        while (next < eng->n_pending && eng->pending[next].frame <= pos)
+            jb_engine_midi(eng, ctx_at(ctx, pos), eng->pending[next++]);
+
+        size_t end = nframes;
+        if (next < eng->n_pending) end = JB_MIN(eng->pending[next].frame, nframes);
+
+        voices = span_render(eng, ctx, pos, end, nframes, bufs, frame);
+        pos = end;
+    }
+
+    // anything stamped past the end of the cycle still gets applied
+    while (next < eng->n_pending) jb_engine_midi(eng, ctx_at(ctx, nframes), eng->pending[next++]);
+
+    eng->pending = NULL;
+    eng->n_pending = 0;
+
+    if (eng->meter) {
+        JB_ZONE("meter");
+        jb_meter_publish(eng->meter, bufs, nframes, ctx.srate);
+    }
+
+    eng->voices = voices;
+    if (eng->metrics && !eng->in_rack) atomic_store_explicit(&eng->metrics->voices, voices, memory_order_relaxed);
+}
+
+void jb_engine_prepare(void *state, jb_ctx_t ctx, size_t nframes) {
+    jb_engine_t *eng = (jb_engine_t *)state;
+    const jb_patch_t *pt = eng->patch;
+
+    // stream rings last as long as the engine, so they're allocated outside the scope
+    jb_sampler_prepare(&eng->sampler, &eng->arena, nframes, ctx.srate);
+
+    // as do the buffers channels are metered in
+    if (eng->meter && eng->chan_len == 0) {
+        for (size_t o = 0; o < JB_OUTS; o++)
+            eng->chan_bufs[o] = JB_ARENA_NEW(&eng->arena, jb_sample_t, nframes);
+
+        if (eng->chan_bufs[0] && eng->chan_bufs[JB_OUTS - 1])
+            eng->chan_len = nframes;
+        else
+            jb_warn("failed to allocate meter buffers; channels won't be metered");
+    }
+
+    jb_arena_scope_t scope = jb_arena_scope_begin(&eng->arena);
+
+    jb_sample_t *scratch[JB_OUTS];
+    bool have_scratch = true;
+
+    for (size_t o = 0; o < JB_OUTS; o++) {
+        scratch[o] = JB_ARENA_NEW(&eng->arena, jb_sample_t, nframes);
+        if (!scratch[o]) have_scratch = false;
+    }
+
+    // everything the audio callback touches lives in the arena or the patch set; lock both so
+    // that the first notes played don't page fault. failing to lock isn't fatal, just slower
+    jb_res_t res = jb_arena_lock(&eng->arena);
+    if (res JB_IS_OK) res = jb_patch_lock(pt);
+
+    if (res JB_IS_ERR) {
+        jb_warn("engine memory not locked: %s", res.msg);
+        free(res.msg);
+    }
+
+    // play a note through every instrument for a few cycles, so the code and tables each one
+    // uses are warm by the time the first real note arrives
+    if (have_scratch) {
+        gain_t unity = mix_gain(&(jb_mix_t){.vol = ramp_init(JB_TARGET_VOL, 0, 1.0),
+                                            .pan = ramp_init(JB_TARGET_PAN, 0, 0.5)},
+                                nframes);
+
+        for (uint32_t i = 0; i < pt->n_insts; i++) {
+            jb_ctx_t warm = ctx;
+            note_on(eng, warm, i, WARMUP_NOTE, 127, 0.0);
+
+            for (size_t j = 0; j < WARMUP_CYCLES; j++) {
+                for (size_t o = 0; o < JB_OUTS; o++)
+                    memset(scratch[o], 0, nframes * sizeof(*scratch[o]));
+
+                inst_render(eng, ctx_at(warm, nframes).time, i, 0.0, unity, nframes, scratch);
+
+                warm.time += warm.period_usecs;
+                warm.cur_sample += nframes;
+            }
+        }
+    }
+
+    voices_reset(eng);
+    jb_arena_scope_end(scope);
+
+    jb_debug("engine prepared (%zu instruments, %zu KiB committed)",
+             pt->n_insts,
+             eng->arena.committed / 1024);
+}
+
+void jb_engine_freewheel(void *state, bool on) {
+    jb_engine_t *eng = (jb_engine_t *)state;
+
+    // a bounce has all the time it needs, so it gets the most exact render there is
+    eng->freewheel = on;
+    eng->sampler.freewheel = on;
+}
@@ -23,6 +23,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+// with -fsanitize=undefined, gcc sees the sanitiser's NULL check on `fmt` below as a NULL format
+// string, and fails optimised builds
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+
 jb_res_t jb_err_impl(jb_err_t kind, size_t line, const char *file, const char *func, char *fmt,
                      ...) {
     jb_res_t err;
@@ -0,0 +1,259 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// image.c: compiled patch set images
+//
+// writes a compiled patch set to disk as a header followed by each of its tables, and maps images
+// back in read-only. tables are used straight out of the mapping, so loading an image costs the
+// same regardless of how many patches it holds, and instances loading the same image share pages
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jbase.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_MAGIC "JBPATCH"
+#define IMAGE_VERSION 7
+#define IMAGE_ORDER 0x01020304 // detects images written on a machine with different endianness
+#define IMAGE_ALIGN 64         // tables start on a cache line
+
+enum {
+    SECT_OSCS,
+    SECT_STAGES,
+    SECT_ENVS,
+    SECT_LINKS,
+    SECT_INSTS,
+    SECT_CHANS,
+    SECT_ROUTES,
+    SECT_PARTIALS,
+    SECT_SYMS,
+    SECT_SLOTS,
+    SECT_STRS,
+    SECT_MAX
+};
+
+typedef struct {
+    uint64_t offset; // offset of table from start of image
+    uint64_t count;  // number of elements in table
+    uint64_t size;   // size of each element
+} sect_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint64_t hash;   // hash of patch source the image was compiled from
+    uint64_t len;    // length of whole image
+    sect_t sects[SECT_MAX];
+} hdr_t;
+
+// a table in a patch set, and where to find its length
+typedef struct {
+    void **ptr;
+    size_t *count;
+    size_t size;
+} table_t;
+
+static void patch_tables(jb_patch_t *pt, table_t tables[SECT_MAX]) {
+    static size_t chans = JB_CHANS;
+
+    tables[SECT_OSCS] = (table_t){(void **)&pt->oscs, &pt->n_oscs, sizeof(jb_osc_t)};
+    tables[SECT_STAGES] = (table_t){(void **)&pt->stages, &pt->n_stages, sizeof(jb_env_stage_t)};
+    tables[SECT_ENVS] = (table_t){(void **)&pt->envs, &pt->n_envs, sizeof(jb_env_t)};
+    tables[SECT_LINKS] = (table_t){(void **)&pt->links, &pt->n_links, sizeof(jb_osc_link_t)};
+    tables[SECT_INSTS] = (table_t){(void **)&pt->insts, &pt->n_insts, sizeof(jb_inst_t)};
+    tables[SECT_CHANS] = (table_t){(void **)&pt->chans, &chans, sizeof(jb_chan_t)};
+    tables[SECT_ROUTES] = (table_t){(void **)&pt->routes, &pt->n_routes, sizeof(jb_route_t)};
+    tables[SECT_PARTIALS] =
+        (table_t){(void **)&pt->partials, &pt->n_partials, sizeof(jb_partial_t)};
+    tables[SECT_SYMS] = (table_t){(void **)&pt->syms, &pt->n_syms, sizeof(jb_sym_t)};
+    tables[SECT_SLOTS] = (table_t){(void **)&pt->slots, &pt->n_slots, sizeof(jb_sym_slot_t)};
+    tables[SECT_STRS] = (table_t){(void **)&pt->strs, &pt->n_strs, sizeof(char)};
+}
+
+static size_t align_up(size_t n) {
+    return (n + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+jb_res_t jb_image_write(const jb_patch_t *pt, const char *path, uint64_t hash) {
+    table_t tables[SECT_MAX];
+    patch_tables((jb_patch_t *)pt, tables);
+
+    hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+    hdr.version = IMAGE_VERSION;
+    hdr.order = IMAGE_ORDER;
+    hdr.hash = hash;
+
+    size_t len = align_up(sizeof(hdr));
+    for (size_t i = 0; i < SECT_MAX; i++) {
+        hdr.sects[i].offset = len;
+        hdr.sects[i].count = *tables[i].count;
+        hdr.sects[i].size = tables[i].size;
+
+        len = align_up(len + *tables[i].count * tables[i].size);
+    }
+    hdr.len = len;
+
+    uint8_t *buf = calloc(len, 1);
+    if (!buf) return JB_ERR(JB_ERR_OOM, "failed to allocate %zu byte patch image", len);
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    for (size_t i = 0; i < SECT_MAX; i++)
+        if (*tables[i].count)
+            memcpy(buf + hdr.sects[i].offset, *tables[i].ptr, *tables[i].count * tables[i].size);
+
+    // write to a temporary file and move it into place, so that other instances never map a
+    // partially written image
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(buf);
+        return JB_ERR(JB_ERR_LIBC, "failed to create '%s': %s", tmp, strerror(errno));
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buf + written, len - written);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            jb_res_t res = JB_ERR(JB_ERR_LIBC, "failed to write '%s': %s", tmp, strerror(errno));
+            close(fd);
+            unlink(tmp);
+            free(buf);
+            return res;
+        }
+
+        written += n;
+    }
+
+    free(buf);
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        jb_res_t res = JB_ERR(JB_ERR_LIBC, "failed to move image to '%s': %s", path, strerror(errno));
+        unlink(tmp);
+        return res;
+    }
+
+    jb_debug("wrote %zu byte patch image to '%s'", len, path);
+
+    return JB_OK_VAL;
+}
+
+// check the header of an image before trusting any of its tables
+static jb_res_t check_hdr(const hdr_t *hdr, size_t len, uint64_t hash, table_t tables[SECT_MAX]) {
+    if (memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0)
+        return JB_ERR(JB_ERR_IMAGE, "not a patch image");
+
+    if (hdr->version != IMAGE_VERSION || hdr->order != IMAGE_ORDER)
+        return JB_ERR(JB_ERR_IMAGE, "incompatible image version %u", hdr->version);
+
+    if (hdr->hash != hash) return JB_ERR(JB_ERR_IMAGE, "image is stale");
+
+    if (hdr->len != len) return JB_ERR(JB_ERR_IMAGE, "image is truncated");
+
+    for (size_t i = 0; i < SECT_MAX; i++) {
+        const sect_t *sect = &hdr->sects[i];
+
+        if (sect->size != tables[i].size)
+            return JB_ERR(JB_ERR_IMAGE, "table %zu has wrong element size", i);
+
+        if (sect->offset % IMAGE_ALIGN != 0 || sect->offset > len ||
+            sect->count > (len - sect->offset) / sect->size)
+            return JB_ERR(JB_ERR_IMAGE, "table %zu out of bounds", i);
+    }
+
+    if (hdr->sects[SECT_CHANS].count != JB_CHANS)
+        return JB_ERR(JB_ERR_IMAGE, "image has wrong number of channels");
+
+    // symbol index is probed with a mask
+    uint64_t slots = hdr->sects[SECT_SLOTS].count;
+    if ((slots & (slots - 1)) != 0)
+        return JB_ERR(JB_ERR_IMAGE, "image has malformed symbol index");
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_image_load(jb_patch_t *pt, const char *path, uint64_t hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return JB_ERR(JB_ERR_LIBC, "failed to stat '%s': %s", path, strerror(errno));
+    }
+
+    size_t len = st.st_size;
+    if (len < sizeof(hdr_t)) {
+        close(fd);
+        return JB_ERR(JB_ERR_IMAGE, "'%s' is too small to be a patch image", path);
+    }
+
+    void *image = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (image == MAP_FAILED)
+        return JB_ERR(JB_ERR_LIBC, "failed to map '%s': %s", path, strerror(errno));
+
+    jb_patch_t loaded;
+    memset(&loaded, 0, sizeof(loaded));
+
+    table_t tables[SECT_MAX];
+    patch_tables(&loaded, tables);
+
+    const hdr_t *hdr = image;
+    jb_res_t res = check_hdr(hdr, len, hash, tables);
+    if (res JB_IS_ERR) {
+        munmap(image, len);
+        return res;
+    }
+
+    for (size_t i = 0; i < SECT_MAX; i++) {
+        *tables[i].ptr = (uint8_t *)image + hdr->sects[i].offset;
+        if (i != SECT_CHANS) *tables[i].count = hdr->sects[i].count;
+    }
+
+    // the tables are in bounds; now check what they point at, before anything follows them
+    res = jb_patch_check(&loaded);
+    if (res JB_IS_ERR) {
+        munmap(image, len);
+        return res;
+    }
+
+    loaded.image = image;
+    loaded.image_len = len;
+
+    jb_patch_free(pt);
+    *pt = loaded;
+
+    jb_debug("mapped %zu byte patch image from '%s'", len, path);
+
+    return JB_OK_VAL;
+}
@@ -0,0 +1,260 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// meter.c: level meters and waveform tap in shared memory
+//
+// the engine meters each channel and its outputs as it renders, and the outputs are fed through a
+// waveform tap that averages every few frames. once a cycle, the lot is published into a triple
+// buffer in a POSIX shared memory object, so that monitoring tools on the same machine can watch
+// levels without adding a JACK client. publishing is a single atomic exchange; the audio thread
+// never waits for a reader, and only touches memory that was locked in when the object was made
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jbase.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define METER_VERSION 1
+
+typedef jb_vf_t vf_t;
+typedef jb_vi_t vi_t;
+
+#define SIGN_BIT ((int32_t)0x80000000)
+
+// shared memory object names need a leading '/'
+static void meter_name(char *out, size_t len, const char *name) {
+    snprintf(out, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+jb_res_t jb_meter_create(jb_meter_t *m, const char *name, uint32_t decimate) {
+    memset(m, 0, sizeof(*m));
+    meter_name(m->name, sizeof(m->name), name);
+
+    // a reader still mapping an old object keeps it until they let go, rather than seeing it
+    // truncated underneath them
+    shm_unlink(m->name);
+
+    int fd = shm_open(m->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return JB_ERR(JB_ERR_LIBC, "failed to create '%s': %s", m->name, strerror(errno));
+
+    if (ftruncate(fd, sizeof(jb_meter_shm_t)) != 0) {
+        jb_res_t res = JB_ERR(JB_ERR_LIBC, "failed to size '%s': %s", m->name, strerror(errno));
+        close(fd);
+        shm_unlink(m->name);
+        return res;
+    }
+
+    void *shm = mmap(NULL, sizeof(jb_meter_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED) {
+        shm_unlink(m->name);
+        return JB_ERR(JB_ERR_LIBC, "failed to map '%s': %s", m->name, strerror(errno));
+    }
+
+    m->shm = shm;
+    m->decimate = decimate;
+
+    // the writer starts with buffer 0 and the reader with buffer 2; the object comes zeroed
+    m->back = 0;
+    atomic_store(&m->shm->middle, 1);
+    atomic_store(&m->shm->front, 2);
+    m->shm->version = METER_VERSION;
+
+    // readers check the magic before anything else, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    memcpy(m->shm->magic, JB_METER_MAGIC, sizeof(m->shm->magic));
+
+    // publishing mustn't page fault; failing to lock isn't fatal, just slower
+    jb_res_t res = jb_mem_lock(m->shm, sizeof(*m->shm));
+    if (res JB_IS_ERR) {
+        jb_warn("meter memory not locked: %s", res.msg);
+        free(res.msg);
+    }
+
+    jb_debug("publishing meters to '%s' (%zu KiB)", m->name, sizeof(*m->shm) / 1024);
+
+    return JB_OK_VAL;
+}
+
+void jb_meter_close(jb_meter_t *m) {
+    if (!m->shm) return;
+
+    munmap(m->shm, sizeof(*m->shm));
+    shm_unlink(m->name);
+    m->shm = NULL;
+}
+
+jb_meter_frame_t *jb_meter_begin(jb_meter_t *m) {
+    jb_meter_frame_t *frame = &m->shm->bufs[m->back];
+
+    memset(&frame->out, 0, sizeof(frame->out));
+    memset(frame->chans, 0, sizeof(frame->chans));
+
+    return frame;
+}
+
+// largest magnitude and sum of squares of a buffer, a vector of frames at a time
+static void buf_level(const jb_sample_t *buf, size_t len, float *peak, float *sum) {
+    vf_t vpeak = {0};
+    vf_t vsum = {0};
+    size_t i = 0;
+
+    for (; i + JB_LANES <= len; i += JB_LANES) {
+        vf_t x;
+        memcpy(&x, buf + i, sizeof(x));
+
+        vf_t a = (vf_t)((vi_t)x & ~SIGN_BIT);
+        vi_t more = a > vpeak;
+        vpeak = (vf_t)((more & (vi_t)a) | (~more & (vi_t)vpeak));
+        vsum += x * x;
+    }
+
+    float p = *peak, s = 0.0;
+    for (size_t l = 0; l < JB_LANES; l++) {
+        p = fmaxf(p, vpeak[l]);
+        s += vsum[l];
+    }
+
+    for (; i < len; i++) {
+        p = fmaxf(p, fabsf(buf[i]));
+        s += buf[i] * buf[i];
+    }
+
+    *peak = p;
+    *sum += s;
+}
+
+void jb_meter_level(jb_level_t *lvl, jb_sample_t *const *bufs, size_t nframes) {
+    for (size_t o = 0; o < JB_OUTS; o++) buf_level(bufs[o], nframes, &lvl->peak[o], &lvl->rms[o]);
+}
+
+// turn a level's sums of squares over `nframes` into RMS levels
+static void level_finish(jb_level_t *lvl, size_t nframes) {
+    for (size_t o = 0; o < JB_OUTS; o++) lvl->rms[o] = sqrtf(lvl->rms[o] / nframes);
+}
+
+// average the outputs into the tap ring, and copy it into a frame oldest first
+static void tap_feed(jb_meter_t *m, jb_meter_frame_t *frame, jb_sample_t *const *bufs,
+                     size_t nframes) {
+    for (size_t i = 0; i < nframes; i++) {
+        for (size_t o = 0; o < JB_OUTS; o++) m->tap_sum[o] += bufs[o][i];
+
+        if (++m->tap_count < m->decimate) continue;
+
+        for (size_t o = 0; o < JB_OUTS; o++) {
+            m->tap[o][m->tap_pos] = m->tap_sum[o] / m->decimate;
+            m->tap_sum[o] = 0.0;
+        }
+
+        m->tap_count = 0;
+        m->tap_pos = (m->tap_pos + 1) % JB_TAP_LEN;
+    }
+
+    size_t older = JB_TAP_LEN - m->tap_pos;
+    for (size_t o = 0; o < JB_OUTS; o++) {
+        memcpy(frame->tap[o], m->tap[o] + m->tap_pos, older * sizeof(float));
+        memcpy(frame->tap[o] + older, m->tap[o], m->tap_pos * sizeof(float));
+    }
+}
+
+void jb_meter_publish(jb_meter_t *m, jb_sample_t *const *bufs, size_t nframes, size_t srate) {
+    if (nframes == 0) return;
+
+    jb_meter_frame_t *frame = &m->shm->bufs[m->back];
+
+    frame->cycle = m->cycles++;
+    frame->srate = srate;
+    frame->nframes = nframes;
+    frame->decimate = m->decimate;
+
+    jb_meter_level(&frame->out, bufs, nframes);
+
+    level_finish(&frame->out, nframes);
+    for (size_t c = 0; c < JB_CHANS; c++) level_finish(&frame->chans[c], nframes);
+
+    if (m->decimate) tap_feed(m, frame, bufs, nframes);
+
+    // the buffer handed back is whichever the reader isn't holding
+    uint32_t back = atomic_exchange_explicit(
+        &m->shm->middle, m->back | JB_METER_FRESH, memory_order_acq_rel);
+    m->back = back & ~JB_METER_FRESH;
+}
+
+jb_res_t jb_meter_open(jb_meter_reader_t *r, const char *name) {
+    char path[64];
+    meter_name(path, sizeof(path), name);
+
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(jb_meter_shm_t)) {
+        close(fd);
+        return JB_ERR(JB_ERR_USER, "'%s' isn't a meter", path);
+    }
+
+    void *shm = mmap(NULL, sizeof(jb_meter_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED)
+        return JB_ERR(JB_ERR_LIBC, "failed to map '%s': %s", path, strerror(errno));
+
+    r->shm = shm;
+
+    if (memcmp(r->shm->magic, JB_METER_MAGIC, sizeof(r->shm->magic)) != 0 ||
+        r->shm->version != METER_VERSION) {
+        jb_meter_reader_close(r);
+        return JB_ERR(JB_ERR_USER, "'%s' isn't a meter, or is from another version", path);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    return JB_OK_VAL;
+}
+
+void jb_meter_reader_close(jb_meter_reader_t *r) {
+    if (!r->shm) return;
+
+    munmap(r->shm, sizeof(*r->shm));
+    r->shm = NULL;
+}
+
+const jb_meter_frame_t *jb_meter_read(jb_meter_reader_t *r) {
+    uint32_t front = atomic_load_explicit(&r->shm->front, memory_order_relaxed);
+
+    if (atomic_load_explicit(&r->shm->middle, memory_order_relaxed) & JB_METER_FRESH) {
+        front = atomic_exchange_explicit(&r->shm->middle, front, memory_order_acq_rel);
+        front &= ~JB_METER_FRESH;
+        atomic_store_explicit(&r->shm->front, front, memory_order_relaxed);
+    }
+
+    const jb_meter_frame_t *frame = &r->shm->bufs[front];
+
+    // frames are never published empty, so an empty one hasn't been published at all
+    return frame->nframes ? frame : NULL;
+}
@@ -0,0 +1,185 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// metrics.c: engine statistics, served over a local socket
+//
+// the audio thread bumps counters with relaxed atomics and never waits on anything; a separate
+// thread formats a snapshot whenever a scraper connects. a snapshot isn't taken atomically as a
+// whole, which Prometheus doesn't need: each value is consistent on its own
+//
+
+#include <errno.h>
+#include <jbase.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LOAD(x) atomic_load_explicit(&(x), memory_order_relaxed)
+
+void jb_metrics_init(jb_metrics_t *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void jb_metrics_time(jb_metrics_t *m, uint64_t ns) {
+    // smallest bucket that fits the time, in whole μs
+    uint64_t us = (ns + 999) / 1000;
+    size_t bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+    bucket = JB_MIN(bucket, JB_METRIC_BUCKETS - 1);
+
+    atomic_fetch_add_explicit(&m->time_hist[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->time_ns, ns, memory_order_relaxed);
+}
+
+// append to a buffer, keeping track of how much was written
+#define APPEND(...)                                                        \
+    do {                                                                   \
+        if (pos < len) pos += snprintf(buf + pos, len - pos, __VA_ARGS__); \
+    } while (0)
+
+// a counter or gauge, with its help text
+#define METRIC(kind, metric, help, val)                                                   \
+    do {                                                                                  \
+        APPEND("# HELP midid_" metric " " help "\n# TYPE midid_" metric " " kind "\n");   \
+        APPEND("midid_" metric "{client=\"%s\"} %llu\n", name, (unsigned long long)(val)); \
+    } while (0)
+
+size_t jb_metrics_format(const jb_metrics_t *m, const char *name, char *buf, size_t len) {
+    size_t pos = 0;
+
+    METRIC("counter", "cycles_total", "Process cycles run.", LOAD(m->cycles));
+    METRIC("counter", "xruns_total", "Xruns reported by JACK.", LOAD(m->xruns));
+    METRIC("counter", "midi_events_total", "MIDI events received.", LOAD(m->midi_events));
+    METRIC("counter", "midi_drops_total", "MIDI events dropped.", LOAD(m->midi_drops));
+    METRIC("counter", "nan_mutes_total", "Cycles muted for rendering NaNs.", LOAD(m->nan_mutes));
+    METRIC("counter", "command_drops_total", "Control commands dropped.", LOAD(m->cmd_drops));
+    METRIC("counter",
+           "stream_underruns_total",
+           "Sample streams that ran dry, or couldn't start.",
+           LOAD(m->underruns));
+    METRIC("counter", "voice_drops_total", "Notes with no voice free.", LOAD(m->voice_drops));
+    METRIC("counter",
+           "shard_misses_total",
+           "Cycles a worker wasn't done in time for.",
+           LOAD(m->shard_misses));
+    METRIC("gauge", "voices", "Voices sounding.", LOAD(m->voices));
+    METRIC("gauge", "freewheel", "Whether JACK is freewheeling.", LOAD(m->freewheel));
+
+    APPEND("# HELP midid_budget_seconds Time available to each process cycle.\n"
+           "# TYPE midid_budget_seconds gauge\n"
+           "midid_budget_seconds{client=\"%s\"} %.9f\n",
+           name,
+           LOAD(m->period_ns) / 1e9);
+
+    APPEND("# HELP midid_callback_seconds Time spent in the process callback.\n"
+           "# TYPE midid_callback_seconds histogram\n");
+
+    // buckets are cumulative in the exposition format
+    uint64_t count = 0;
+    for (size_t i = 0; i < JB_METRIC_BUCKETS; i++) {
+        count += LOAD(m->time_hist[i]);
+
+        if (i + 1 < JB_METRIC_BUCKETS)
+            APPEND("midid_callback_seconds_bucket{client=\"%s\",le=\"%g\"} %llu\n",
+                   name,
+                   (double)(1ull << i) / 1e6,
+                   (unsigned long long)count);
+        else
+            APPEND("midid_callback_seconds_bucket{client=\"%s\",le=\"+Inf\"} %llu\n",
+                   name,
+                   (unsigned long long)count);
+    }
+
+    APPEND("midid_callback_seconds_sum{client=\"%s\"} %.9f\n", name, LOAD(m->time_ns) / 1e9);
+    APPEND("midid_callback_seconds_count{client=\"%s\"} %llu\n", name, (unsigned long long)count);
+
+    return JB_MIN(pos, len > 0 ? len - 1 : 0);
+}
+
+// answer one scrape; the request itself is read but not looked at, since there's only one page
+static void serve_conn(jb_metrics_server_t *srv, int conn) {
+    char req[1024];
+    char body[8192];
+    char hdr[256];
+
+    // don't let a client that never sends anything hold up the next scrape
+    struct timeval timeout = {.tv_sec = 1};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (recv(conn, req, sizeof(req), 0) < 0) return;
+
+    size_t body_len = jb_metrics_format(srv->metrics, srv->name, body, sizeof(body));
+    int hdr_len = snprintf(hdr,
+                           sizeof(hdr),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n"
+                           "Connection: close\r\n\r\n",
+                           body_len);
+
+    if (send(conn, hdr, hdr_len, MSG_NOSIGNAL) == hdr_len) send(conn, body, body_len, MSG_NOSIGNAL);
+}
+
+static void *serve_thread(void *arg) {
+    jb_metrics_server_t *srv = (jb_metrics_server_t *)arg;
+
+    for (;;) {
+        int conn = accept(srv->sock.fd, NULL, NULL);
+
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break; // socket was shut down
+        }
+
+        serve_conn(srv, conn);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+jb_res_t jb_metrics_serve(jb_metrics_server_t *srv, const jb_metrics_t *m, const char *name,
+                          const char *addr) {
+    memset(srv, 0, sizeof(*srv));
+    srv->metrics = m;
+    srv->name = name;
+
+    JB_TRY(jb_sock_listen(&srv->sock, addr));
+
+    int err = pthread_create(&srv->thread, NULL, serve_thread, srv);
+    if (err != 0) {
+        jb_sock_close(&srv->sock);
+        return JB_ERR(JB_ERR_LIBC, "failed to start metrics thread: %s", strerror(err));
+    }
+
+    jb_info("serving metrics on %s%s", srv->sock.path[0] ? "" : "localhost:", addr);
+
+    return JB_OK_VAL;
+}
+
+void jb_metrics_stop(jb_metrics_server_t *srv) {
+    if (srv->sock.fd < 0) return;
+
+    jb_sock_wake(&srv->sock);
+    pthread_join(srv->thread, NULL);
+
+    jb_sock_close(&srv->sock);
+}
@@ -0,0 +1,116 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// midi.c: MIDI decoding
+//
+// turns the raw bytes of MIDI events into jb_midi_t's. handles every channel voice message, running
+// status (data bytes reusing the last status byte), and skips over system exclusive and system
+// common messages; real-time messages may appear anywhere, and are dropped without disturbing
+// anything else
+//
+
+#include <jbase.h>
+
+// data bytes following a channel voice status byte
+static uint8_t voice_len(uint8_t status) {
+    switch (status & 0xf0) {
+        case JB_PROG_CHANGE:
+        case JB_CHAN_TOUCH:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+// data bytes following a system common status byte
+static uint8_t common_len(uint8_t status) {
+    switch (status) {
+        case 0xf1: // time code quarter frame
+        case 0xf3: // song select
+            return 1;
+        case 0xf2: // song position
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+size_t jb_midi_decode(jb_midi_decoder_t *dec, uint32_t frame, const uint8_t *buf, size_t len,
+                      jb_midi_t *out, size_t cap, size_t *dropped) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t b = buf[i];
+
+        // real-time
+        if (b >= 0xf8) continue;
+
+        // nothing reads system exclusive messages, so they're skipped without taking up a slot
+        if (b == 0xf0) {
+            dec->sysex = true;
+            dec->status = 0;
+            continue;
+        }
+
+        if (b > 0xf0) {
+            // system common, including the end of a system exclusive message. these cancel running
+            // status; their data bytes are skipped
+            dec->sysex = false;
+            dec->status = 0;
+            dec->need = common_len(b);
+            dec->have = 0;
+            continue;
+        }
+
+        if (b & 0x80) {
+            dec->sysex = false;
+            dec->status = b;
+            dec->need = voice_len(b);
+            dec->have = 0;
+            continue;
+        }
+
+        // data byte
+        if (dec->sysex) continue;
+
+        if (dec->status == 0) {
+            // belongs to a system common message, or arrived with no status to run on
+            if (dec->need > 0) dec->need--;
+            continue;
+        }
+
+        dec->data[dec->have++] = b;
+        if (dec->have < dec->need) continue;
+
+        // complete message; the status byte stays put for any following running status
+        dec->have = 0;
+
+        if (count < cap)
+            out[count++] = (jb_midi_t){
+                .frame = frame,
+                .kind = dec->status & 0xf0,
+                .chan = dec->base + (dec->status & 0x0f),
+                .args = {dec->data[0], dec->need > 1 ? dec->data[1] : 0},
+            };
+        else
+            (*dropped)++;
+    }
+
+    return count;
+}
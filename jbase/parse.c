@@ -0,0 +1,868 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// parse.c: patch language
+//
+// parses envelope, oscillator, instrument and channel definitions, appending them to the tables
+// of a jb_patch_t and resolving any references to previously defined objects
+//
+
+#include <ctype.h>
+#include <jbase.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char *src;
+    size_t len, ptr;
+} parser_t;
+
+typedef bool (*ccond_t)(char);
+
+// extracts a field's value into `out`
+typedef jb_res_t (*extract_fn_t)(parser_t *p, const char *str, size_t len, void *out);
+
+typedef struct {
+    char *key;
+    void *out;
+    bool taken;
+    bool required;
+    extract_fn_t extract;
+} field_t;
+
+#define FIELD_LAST ((field_t){.key = NULL})
+
+static void parser_init(parser_t *p, const char *src) {
+    p->src = src;
+    p->len = strlen(src);
+    p->ptr = 0;
+}
+
+// resolve line number of a position in the source
+static size_t resolve(parser_t *p, size_t pos) {
+    size_t line = 1;
+
+    for (size_t i = 0; i < pos && i < p->len; i++)
+        if (p->src[i] == '\n') line++;
+
+    return line;
+}
+
+#define PARSE_ERR(p, pos, f, ...) \
+    JB_ERR(JB_ERR_PARSE, "line %zu: " f, resolve((p), (pos)), __VA_ARGS__)
+
+static bool is_ident_start(char c) {
+    return isalpha(c) || c == '_';
+}
+
+static bool is_ident_body(char c) {
+    return is_ident_start(c) || isdigit(c);
+}
+
+static bool is_digit(char c) {
+    return isdigit(c);
+}
+
+static bool is_ws(char c) {
+    return c != '\n' && isspace(c);
+}
+
+static bool is_ws_nl(char c) {
+    return isspace(c);
+}
+
+static bool is_not_nl(char c) {
+    return c != '\n';
+}
+
+static bool is_not_tok_end(char c) {
+    return !isspace(c) && c != '#';
+}
+
+static bool is_eof(parser_t *p) {
+    return p->ptr >= p->len;
+}
+
+static bool peek_if(parser_t *p, ccond_t cond) {
+    return !is_eof(p) && cond(p->src[p->ptr]);
+}
+
+static bool take_if(parser_t *p, ccond_t cond) {
+    if (!peek_if(p, cond)) return false;
+
+    p->ptr++;
+    return true;
+}
+
+static bool take_ifc(parser_t *p, char c) {
+    if (is_eof(p) || p->src[p->ptr] != c) return false;
+
+    p->ptr++;
+    return true;
+}
+
+static bool take_while(parser_t *p, ccond_t cond) {
+    bool taken = false;
+
+    while (take_if(p, cond)) taken = true;
+
+    return taken;
+}
+
+static bool take_lit(parser_t *p, const char *lit) {
+    size_t len = strlen(lit);
+
+    if (p->len - p->ptr < len || strncmp(p->src + p->ptr, lit, len) != 0) return false;
+
+    p->ptr += len;
+    return true;
+}
+
+static void skip_ws(parser_t *p) {
+    take_while(p, is_ws);
+}
+
+static void skip_comment(parser_t *p) {
+    skip_ws(p);
+    if (take_ifc(p, '#')) take_while(p, is_not_nl);
+}
+
+static jb_res_t expect_char(parser_t *p, char c) {
+    if (!take_ifc(p, c)) return PARSE_ERR(p, p->ptr, "expected char '%c'", c);
+
+    return JB_OK_VAL;
+}
+
+// everything in a definition should have been consumed
+static jb_res_t expect_end(parser_t *p) {
+    skip_comment(p);
+    take_while(p, is_ws_nl);
+
+    if (!is_eof(p))
+        return PARSE_ERR(p, p->ptr, "unexpected trailing input '%s'", p->src + p->ptr);
+
+    return JB_OK_VAL;
+}
+
+static jb_res_t take_ident(parser_t *p, size_t *start, size_t *len) {
+    *start = p->ptr;
+    *len = 0;
+
+    if (!take_if(p, is_ident_start)) return PARSE_ERR(p, p->ptr, "expected identifier", "");
+
+    take_while(p, is_ident_body);
+
+    *len = p->ptr - *start;
+
+    return JB_OK_VAL;
+}
+
+// `name:`
+static jb_res_t take_name(parser_t *p, size_t *start, size_t *len) {
+    skip_ws(p);
+
+    JB_TRY(take_ident(p, start, len));
+    JB_TRY(expect_char(p, ':'));
+
+    return JB_OK_VAL;
+}
+
+// decimal number, with optional sign and fractional part
+static jb_res_t take_num(parser_t *p, float *out) {
+    size_t start = p->ptr;
+
+    if (is_eof(p)) return PARSE_ERR(p, start, "expected number, found EOF", "");
+
+    if (!take_ifc(p, '-')) take_ifc(p, '+');
+
+    if (!take_while(p, is_digit))
+        return PARSE_ERR(p, start, "expected number, found '%s'", p->src + start);
+
+    if (take_ifc(p, '.')) take_while(p, is_digit);
+
+    *out = strtof(p->src + start, NULL);
+
+    return JB_OK_VAL;
+}
+
+// decimal integer, with optional sign
+static jb_res_t take_int(parser_t *p, long *out) {
+    size_t start = p->ptr;
+
+    if (is_eof(p)) return PARSE_ERR(p, start, "expected integer, found EOF", "");
+
+    if (!take_ifc(p, '-')) take_ifc(p, '+');
+
+    if (!take_while(p, is_digit))
+        return PARSE_ERR(p, start, "expected integer, found '%s'", p->src + start);
+
+    if (!is_eof(p) && p->src[p->ptr] == '.')
+        return PARSE_ERR(p, start, "expected integer, found number", "");
+
+    *out = strtol(p->src + start, NULL, 10);
+
+    return JB_OK_VAL;
+}
+
+//
+// envelopes
+//
+
+// `[TIME]s[LEVEL]` or `SUST`
+static jb_res_t parse_env_stage(parser_t *p, jb_env_stage_t *stage) {
+    skip_ws(p);
+
+    if (take_lit(p, "SUST")) {
+        stage->time = JB_ENV_SUSTAIN;
+        stage->amp = 0.0;
+        return JB_OK_VAL;
+    }
+
+    size_t start = p->ptr;
+    float time;
+
+    JB_TRY(take_num(p, &time));
+    JB_TRY(expect_char(p, 's'));
+    JB_TRY(take_num(p, &stage->amp));
+
+    if (time < 0.0) return PARSE_ERR(p, start, "negative stage length", "");
+
+    // a zero-length stage would be mistaken for a sustain, so round it up to 1us
+    stage->time = JB_MAX(1, (uint32_t)lroundf(time * 1000000.f));
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_parse_env(jb_patch_t *pt, const char *src) {
+    parser_t p;
+    parser_init(&p, src);
+
+    size_t name, name_len;
+    JB_TRY(take_name(&p, &name, &name_len));
+
+    jb_env_t env = {.start = jb_buf_len(pt->stages), .len = 0, .release = JB_NONE};
+    bool sustained = false;
+
+    for (;;) {
+        jb_env_stage_t stage;
+        JB_TRY(parse_env_stage(&p, &stage));
+
+        // the first stage after a sustain is where notes go when released
+        if (sustained && env.release == JB_NONE) env.release = env.start + env.len;
+        if (stage.time == JB_ENV_SUSTAIN) sustained = true;
+
+        jb_buf_push(pt->stages, stage);
+        env.len++;
+
+        skip_ws(&p);
+
+        if (!take_lit(&p, "->")) break;
+    }
+
+    JB_TRY(expect_end(&p));
+
+    jb_buf_push(pt->envs, env);
+
+    return jb_patch_define(pt, JB_SYM_ENV, src + name, name_len, jb_buf_len(pt->envs) - 1);
+}
+
+//
+// oscillators
+//
+
+static jb_res_t parse_pair(parser_t *p, size_t *key, size_t *key_len, size_t *val,
+                           size_t *val_len) {
+    skip_ws(p);
+    JB_TRY(take_ident(p, key, key_len));
+    skip_ws(p);
+    JB_TRY(expect_char(p, '='));
+    skip_ws(p);
+
+    *val = p->ptr;
+    if (!take_while(p, is_not_tok_end))
+        return PARSE_ERR(p, p->ptr, "key '%.*s' missing value", (int)*key_len, p->src + *key);
+
+    *val_len = p->ptr - *val;
+
+    return JB_OK_VAL;
+}
+
+// parse a list of `key=value` pairs into `fields`
+static jb_res_t parse_fields(parser_t *p, field_t *fields) {
+    size_t start = p->ptr;
+    bool taken = false;
+
+    for (;;) {
+        skip_ws(p);
+        if (!peek_if(p, is_ident_start)) break;
+
+        size_t key, key_len, val, val_len;
+        JB_TRY(parse_pair(p, &key, &key_len, &val, &val_len));
+
+        field_t *field = NULL;
+        for (field_t *cur = fields; cur->key; cur++)
+            if (strlen(cur->key) == key_len && strncmp(cur->key, p->src + key, key_len) == 0)
+                field = cur;
+
+        if (!field)
+            return PARSE_ERR(p, key, "unknown key '%.*s'", (int)key_len, p->src + key);
+
+        if (field->taken) return PARSE_ERR(p, key, "duplicate key '%s'", field->key);
+
+        JB_TRY(field->extract(p, p->src + val, val_len, field->out));
+        field->taken = true;
+        taken = true;
+    }
+
+    for (field_t *cur = fields; cur->key; cur++)
+        if (cur->required && !cur->taken)
+            return PARSE_ERR(p, start, "key '%s' required", cur->key);
+
+    if (!taken) return PARSE_ERR(p, start, "expected at least 1 field", "");
+
+    return JB_OK_VAL;
+}
+
+static jb_res_t extract_wave(parser_t *p, const char *str, size_t len, void *out) {
+    for (size_t i = 0; i < JB_WAVE_MAX; i++) {
+        if (strlen(jb_wave_str[i]) == len && strncmp(str, jb_wave_str[i], len) == 0) {
+            *(jb_wave_t *)out = i;
+            return JB_OK_VAL;
+        }
+    }
+
+    return PARSE_ERR(p, str - p->src, "expected wave, found '%.*s'", (int)len, str);
+}
+
+// semitones, stored as cents
+static jb_res_t extract_semis(parser_t *p, const char *str, size_t len, void *out) {
+    char *end;
+    long semis = strtol(str, &end, 10);
+
+    if (end != str + len || labs(semis) > JB_SEMIS(128))
+        return PARSE_ERR(p, str - p->src, "invalid semitones '%.*s'", (int)len, str);
+
+    *(jb_cents_t *)out = JB_SEMIS(semis);
+
+    return JB_OK_VAL;
+}
+
+static jb_res_t extract_hz(parser_t *p, const char *str, size_t len, void *out) {
+    char *end;
+    float val = strtof(str, &end);
+
+    if (end != str + len || val < 0.0 || !isfinite(val))
+        return PARSE_ERR(p, str - p->src, "invalid frequency '%.*s'", (int)len, str);
+
+    *(float *)out = val;
+
+    return JB_OK_VAL;
+}
+
+// a span of the source, interned into the string table once the definition has parsed
+typedef struct {
+    const char *str;
+    size_t len;
+} span_t;
+
+static jb_res_t extract_span(parser_t *p, const char *str, size_t len, void *out) {
+    (void)p;
+    *(span_t *)out = (span_t){str, len};
+
+    return JB_OK_VAL;
+}
+
+static uint32_t intern(jb_patch_t *pt, span_t span) {
+    uint32_t off = jb_buf_len(pt->strs);
+
+    for (size_t i = 0; i < span.len; i++) jb_buf_push(pt->strs, span.str[i]);
+    jb_buf_push(pt->strs, '\0');
+
+    pt->n_strs = jb_buf_len(pt->strs);
+
+    return off;
+}
+
+static jb_res_t extract_level(parser_t *p, const char *str, size_t len, void *out) {
+    char *end;
+    float val = strtof(str, &end);
+
+    if (end != str + len)
+        return PARSE_ERR(p, str - p->src, "invalid level '%.*s'", (int)len, str);
+
+    if (val < 0.0 || val > 1.0)
+        return PARSE_ERR(
+            p, str - p->src, "level '%.*s' out of range '0.0 -> 1.0'", (int)len, str);
+
+    *(float *)out = val;
+
+    return JB_OK_VAL;
+}
+
+// `[TIME]s`, stored in usecs
+static jb_res_t extract_time(parser_t *p, const char *str, size_t len, void *out) {
+    char *end;
+    float val = strtof(str, &end);
+
+    if (end != str + len - 1 || *end != 's' || val < 0.0 || val > 60.0)
+        return PARSE_ERR(p, str - p->src, "invalid time '%.*s'", (int)len, str);
+
+    *(uint32_t *)out = (uint32_t)lroundf(val * 1000000.f);
+
+    return JB_OK_VAL;
+}
+
+// `on` or `off`
+static jb_res_t extract_switch(parser_t *p, const char *str, size_t len, void *out) {
+    if (len == 2 && strncmp(str, "on", len) == 0)
+        *(bool *)out = true;
+    else if (len == 3 && strncmp(str, "off", len) == 0)
+        *(bool *)out = false;
+    else
+        return PARSE_ERR(p, str - p->src, "expected 'on' or 'off', found '%.*s'", (int)len, str);
+
+    return JB_OK_VAL;
+}
+
+// `[RATIO]:[LEVEL],...`, where a level on its own is the next harmonic (e.g. `1.0,0.5,3.5:0.2`),
+// sorted by ratio
+static jb_res_t parse_partials(parser_t *p, span_t span, jb_partial_t *out, uint32_t *len) {
+    const char *str = span.str, *end = span.str + span.len;
+    *len = 0;
+
+    while (str < end) {
+        const char *item = str;
+        const char *comma = memchr(item, ',', end - item);
+        const char *item_end = comma ? comma : end;
+        const char *colon = memchr(item, ':', item_end - item);
+
+        if (*len == JB_PARTIALS)
+            return PARSE_ERR(p, item - p->src, "more than %d partials", JB_PARTIALS);
+
+        jb_partial_t partial = {.ratio = *len + 1};
+        char *num_end;
+
+        if (colon) {
+            partial.ratio = strtof(item, &num_end);
+
+            if (num_end != colon || !(partial.ratio > 0.0) || !isfinite(partial.ratio))
+                return PARSE_ERR(
+                    p, item - p->src, "invalid ratio '%.*s'", (int)(colon - item), item);
+        }
+
+        const char *level = colon ? colon + 1 : item;
+        if (level == item_end) return PARSE_ERR(p, level - p->src, "partial missing level", "");
+
+        JB_TRY(extract_level(p, level, item_end - level, &partial.amp));
+
+        // insertion sort; there are never many
+        uint32_t i = (*len)++;
+        for (; i > 0 && out[i - 1].ratio > partial.ratio; i--) out[i] = out[i - 1];
+        out[i] = partial;
+
+        str = item_end + 1;
+    }
+
+    if (*len == 0) return PARSE_ERR(p, span.str - p->src, "expected at least 1 partial", "");
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_parse_osc(jb_patch_t *pt, const char *src) {
+    parser_t p;
+    parser_init(&p, src);
+
+    size_t name, name_len;
+    JB_TRY(take_name(&p, &name, &name_len));
+
+    jb_osc_t osc = {.wave = JB_WAVE_SIN,
+                    .detune = 0,
+                    .amp = 0.0,
+                    .bias = 0.001,
+                    .hz = 0,
+                    .sample = JB_NONE,
+                    .root = JB_SEMIS(60),
+                    .partials = JB_NONE,
+                    .n_partials = 0};
+    span_t sample, partials;
+    size_t start = p.ptr;
+
+    field_t fields[] = {
+        {.key = "wave", .out = &osc.wave, .required = false, .extract = extract_wave},
+        {.key = "base", .out = &osc.detune, .required = false, .extract = extract_semis},
+        {.key = "vol", .out = &osc.amp, .required = true, .extract = extract_level},
+        {.key = "bias", .out = &osc.bias, .required = false, .extract = extract_level},
+        {.key = "hz", .out = &osc.hz, .required = false, .extract = extract_hz},
+        {.key = "sample", .out = &sample, .required = false, .extract = extract_span},
+        {.key = "root", .out = &osc.root, .required = false, .extract = extract_semis},
+        {.key = "partials", .out = &partials, .required = false, .extract = extract_span},
+        FIELD_LAST};
+
+    JB_TRY(parse_fields(&p, fields));
+    JB_TRY(expect_end(&p));
+
+    // an oscillator plays either a wave, a sample or a set of partials
+    bool has_wave = fields[0].taken, has_sample = fields[5].taken, has_partials = fields[7].taken;
+
+    if (has_wave + has_sample + has_partials != 1)
+        return PARSE_ERR(&p, start, "expected one of keys 'wave', 'sample' or 'partials'", "");
+
+    if (!has_sample && fields[6].taken)
+        return PARSE_ERR(&p, start, "key 'root' only applies to samples", "");
+
+    if (has_partials) {
+        jb_partial_t parts[JB_PARTIALS];
+        JB_TRY(parse_partials(&p, partials, parts, &osc.n_partials));
+
+        osc.partials = jb_buf_len(pt->partials);
+        for (uint32_t i = 0; i < osc.n_partials; i++) jb_buf_push(pt->partials, parts[i]);
+    }
+
+    if (has_sample) osc.sample = intern(pt, sample);
+
+    jb_buf_push(pt->oscs, osc);
+
+    return jb_patch_define(pt, JB_SYM_OSC, src + name, name_len, jb_buf_len(pt->oscs) - 1);
+}
+
+//
+// instruments
+//
+
+// `[NAME] [ENV]: [OSC] ([OP] [OSC])* ([KEY]=[VALUE])*`
+jb_res_t jb_parse_inst(jb_patch_t *pt, const char *src) {
+    parser_t p;
+    parser_init(&p, src);
+
+    size_t name, name_len;
+    skip_ws(&p);
+    JB_TRY(take_ident(&p, &name, &name_len));
+    skip_ws(&p);
+
+    size_t env, env_len;
+    JB_TRY(take_name(&p, &env, &env_len));
+
+    const jb_sym_t *env_sym = jb_patch_find(pt, JB_SYM_ENV, src + env, env_len);
+    if (!env_sym)
+        return PARSE_ERR(&p, env, "no such envelope '%.*s'", (int)env_len, src + env);
+
+    jb_inst_t inst = {
+        .env = env_sym->idx, .chain = jb_buf_len(pt->links), .len = 0, .glide = 0, .legato = false};
+
+    for (;;) {
+        skip_ws(&p);
+
+        size_t osc, osc_len;
+        JB_TRY(take_ident(&p, &osc, &osc_len));
+
+        const jb_sym_t *osc_sym = jb_patch_find(pt, JB_SYM_OSC, src + osc, osc_len);
+        if (!osc_sym)
+            return PARSE_ERR(&p, osc, "no such oscillator '%.*s'", (int)osc_len, src + osc);
+
+        jb_osc_link_t link = {.osc = osc_sym->idx, .mod = JB_MOD_AM};
+
+        skip_ws(&p);
+
+        bool more = true;
+        if (take_ifc(&p, '%'))
+            link.mod = JB_MOD_FM;
+        else if (take_ifc(&p, '+'))
+            link.mod = JB_MOD_PM;
+        else if (take_ifc(&p, '*'))
+            link.mod = JB_MOD_AM;
+        else if (take_ifc(&p, '-'))
+            link.mod = JB_MOD_BM;
+        else
+            more = false;
+
+        if (inst.len == JB_CHAIN_MAX)
+            return PARSE_ERR(&p, osc, "chain is longer than %d oscillators", JB_CHAIN_MAX);
+
+        // samples and partials are played as they are, rather than through a chain
+        if (pt->oscs[link.osc].sample != JB_NONE && (inst.len > 0 || more))
+            return PARSE_ERR(&p, osc, "sample oscillators can't be chained", "");
+
+        if (pt->oscs[link.osc].partials != JB_NONE && (inst.len > 0 || more))
+            return PARSE_ERR(&p, osc, "additive oscillators can't be chained", "");
+
+        jb_buf_push(pt->links, link);
+        inst.len++;
+
+        if (!more) break;
+    }
+
+    field_t fields[] = {
+        {.key = "glide", .out = &inst.glide, .required = false, .extract = extract_time},
+        {.key = "legato", .out = &inst.legato, .required = false, .extract = extract_switch},
+        FIELD_LAST};
+
+    skip_ws(&p);
+    if (peek_if(&p, is_ident_start)) JB_TRY(parse_fields(&p, fields));
+
+    JB_TRY(expect_end(&p));
+
+    jb_buf_push(pt->insts, inst);
+
+    return jb_patch_define(pt, JB_SYM_INST, src + name, name_len, jb_buf_len(pt->insts) - 1);
+}
+
+//
+// channels
+//
+
+// `[PORT].[CHAN]`, or a logical channel number, followed by `:`
+static jb_res_t take_chan(parser_t *p, long *out) {
+    skip_ws(p);
+    size_t start = p->ptr;
+
+    take_while(p, is_digit);
+
+    if (p->ptr > start && take_ifc(p, '.')) {
+        long port = strtol(p->src + start, NULL, 10);
+        long chan;
+
+        JB_TRY(take_int(p, &chan));
+
+        if (port >= JB_MIDI_PORTS)
+            return PARSE_ERR(p, start, "port %ld out of range '0 -> %d'", port, JB_MIDI_PORTS - 1);
+        if (chan < 0 || chan >= JB_PORT_CHANS)
+            return PARSE_ERR(p, start, "channel %ld out of range '0 -> %d'", chan, JB_PORT_CHANS - 1);
+
+        *out = port * JB_PORT_CHANS + chan;
+    } else {
+        p->ptr = start;
+        JB_TRY(take_int(p, out));
+
+        if (*out < 0 || *out >= JB_CHANS)
+            return PARSE_ERR(p, start, "channel %ld out of range '0 -> %d'", *out, JB_CHANS - 1);
+    }
+
+    return expect_char(p, ':');
+}
+
+// channel an instrument is assigned to (-1 if none)
+static long chan_of_inst(const jb_patch_t *pt, uint32_t inst) {
+    for (size_t c = 0; c < JB_CHANS; c++)
+        for (size_t i = 0; i < pt->chans[c].len; i++)
+            if (pt->chans[c].insts[i] == inst) return c;
+
+    return -1;
+}
+
+// `[CHAN]: [INST]* ([KEY]=[VALUE])*`
+jb_res_t jb_parse_chan(jb_patch_t *pt, const char *src) {
+    parser_t p;
+    parser_init(&p, src);
+
+    skip_ws(&p);
+    size_t start = p.ptr;
+
+    long idx;
+    JB_TRY(take_chan(&p, &idx));
+
+    jb_chan_t *chan = &pt->chans[idx];
+    bool taken = false;
+
+    for (;;) {
+        skip_ws(&p);
+        if (!peek_if(&p, is_ident_start)) break;
+
+        size_t name, name_len;
+        JB_TRY(take_ident(&p, &name, &name_len));
+
+        // the instruments end where the fields start
+        skip_ws(&p);
+        if (take_ifc(&p, '=')) {
+            p.ptr = name;
+            break;
+        }
+
+        if (chan->len >= JB_CHAN_INSTS)
+            return PARSE_ERR(
+                &p, name, "a channel can only have %d instruments", JB_CHAN_INSTS);
+
+        const jb_sym_t *inst = jb_patch_find(pt, JB_SYM_INST, src + name, name_len);
+        if (!inst)
+            return PARSE_ERR(&p, name, "no such instrument '%.*s'", (int)name_len, src + name);
+
+        // voices belong to an instrument, so it can only be played through one channel
+        long owner = chan_of_inst(pt, inst->idx);
+        if (owner >= 0)
+            return PARSE_ERR(&p,
+                             name,
+                             "instrument '%.*s' is already assigned to channel %ld.%ld",
+                             (int)name_len,
+                             src + name,
+                             owner / JB_PORT_CHANS,
+                             owner % JB_PORT_CHANS);
+
+        chan->insts[chan->len++] = inst->idx;
+        taken = true;
+    }
+
+    if (!taken) return PARSE_ERR(&p, start, "channel needs at least 1 instrument", "");
+
+    field_t fields[] = {
+        {.key = "bend", .out = &chan->bend, .required = false, .extract = extract_semis},
+        FIELD_LAST};
+
+    size_t fields_start = p.ptr;
+    if (peek_if(&p, is_ident_start)) JB_TRY(parse_fields(&p, fields));
+
+    if (chan->bend < 0 || chan->bend > JB_SEMIS(48))
+        return PARSE_ERR(&p, fields_start, "bend out of range '0 -> 48'", "");
+
+    return expect_end(&p);
+}
+
+//
+// controller routes
+//
+
+static bool is_num_start(char c) {
+    return isdigit(c) || c == '-' || c == '+';
+}
+
+// find a name in a table of names, returning `max` if it isn't there
+static size_t lookup(const char **strs, size_t min, size_t max, const char *str, size_t len) {
+    for (size_t i = min; i < max; i++)
+        if (strlen(strs[i]) == len && strncmp(str, strs[i], len) == 0) return i;
+
+    return max;
+}
+
+// `vol`, `pan`, or `[OSC].[vol|bias|wave]`
+static jb_res_t parse_target(jb_patch_t *pt, parser_t *p, jb_route_t *route) {
+    size_t name, name_len;
+    JB_TRY(take_ident(p, &name, &name_len));
+
+    const char *src = p->src;
+
+    if (!take_ifc(p, '.')) {
+        route->target = lookup(jb_target_str, JB_TARGET_VOL, JB_TARGET_PAN + 1, src + name, name_len);
+        if (route->target > JB_TARGET_PAN)
+            return PARSE_ERR(p, name, "no such channel parameter '%.*s'", (int)name_len, src + name);
+
+        return JB_OK_VAL;
+    }
+
+    const jb_sym_t *osc = jb_patch_find(pt, JB_SYM_OSC, src + name, name_len);
+    if (!osc) return PARSE_ERR(p, name, "no such oscillator '%.*s'", (int)name_len, src + name);
+
+    size_t field, field_len;
+    JB_TRY(take_ident(p, &field, &field_len));
+
+    route->target = lookup(jb_target_str, JB_TARGET_AMP, JB_TARGET_MAX, src + field, field_len);
+    if (route->target == JB_TARGET_MAX)
+        return PARSE_ERR(
+            p, field, "no such oscillator parameter '%.*s'", (int)field_len, src + field);
+
+    route->idx = osc->idx;
+
+    return JB_OK_VAL;
+}
+
+// `[CHAN]: [CC] [TARGET] ([LO] [HI])? ([CURVE])?`
+jb_res_t jb_parse_route(jb_patch_t *pt, const char *src) {
+    parser_t p;
+    parser_init(&p, src);
+
+    long chan;
+    JB_TRY(take_chan(&p, &chan));
+
+    skip_ws(&p);
+    size_t cc_start = p.ptr;
+
+    long cc;
+    JB_TRY(take_int(&p, &cc));
+
+    if (cc < 0 || cc >= JB_CCS)
+        return PARSE_ERR(&p, cc_start, "controller %ld out of range '0 -> %d'", cc, JB_CCS - 1);
+
+    jb_route_t route = {.idx = chan, .lo = 0.0, .hi = 1.0, .curve = JB_CURVE_LIN};
+
+    skip_ws(&p);
+    JB_TRY(parse_target(pt, &p, &route));
+
+    // wave kinds are spread across the whole controller range by default
+    if (route.target == JB_TARGET_WAVE) route.hi = JB_WAVE_MAX - 1;
+
+    skip_ws(&p);
+    if (peek_if(&p, is_num_start)) {
+        JB_TRY(take_num(&p, &route.lo));
+        skip_ws(&p);
+        JB_TRY(take_num(&p, &route.hi));
+        skip_ws(&p);
+    }
+
+    if (peek_if(&p, is_ident_start)) {
+        size_t curve, curve_len;
+        JB_TRY(take_ident(&p, &curve, &curve_len));
+
+        route.curve = lookup(jb_curve_str, 0, JB_CURVE_MAX, src + curve, curve_len);
+        if (route.curve == JB_CURVE_MAX)
+            return PARSE_ERR(&p, curve, "no such curve '%.*s'", (int)curve_len, src + curve);
+    }
+
+    JB_TRY(expect_end(&p));
+
+    // a controller has one route per channel; routing it again replaces the old route in place
+    uint32_t *slot = &pt->chans[chan].ccs[cc];
+
+    if (*slot != JB_NONE) {
+        pt->routes[*slot] = route;
+    } else {
+        jb_buf_push(pt->routes, route);
+        *slot = jb_buf_len(pt->routes) - 1;
+    }
+
+    return JB_OK_VAL;
+}
+
+// `([CHAN]:)? [TARGET] [VALUE]`; channel parameters need a channel
+jb_res_t jb_parse_param(jb_patch_t *pt, const char *src, jb_route_t *param, float *val) {
+    parser_t p;
+    parser_init(&p, src);
+
+    skip_ws(&p);
+
+    long chan = -1;
+    if (peek_if(&p, is_digit)) JB_TRY(take_chan(&p, &chan));
+
+    skip_ws(&p);
+    size_t start = p.ptr;
+
+    jb_route_t route = {.lo = 0.0, .hi = 1.0, .curve = JB_CURVE_LIN};
+    JB_TRY(parse_target(pt, &p, &route));
+
+    if (route.target <= JB_TARGET_PAN) {
+        if (chan < 0) return PARSE_ERR(&p, start, "channel parameters need a channel", "");
+        route.idx = chan;
+    }
+
+    skip_ws(&p);
+    JB_TRY(take_num(&p, val));
+    JB_TRY(expect_end(&p));
+
+    *param = route;
+
+    return JB_OK_VAL;
+}
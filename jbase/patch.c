@@ -0,0 +1,473 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// patch.c: compiled patch sets
+//
+// a patch set is a handful of flat tables (oscillators, envelope stages, instruments, ...) that
+// only refer to eachother by index. this keeps them free of pointers, so that they can be written
+// to disk and mapped straight back in by image.c
+//
+
+#include <errno.h>
+#include <jbase.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// bumped whenever the patch language or compiled representation changes
+#define PATCH_VERSION 6
+
+#define DEFS_LINE_MAX 1024 // longest line in a file of definitions
+
+const char *jb_target_str[JB_TARGET_MAX] = {
+    [JB_TARGET_VOL] = "vol",
+    [JB_TARGET_PAN] = "pan",
+    [JB_TARGET_AMP] = "vol",
+    [JB_TARGET_BIAS] = "bias",
+    [JB_TARGET_WAVE] = "wave",
+};
+
+const char *jb_curve_str[JB_CURVE_MAX] = {
+    [JB_CURVE_LIN] = "lin",
+    [JB_CURVE_EXP] = "exp",
+    [JB_CURVE_LOG] = "log",
+};
+
+// route a controller on a channel, returning the route's index
+static uint32_t patch_route(jb_patch_t *pt, uint32_t chan, uint8_t cc, jb_route_t route) {
+    jb_buf_push(pt->routes, route);
+    pt->chans[chan].ccs[cc] = jb_buf_len(pt->routes) - 1;
+
+    return pt->chans[chan].ccs[cc];
+}
+
+void jb_patch_init(jb_patch_t *pt) {
+    memset(pt, 0, sizeof(*pt));
+
+    for (uint32_t i = 0; i < JB_CHANS; i++) {
+        jb_chan_t chan = {.len = 0, .bend = JB_BEND_RANGE};
+        for (size_t j = 0; j < JB_CCS; j++) chan.ccs[j] = JB_NONE;
+
+        jb_buf_push(pt->chans, chan);
+
+        // every channel starts with the standard volume and pan controllers, which patches may
+        // reroute
+        patch_route(pt, i, JB_VOL_CC, (jb_route_t){JB_TARGET_VOL, i, 0.0, 1.0, JB_CURVE_EXP});
+        patch_route(pt, i, JB_PAN_CC, (jb_route_t){JB_TARGET_PAN, i, 0.0, 1.0, JB_CURVE_LIN});
+    }
+
+    pt->n_routes = jb_buf_len(pt->routes);
+}
+
+void jb_patch_free(jb_patch_t *pt) {
+    if (pt->image) {
+        // tables point into the mapping, so there's nothing else to free
+        munmap(pt->image, pt->image_len);
+    } else {
+        jb_buf_free(pt->oscs);
+        jb_buf_free(pt->stages);
+        jb_buf_free(pt->envs);
+        jb_buf_free(pt->links);
+        jb_buf_free(pt->insts);
+        jb_buf_free(pt->chans);
+        jb_buf_free(pt->routes);
+        jb_buf_free(pt->partials);
+        jb_buf_free(pt->syms);
+        jb_buf_free(pt->strs);
+        free(pt->slots);
+    }
+
+    memset(pt, 0, sizeof(*pt));
+}
+
+uint64_t jb_patch_hash(const jb_def_t *defs, size_t len) {
+    uint32_t version = PATCH_VERSION;
+    uint64_t hash = jb_hash(JB_HASH_INIT, &version, sizeof(version));
+
+    for (size_t i = 0; i < len; i++) {
+        char kind = defs[i].kind;
+
+        hash = jb_hash(hash, &kind, 1);
+        // include the NUL terminator, so that definitions can't run into eachother
+        hash = jb_hash(hash, defs[i].src, strlen(defs[i].src) + 1);
+    }
+
+    return hash;
+}
+
+jb_res_t jb_defs_read(const char *path, jb_def_t **defs) {
+    FILE *f = fopen(path, "r");
+    if (!f) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    char line[DEFS_LINE_MAX];
+    size_t n = 0;
+    jb_res_t res = JB_OK_VAL;
+
+    while (fgets(line, sizeof(line), f)) {
+        n++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char *src = line + strspn(line, " \t");
+        if (*src == '\0' || *src == '#') continue;
+
+        if (*src == '-') src++;
+
+        if (*src == '\0' || !strchr("EOICR", *src) || (src[1] != ' ' && src[1] != '\t')) {
+            res = JB_ERR(JB_ERR_PARSE, "%s:%zu: expected '-[E|O|I|C|R] [SRC]'", path, n);
+            break;
+        }
+
+        char *copy = strdup(src + 2);
+        if (!copy) {
+            res = JB_ERR(JB_ERR_OOM, "failed to read '%s'", path);
+            break;
+        }
+
+        jb_buf_push(*defs, ((jb_def_t){.kind = (jb_def_kind_t)*src, .src = copy}));
+    }
+
+    fclose(f);
+    return res;
+}
+
+void jb_defs_free(jb_def_t *defs) {
+    for (size_t i = 0; i < jb_buf_len(defs); i++) free(defs[i].src);
+    jb_buf_free(defs);
+}
+
+// update table lengths after the tables have been pushed to
+static void patch_sync(jb_patch_t *pt) {
+    pt->n_oscs = jb_buf_len(pt->oscs);
+    pt->n_stages = jb_buf_len(pt->stages);
+    pt->n_envs = jb_buf_len(pt->envs);
+    pt->n_links = jb_buf_len(pt->links);
+    pt->n_insts = jb_buf_len(pt->insts);
+    pt->n_routes = jb_buf_len(pt->routes);
+    pt->n_partials = jb_buf_len(pt->partials);
+    pt->n_syms = jb_buf_len(pt->syms);
+    pt->n_strs = jb_buf_len(pt->strs);
+}
+
+jb_res_t jb_patch_compile(jb_patch_t *pt, const jb_def_t *defs, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        jb_res_t res;
+
+        switch (defs[i].kind) {
+            case JB_DEF_ENV:
+                res = jb_parse_env(pt, defs[i].src);
+                break;
+            case JB_DEF_OSC:
+                res = jb_parse_osc(pt, defs[i].src);
+                break;
+            case JB_DEF_INST:
+                res = jb_parse_inst(pt, defs[i].src);
+                break;
+            case JB_DEF_CHAN:
+                res = jb_parse_chan(pt, defs[i].src);
+                break;
+            case JB_DEF_ROUTE:
+                res = jb_parse_route(pt, defs[i].src);
+                break;
+            default:
+                res = JB_ERR(JB_ERR_PARSE, "unknown definition kind '%c'", defs[i].kind);
+        }
+
+        patch_sync(pt);
+
+        if (res JB_IS_ERR) {
+            jb_error("failed to compile '-%c %s'", defs[i].kind, defs[i].src);
+            return res;
+        }
+    }
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_patch_check(const jb_patch_t *pt) {
+    for (size_t i = 0; i < pt->n_insts; i++)
+        if (pt->insts[i].len == 0 || pt->insts[i].len > JB_CHAIN_MAX ||
+            (size_t)pt->insts[i].chain + pt->insts[i].len > pt->n_links)
+            return JB_ERR(JB_ERR_IMAGE, "instrument %zu has a malformed chain", i);
+
+    for (size_t i = 0; i < pt->n_insts; i++)
+        if (pt->insts[i].env >= pt->n_envs)
+            return JB_ERR(JB_ERR_IMAGE, "instrument %zu has a malformed envelope", i);
+
+    // a bool holding anything but 0 or 1 is undefined, so its byte is read as it was stored
+    for (size_t i = 0; i < pt->n_insts; i++) {
+        uint8_t legato;
+        memcpy(&legato, &pt->insts[i].legato, 1);
+
+        if (legato > 1) return JB_ERR(JB_ERR_IMAGE, "instrument %zu has a malformed legato", i);
+    }
+
+    // stages are stepped through up to the end of their envelope, and a release jumps into them
+    for (size_t i = 0; i < pt->n_envs; i++) {
+        const jb_env_t *env = &pt->envs[i];
+
+        if (env->len == 0 || (size_t)env->start + env->len > pt->n_stages ||
+            (env->release != JB_NONE &&
+             (env->release < env->start || env->release >= env->start + env->len)))
+            return JB_ERR(JB_ERR_IMAGE, "envelope %zu has malformed stages", i);
+    }
+
+    for (size_t i = 0; i < pt->n_links; i++)
+        if (pt->links[i].osc >= pt->n_oscs)
+            return JB_ERR(JB_ERR_IMAGE, "link %zu has a malformed oscillator", i);
+
+    for (size_t i = 0; i < pt->n_links; i++)
+        if (pt->links[i].mod >= JB_MOD_MAX)
+            return JB_ERR(JB_ERR_IMAGE, "link %zu has a malformed modulation", i);
+
+    for (size_t i = 0; i < pt->n_oscs; i++)
+        if (pt->oscs[i].wave >= JB_WAVE_MAX)
+            return JB_ERR(JB_ERR_IMAGE, "oscillator %zu has a malformed wave", i);
+
+    if (pt->n_strs && pt->strs[pt->n_strs - 1] != '\0')
+        return JB_ERR(JB_ERR_IMAGE, "string table is unterminated");
+
+    for (size_t i = 0; i < pt->n_oscs; i++)
+        if (pt->oscs[i].sample != JB_NONE && pt->oscs[i].sample >= pt->n_strs)
+            return JB_ERR(JB_ERR_IMAGE, "oscillator %zu has a malformed sample", i);
+
+    for (size_t i = 0; i < pt->n_oscs; i++)
+        if (pt->oscs[i].partials != JB_NONE &&
+            (pt->oscs[i].n_partials == 0 || pt->oscs[i].n_partials > JB_PARTIALS ||
+             (size_t)pt->oscs[i].partials + pt->oscs[i].n_partials > pt->n_partials))
+            return JB_ERR(JB_ERR_IMAGE, "oscillator %zu has malformed partials", i);
+
+    for (size_t i = 0; i < pt->n_insts; i++) {
+        const jb_osc_t *osc = &pt->oscs[pt->links[pt->insts[i].chain].osc];
+
+        if (osc->sample != JB_NONE && pt->insts[i].len != 1)
+            return JB_ERR(JB_ERR_IMAGE, "instrument %zu chains a sample", i);
+        if (osc->partials != JB_NONE && pt->insts[i].len != 1)
+            return JB_ERR(JB_ERR_IMAGE, "instrument %zu chains partials", i);
+    }
+
+    for (size_t i = 0; i < pt->n_routes; i++) {
+        const jb_route_t *route = &pt->routes[i];
+        size_t max = route->target <= JB_TARGET_PAN ? JB_CHANS : pt->n_oscs;
+
+        if (route->target >= JB_TARGET_MAX || route->curve >= JB_CURVE_MAX || route->idx >= max)
+            return JB_ERR(JB_ERR_IMAGE, "route %zu is malformed", i);
+    }
+
+    for (size_t i = 0; i < JB_CHANS; i++)
+        for (size_t j = 0; j < JB_CCS; j++)
+            if (pt->chans[i].ccs[j] != JB_NONE && pt->chans[i].ccs[j] >= pt->n_routes)
+                return JB_ERR(JB_ERR_IMAGE, "channel %zu has malformed routes", i);
+
+    for (size_t i = 0; i < JB_CHANS; i++) {
+        const jb_chan_t *chan = &pt->chans[i];
+
+        if (chan->len > JB_CHAN_INSTS)
+            return JB_ERR(JB_ERR_IMAGE, "channel %zu has malformed instruments", i);
+
+        for (size_t j = 0; j < chan->len; j++)
+            if (chan->insts[j] >= pt->n_insts)
+                return JB_ERR(JB_ERR_IMAGE, "channel %zu has malformed instruments", i);
+    }
+
+    // an instrument's voices are stepped and mixed once per channel it's on, so it can only be on
+    // one (see jb_parse_chan)
+    for (size_t i = 0; i < JB_CHANS * JB_CHAN_INSTS; i++) {
+        const jb_chan_t *a = &pt->chans[i / JB_CHAN_INSTS];
+        if (i % JB_CHAN_INSTS >= a->len) continue;
+
+        for (size_t j = 0; j < i; j++) {
+            const jb_chan_t *b = &pt->chans[j / JB_CHAN_INSTS];
+
+            if (j % JB_CHAN_INSTS < b->len &&
+                a->insts[i % JB_CHAN_INSTS] == b->insts[j % JB_CHAN_INSTS])
+                return JB_ERR(JB_ERR_IMAGE, "instrument %u is on more than one channel",
+                              a->insts[i % JB_CHAN_INSTS]);
+        }
+    }
+
+    // names are read straight out of the string table, and lookups follow slots to symbols
+    for (size_t i = 0; i < pt->n_syms; i++) {
+        const jb_sym_t *sym = &pt->syms[i];
+
+        size_t objs = sym->kind == JB_SYM_OSC ? pt->n_oscs
+                    : sym->kind == JB_SYM_ENV ? pt->n_envs
+                                              : pt->n_insts;
+
+        if (sym->kind >= JB_SYM_MAX || sym->idx >= objs ||
+            (size_t)sym->name + sym->len >= pt->n_strs || pt->strs[sym->name + sym->len] != '\0')
+            return JB_ERR(JB_ERR_IMAGE, "symbol %zu is malformed", i);
+    }
+
+    for (size_t i = 0; i < pt->n_slots; i++)
+        if (pt->slots[i].sym != JB_NONE && pt->slots[i].sym >= pt->n_syms)
+            return JB_ERR(JB_ERR_IMAGE, "symbol index slot %zu is malformed", i);
+
+    return JB_OK_VAL;
+}
+
+// lock a table's whole buffer, if it has one
+#define LOCK_BUF(b) \
+    if (b) JB_TRY(jb_mem_lock(jb_buf_hdr(b), offsetof(jb_buf_hdr_t, buf) + jb_buf_cap(b) * sizeof(*(b))))
+
+jb_res_t jb_patch_lock(const jb_patch_t *pt) {
+    if (pt->image) return jb_mem_lock(pt->image, pt->image_len);
+
+    LOCK_BUF(pt->oscs);
+    LOCK_BUF(pt->stages);
+    LOCK_BUF(pt->envs);
+    LOCK_BUF(pt->links);
+    LOCK_BUF(pt->insts);
+    LOCK_BUF(pt->chans);
+    LOCK_BUF(pt->routes);
+    LOCK_BUF(pt->partials);
+    LOCK_BUF(pt->syms);
+    LOCK_BUF(pt->strs);
+
+    return jb_mem_lock(pt->slots, pt->n_slots * sizeof(*pt->slots));
+}
+
+// log an instrument's envelope and oscillator chain on one line
+static void log_inst(const jb_patch_t *pt, const jb_inst_t *inst) {
+    char line[256];
+    size_t len = 0;
+
+    const char *env = jb_patch_name(pt, JB_SYM_ENV, inst->env);
+    len += snprintf(line + len, sizeof(line) - len, "%s:", env ? env : "?");
+
+    for (size_t i = 0; i < inst->len && len < sizeof(line); i++) {
+        const jb_osc_link_t *link = &pt->links[inst->chain + i];
+        const char *osc = jb_patch_name(pt, JB_SYM_OSC, link->osc);
+
+        len += snprintf(line + len, sizeof(line) - len, " %s", osc ? osc : "?");
+
+        if (i + 1 < inst->len && len < sizeof(line))
+            len += snprintf(line + len, sizeof(line) - len, " %c", jb_mod_char[link->mod]);
+    }
+
+    if (inst->glide && len < sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, " glide=%fs", inst->glide / 1e6);
+    if (inst->legato && len < sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, " legato=on");
+
+    jb_log_line("       %s", line);
+}
+
+// log an additive oscillator's partials on one line, as they'd be written in a patch
+static void log_partials(const jb_patch_t *pt, const jb_osc_t *osc) {
+    char line[256];
+    size_t len = 0;
+
+    for (size_t i = 0; i < osc->n_partials && len < sizeof(line); i++) {
+        const jb_partial_t *partial = &pt->partials[osc->partials + i];
+
+        len += snprintf(line + len, sizeof(line) - len, "%s%g:%g", i ? "," : "", partial->ratio,
+                        partial->amp);
+    }
+
+    jb_log_line("       partials=%s", line);
+}
+
+static void log_route(const jb_patch_t *pt, size_t cc, const jb_route_t *route) {
+    const char *osc = "";
+    const char *dot = "";
+
+    if (route->target >= JB_TARGET_AMP) {
+        osc = jb_patch_name(pt, JB_SYM_OSC, route->idx);
+        osc = osc ? osc : "?";
+        dot = ".";
+    }
+
+    jb_log_line("      cc %zu -> %s%s%s %f %f %s",
+                cc,
+                osc,
+                dot,
+                jb_target_str[route->target],
+                route->lo,
+                route->hi,
+                jb_curve_str[route->curve]);
+}
+
+void jb_patch_log(const jb_patch_t *pt) {
+    jb_info("patch set%s:", pt->image ? " (from image)" : "");
+
+    jb_log_line("  objects:");
+    for (size_t i = 0; i < pt->n_syms; i++) {
+        const jb_sym_t *sym = &pt->syms[i];
+
+        jb_log_line("     " JB_FG_GREEN "%s " JB_RESET "%s:",
+                    jb_sym_str[sym->kind],
+                    pt->strs + sym->name);
+
+        switch (sym->kind) {
+            case JB_SYM_OSC: {
+                const jb_osc_t *osc = &pt->oscs[sym->idx];
+
+                if (osc->sample != JB_NONE) {
+                    jb_log_line("       sample=%s", pt->strs + osc->sample);
+                    jb_log_line("       root=%d", osc->root / 100);
+                } else if (osc->partials != JB_NONE) {
+                    log_partials(pt, osc);
+                } else {
+                    jb_log_line("       wave=%s", jb_wave_str[osc->wave]);
+                }
+                jb_log_line("       detune=%d", osc->detune);
+                jb_log_line("       bias=%f", osc->bias);
+                jb_log_line("       vol=%f", osc->amp);
+                if (osc->hz != 0) jb_log_line("       hz=%f", osc->hz);
+            } break;
+
+            case JB_SYM_ENV: {
+                const jb_env_t *env = &pt->envs[sym->idx];
+
+                for (size_t j = env->start; j < env->start + env->len; j++) {
+                    if (pt->stages[j].time == JB_ENV_SUSTAIN)
+                        jb_log_line("       SUST");
+                    else
+                        jb_log_line("       %f over %uμs", pt->stages[j].amp, pt->stages[j].time);
+                }
+            } break;
+
+            case JB_SYM_INST:
+                log_inst(pt, &pt->insts[sym->idx]);
+                break;
+
+            default:
+                jb_log_line("       unknown");
+        }
+    }
+
+    jb_log_line("  chans:");
+    for (size_t i = 0; i < JB_CHANS; i++) {
+        const jb_chan_t *chan = &pt->chans[i];
+        if (chan->len == 0) continue;
+
+        jb_log_line("    chan %zu.%zu (bend=%d):",
+                    i / JB_PORT_CHANS,
+                    i % JB_PORT_CHANS,
+                    chan->bend / 100);
+
+        for (size_t j = 0; j < chan->len; j++) {
+            const char *name = jb_patch_name(pt, JB_SYM_INST, chan->insts[j]);
+            jb_log_line("      %s", name ? name : "?");
+        }
+
+        for (size_t j = 0; j < JB_CCS; j++)
+            if (chan->ccs[j] != JB_NONE) log_route(pt, j, &pt->routes[chan->ccs[j]]);
+    }
+}
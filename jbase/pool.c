@@ -0,0 +1,138 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// pool.c: object pools
+//
+// free slots form a stack threaded through the slots themselves (each free slot starts with the
+// index of the next). the head of the stack packs the index of the top slot with a tag that is
+// bumped on every change, so a compare-and-swap can't be fooled by a slot being popped and pushed
+// back in between (the ABA problem)
+//
+
+#include <assert.h>
+#include <jbase.h>
+#include <stdatomic.h>
+
+#define HEAD(idx, tag) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define HEAD_IDX(head) ((uint32_t)(head))
+#define HEAD_TAG(head) ((uint32_t)((head) >> 32))
+
+// link to next free slot, stored at the start of a free slot
+static _Atomic uint32_t *slot_next(jb_pool_t *pool, uint32_t idx) {
+    return (_Atomic uint32_t *)(pool->slots + (size_t)idx * pool->size);
+}
+
+jb_res_t jb_pool_init(jb_pool_t *pool, jb_arena_t *arena, size_t size, size_t cap) {
+    if (cap >= JB_NONE) return JB_ERR(JB_ERR_OOM, "pool capacity %zu too large", cap);
+
+    // slots are padded out to whole cache lines, so neighbouring objects never share one
+    pool->size = (JB_MAX(size, sizeof(uint32_t)) + JB_CACHE_LINE - 1) & ~(size_t)(JB_CACHE_LINE - 1);
+    pool->cap = cap;
+    pool->slots = jb_arena_alloc(arena, pool->size * cap, JB_CACHE_LINE);
+
+    if (!pool->slots && cap)
+        return JB_ERR(JB_ERR_OOM, "failed to allocate pool of %zu slots", cap);
+
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(slot_next(pool, i), i + 1 < cap ? (uint32_t)(i + 1) : JB_NONE);
+
+    atomic_init(&pool->head, HEAD(cap ? 0 : JB_NONE, 0));
+
+    return JB_OK_VAL;
+}
+
+void *jb_pool_alloc(jb_pool_t *pool) {
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_acquire);
+
+    for (;;) {
+        uint32_t idx = HEAD_IDX(head);
+        if (idx == JB_NONE) return NULL;
+
+        // if another thread takes this slot first, `next` may be stale, but the tag will have
+        // changed and the exchange will fail
+        uint32_t next = atomic_load_explicit(slot_next(pool, idx), memory_order_relaxed);
+
+        if (atomic_compare_exchange_weak_explicit(&pool->head,
+                                                  &head,
+                                                  HEAD(next, HEAD_TAG(head) + 1),
+                                                  memory_order_acquire,
+                                                  memory_order_acquire))
+            return jb_pool_at(pool, idx);
+    }
+}
+
+void jb_pool_free(jb_pool_t *pool, void *ptr) {
+    uint32_t idx = jb_pool_index(pool, ptr);
+    uint64_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+
+    for (;;) {
+        atomic_store_explicit(slot_next(pool, idx), HEAD_IDX(head), memory_order_relaxed);
+
+        if (atomic_compare_exchange_weak_explicit(&pool->head,
+                                                  &head,
+                                                  HEAD(idx, HEAD_TAG(head) + 1),
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+            return;
+    }
+}
+
+uint32_t jb_pool_index(jb_pool_t *pool, void *ptr) {
+    size_t off = (uint8_t *)ptr - pool->slots;
+    assert(off % pool->size == 0 && off / pool->size < pool->cap);
+
+    return off / pool->size;
+}
+
+void *jb_pool_at(jb_pool_t *pool, uint32_t idx) {
+    return pool->slots + (size_t)idx * pool->size;
+}
+
+void jb_pool_cache_init(jb_pool_cache_t *cache, jb_pool_t *pool) {
+    cache->pool = pool;
+    cache->len = 0;
+}
+
+void *jb_pool_cache_alloc(jb_pool_cache_t *cache) {
+    // refill half the cache at once, so alternating allocs and frees don't hit the shared list
+    while (cache->len < JB_POOL_CACHE / 2) {
+        void *ptr = jb_pool_alloc(cache->pool);
+        if (!ptr) break;
+
+        cache->free[cache->len++] = jb_pool_index(cache->pool, ptr);
+    }
+
+    if (cache->len == 0) return NULL;
+
+    return jb_pool_at(cache->pool, cache->free[--cache->len]);
+}
+
+void jb_pool_cache_free(jb_pool_cache_t *cache, void *ptr) {
+    // spill half the cache when full
+    if (cache->len == JB_POOL_CACHE)
+        while (cache->len > JB_POOL_CACHE / 2)
+            jb_pool_free(cache->pool, jb_pool_at(cache->pool, cache->free[--cache->len]));
+
+    cache->free[cache->len++] = jb_pool_index(cache->pool, ptr);
+}
+
+void jb_pool_cache_flush(jb_pool_cache_t *cache) {
+    while (cache->len > 0)
+        jb_pool_free(cache->pool, jb_pool_at(cache->pool, cache->free[--cache->len]));
+}
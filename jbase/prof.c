@@ -0,0 +1,225 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// prof.c: zone profiler
+//
+// each thread that records a zone claims a ring of its own, so that recording is a handful of
+// stores and one release, with no locks or syscalls. a background thread drains every ring a few
+// times a second into a Chrome trace (the JSON format Perfetto and chrome://tracing both load),
+// converting timestamps to μs with a ratio measured when profiling starts
+//
+
+#include <errno.h>
+#include <jbase.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef JB_PROFILE
+
+#define DUMP_USECS 50000      // time between dumps
+#define CALIBRATE_USECS 20000 // time spent measuring timestamp rate
+
+typedef struct {
+    const char *name;
+    uint32_t arg;
+    uint64_t start;
+    uint64_t end;
+} rec_t;
+
+// single producer (the owning thread), single consumer (the dump thread)
+typedef struct {
+    _Alignas(JB_CACHE_LINE) _Atomic uint64_t head; // records written
+    _Alignas(JB_CACHE_LINE) _Atomic uint64_t tail; // records dumped
+    uint64_t dropped;                              // records lost to a full ring (owner only)
+    uint32_t tid;
+    rec_t recs[JB_PROF_EVENTS];
+} ring_t;
+
+static ring_t rings[JB_PROF_THREADS];
+static _Atomic size_t n_rings;
+
+static _Thread_local ring_t *ring;
+static _Thread_local bool claimed;
+
+static _Atomic bool running;
+static pthread_t dump_thread;
+static FILE *out;
+static bool first;
+
+static uint64_t base;        // timestamp trace starts at
+static double ticks_per_us;
+
+void jb_prof_record(const char *name, uint32_t arg, uint64_t start, uint64_t end) {
+    if (!atomic_load_explicit(&running, memory_order_relaxed)) return;
+
+    if (!claimed) {
+        claimed = true;
+
+        size_t idx = atomic_fetch_add(&n_rings, 1);
+        if (idx >= JB_PROF_THREADS) return;
+
+        ring = &rings[idx];
+        ring->tid = syscall(SYS_gettid);
+    }
+
+    if (!ring) return;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == JB_PROF_EVENTS) {
+        ring->dropped++;
+        return;
+    }
+
+    ring->recs[head & (JB_PROF_EVENTS - 1)] = (rec_t){name, arg, start, end};
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static double ticks_us(uint64_t ticks) {
+    return (double)(int64_t)(ticks - base) / ticks_per_us;
+}
+
+// write out everything recorded so far
+static void dump(void) {
+    size_t len = JB_MIN(atomic_load(&n_rings), JB_PROF_THREADS);
+
+    for (size_t i = 0; i < len; i++) {
+        ring_t *r = &rings[i];
+        uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+        for (; tail < head; tail++) {
+            const rec_t *rec = &r->recs[tail & (JB_PROF_EVENTS - 1)];
+
+            fprintf(out,
+                    "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"args\":{\"arg\":%u}}",
+                    first ? "" : ",",
+                    rec->name,
+                    (int)getpid(),
+                    r->tid,
+                    ticks_us(rec->start),
+                    ticks_us(rec->end) - ticks_us(rec->start),
+                    rec->arg);
+            first = false;
+        }
+
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+
+    fflush(out);
+}
+
+static void *dump_main(void *arg) {
+    (void)arg;
+
+    while (atomic_load(&running)) {
+        usleep(DUMP_USECS);
+        dump();
+    }
+
+    return NULL;
+}
+
+// measure how many ticks pass per μs
+static double calibrate(void) {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    uint64_t start = jb_prof_ticks();
+
+    usleep(CALIBRATE_USECS);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t end = jb_prof_ticks();
+
+    double us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+    return (double)(end - start) / us;
+}
+
+jb_res_t jb_prof_start(const char *path) {
+    if (atomic_load(&running)) return JB_ERR(JB_ERR_USER, "profiler already running");
+
+    out = fopen(path, "w");
+    if (!out) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    // rings are touched from the audio thread, so they mustn't page fault
+    jb_res_t res = jb_mem_lock(rings, sizeof(rings));
+    if (res JB_IS_ERR) {
+        jb_warn("profiler memory not locked: %s", res.msg);
+        free(res.msg);
+    }
+
+    ticks_per_us = calibrate();
+    base = jb_prof_ticks();
+    first = true;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    atomic_store(&running, true);
+
+    int err = pthread_create(&dump_thread, NULL, dump_main, NULL);
+    if (err != 0) {
+        atomic_store(&running, false);
+        fclose(out);
+        return JB_ERR(JB_ERR_LIBC, "failed to start profiler thread: %s", strerror(err));
+    }
+
+    jb_info("writing zone trace to '%s' (%.0f ticks/μs)", path, ticks_per_us);
+
+    return JB_OK_VAL;
+}
+
+void jb_prof_stop(void) {
+    if (!atomic_load(&running)) return;
+
+    atomic_store(&running, false);
+    pthread_join(dump_thread, NULL);
+
+    dump();
+    fprintf(out, "\n]}\n");
+    fclose(out);
+
+    size_t len = JB_MIN(atomic_load(&n_rings), JB_PROF_THREADS);
+    uint64_t dropped = 0;
+    for (size_t i = 0; i < len; i++) dropped += rings[i].dropped;
+
+    if (dropped) jb_warn("%llu zones dropped (rings full)", (unsigned long long)dropped);
+    if (atomic_load(&n_rings) > JB_PROF_THREADS)
+        jb_warn("zones from more than %d threads were dropped", JB_PROF_THREADS);
+}
+
+#else
+
+// zones compile to nothing without JB_PROFILE, so there's never anything to record
+void jb_prof_record(const char *name, uint32_t arg, uint64_t start, uint64_t end) {
+    (void)name, (void)arg, (void)start, (void)end;
+}
+
+jb_res_t jb_prof_start(const char *path) {
+    (void)path;
+    return JB_ERR(JB_ERR_USER, "built without zone profiling (rebuild with `make PROFILE=1`)");
+}
+
+void jb_prof_stop(void) {
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// rack.c: engine rack
+//
+// hosts several engines on one client. a cycle's events come from every MIDI input merged, so
+// they're grouped back up by input, then each engine is played through the outputs of its part
+//
+
+#include <jbase.h>
+#include <stdatomic.h>
+
+void jb_rack_init(jb_rack_t *rack) {
+    rack->len = 0;
+    rack->metrics = NULL;
+}
+
+jb_res_t jb_rack_add(jb_rack_t *rack, jb_engine_t *eng) {
+    if (rack->len == JB_RACK_PARTS)
+        return JB_ERR(JB_ERR_USER, "at most %d engines can share a rack", JB_RACK_PARTS);
+
+    for (size_t c = JB_PORT_CHANS; c < JB_CHANS; c++)
+        if (eng->patch->chans[c].len > 0)
+            return JB_ERR(JB_ERR_USER,
+                          "engine %zu uses channel %zu.%zu, but only has one MIDI input",
+                          rack->len,
+                          c / JB_PORT_CHANS,
+                          c % JB_PORT_CHANS);
+
+    eng->in_rack = true;
+    rack->engs[rack->len++] = eng;
+
+    return JB_OK_VAL;
+}
+
+void jb_rack_midi_batch(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len) {
+    jb_rack_t *rack = (jb_rack_t *)state;
+
+    // counting sort by input, which keeps each engine's events in frame order
+    size_t start[JB_RACK_PARTS + 1] = {0};
+
+    for (size_t i = 0; i < len; i++) {
+        size_t part = evs[i].chan / JB_PORT_CHANS;
+        if (part < rack->len) start[part + 1]++;
+    }
+
+    for (size_t p = 0; p < rack->len; p++) start[p + 1] += start[p];
+
+    size_t next[JB_RACK_PARTS];
+    for (size_t p = 0; p < rack->len; p++) next[p] = start[p];
+
+    for (size_t i = 0; i < len; i++) {
+        size_t part = evs[i].chan / JB_PORT_CHANS;
+        if (part >= rack->len) continue;
+
+        jb_midi_t ev = evs[i];
+        ev.chan %= JB_PORT_CHANS;
+
+        rack->events[next[part]++] = ev;
+    }
+
+    // engines keep hold of their events until the audio callback, when playing them accurately
+    for (size_t p = 0; p < rack->len; p++)
+        jb_engine_midi_batch(rack->engs[p], ctx, rack->events + start[p], start[p + 1] - start[p]);
+}
+
+void jb_rack_audio(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs) {
+    jb_rack_t *rack = (jb_rack_t *)state;
+    size_t voices = 0;
+
+    for (size_t p = 0; p < rack->len; p++) {
+        jb_engine_audio(rack->engs[p], ctx, nframes, bufs + p * JB_OUTS);
+        voices += rack->engs[p]->voices;
+    }
+
+    if (rack->metrics) atomic_store_explicit(&rack->metrics->voices, voices, memory_order_relaxed);
+}
+
+void jb_rack_prepare(void *state, jb_ctx_t ctx, size_t nframes) {
+    jb_rack_t *rack = (jb_rack_t *)state;
+
+    for (size_t p = 0; p < rack->len; p++) jb_engine_prepare(rack->engs[p], ctx, nframes);
+}
+
+void jb_rack_freewheel(void *state, bool on) {
+    jb_rack_t *rack = (jb_rack_t *)state;
+
+    for (size_t p = 0; p < rack->len; p++) jb_engine_freewheel(rack->engs[p], on);
+}
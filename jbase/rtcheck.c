@@ -0,0 +1,368 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// rtcheck.c: realtime safety audit
+//
+// defines its own malloc, pthread_mutex_lock, write, ... in the executable, where they take
+// precedence over libc's (and those of any library loaded alongside it). each checks whether the
+// calling thread is marked realtime before handing over to the real function, found with
+// dlsym(RTLD_NEXT). allocators hand over to glibc's __libc_* entry points instead, as dlsym() may
+// itself allocate. only calls that cross into libc are seen; libc's calls to itself aren't, which
+// is why stdio is interposed at its entry points rather than at write()
+//
+
+#define _GNU_SOURCE
+
+#include <jbase.h>
+
+#ifdef JB_RTCHECK
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BACKTRACE_DEPTH 32
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static _Thread_local unsigned depth;   // jb_rt_enter()s not yet left
+static _Thread_local bool reporting;  // whether the thread is reporting (and so exempt)
+
+static _Atomic(void *) sites[JB_RT_SITES]; // call sites reported, as an open-addressed set
+static _Atomic size_t n_sites;
+
+void jb_rt_enter(void) {
+    depth++;
+}
+
+void jb_rt_leave(void) {
+    depth--;
+}
+
+size_t jb_rt_violations(void) {
+    return atomic_load(&n_sites);
+}
+
+// add a call site to the set, returning whether it was new. a full set reports everything
+static bool site_claim(void *site) {
+    size_t start = ((uintptr_t)site >> 2) % JB_RT_SITES;
+
+    for (size_t i = 0; i < JB_RT_SITES; i++) {
+        _Atomic(void *) *slot = &sites[(start + i) % JB_RT_SITES];
+        void *cur = NULL;
+
+        if (atomic_compare_exchange_strong(slot, &cur, site)) {
+            atomic_fetch_add(&n_sites, 1);
+            return true;
+        }
+
+        if (cur == site) return false;
+    }
+
+    return true;
+}
+
+static ssize_t (*real_write)(int, const void *, size_t);
+
+// write straight to stderr, with write() itself exempt
+static void rt_write(const char *buf, int len) {
+    if (real_write && len > 0) real_write(STDERR_FILENO, buf, len);
+}
+
+// report a call to `name` from `site`, if the thread is realtime and the site hasn't been seen
+static void rt_check(const char *name, void *site) {
+    if (depth == 0 || reporting) return;
+
+    // everything from here on may call back in; none of it is checked
+    reporting = true;
+
+    if (site_claim(site)) {
+        void *frames[BACKTRACE_DEPTH];
+        int len = backtrace(frames, BACKTRACE_DEPTH);
+
+        // the interposed call may have been made from inside libc with one of its locks held (a
+        // malloc() from localtime(), say), so the report can't go through the logger or stdio
+        char msg[128];
+        int n = snprintf(msg, sizeof(msg), "rtcheck: %s() called on a realtime thread:\n", name);
+        rt_write(msg, n);
+
+        // skip the interposer itself
+        backtrace_symbols_fd(frames + 1, len - 1, STDERR_FILENO);
+    }
+
+    reporting = false;
+}
+
+#define SITE __builtin_return_address(0)
+
+// look up the next definition of `fn` once, as `real`. dlsym() allocates with the loader locked,
+// so it mustn't be reported on (backtrace() may need the loader too)
+#define REAL(fn)                                                    \
+    static __typeof__(fn) *real;                                    \
+    if (!real) {                                                    \
+        bool was = reporting;                                       \
+        reporting = true;                                           \
+        real = (__typeof__(fn) *)dlsym(RTLD_NEXT, #fn);             \
+        reporting = was;                                            \
+    }
+
+// backtrace() loads the unwinder the first time it's called, so call it once before any thread is
+// marked realtime
+__attribute__((constructor)) static void rt_init(void) {
+    void *frame;
+    backtrace(&frame, 1);
+
+    real_write = (__typeof__(real_write))dlsym(RTLD_NEXT, "write");
+}
+
+//
+// allocation
+//
+
+void *malloc(size_t size) {
+    rt_check("malloc", SITE);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    rt_check("calloc", SITE);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    rt_check("realloc", SITE);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (ptr) rt_check("free", SITE);
+    __libc_free(ptr);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+    rt_check("aligned_alloc", SITE);
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+    rt_check("posix_memalign", SITE);
+
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0) return EINVAL;
+
+    void *ptr = __libc_memalign(align, size);
+    if (!ptr) return ENOMEM;
+
+    *out = ptr;
+    return 0;
+}
+
+//
+// locks
+//
+
+int pthread_mutex_lock(pthread_mutex_t *mutex) {
+    REAL(pthread_mutex_lock);
+    rt_check("pthread_mutex_lock", SITE);
+    return real(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    REAL(pthread_cond_wait);
+    rt_check("pthread_cond_wait", SITE);
+    return real(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                           const struct timespec *abstime) {
+    REAL(pthread_cond_timedwait);
+    rt_check("pthread_cond_timedwait", SITE);
+    return real(cond, mutex, abstime);
+}
+
+int sem_wait(sem_t *sem) {
+    REAL(sem_wait);
+    rt_check("sem_wait", SITE);
+    return real(sem);
+}
+
+//
+// system calls
+//
+
+ssize_t read(int fd, void *buf, size_t len) {
+    REAL(read);
+    rt_check("read", SITE);
+    return real(fd, buf, len);
+}
+
+ssize_t write(int fd, const void *buf, size_t len) {
+    REAL(write);
+    rt_check("write", SITE);
+    return real(fd, buf, len);
+}
+
+int poll(struct pollfd *fds, nfds_t n, int timeout) {
+    REAL(poll);
+    rt_check("poll", SITE);
+    return real(fds, n, timeout);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+    REAL(nanosleep);
+    rt_check("nanosleep", SITE);
+    return real(req, rem);
+}
+
+int usleep(useconds_t usecs) {
+    REAL(usleep);
+    rt_check("usleep", SITE);
+    return real(usecs);
+}
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off) {
+    REAL(mmap);
+    rt_check("mmap", SITE);
+    return real(addr, len, prot, flags, fd, off);
+}
+
+int munmap(void *addr, size_t len) {
+    REAL(munmap);
+    rt_check("munmap", SITE);
+    return real(addr, len);
+}
+
+int mprotect(void *addr, size_t len, int prot) {
+    REAL(mprotect);
+    rt_check("mprotect", SITE);
+    return real(addr, len, prot);
+}
+
+//
+// stdio (which locks the stream, may allocate a buffer, and writes when it flushes)
+//
+
+int vfprintf(FILE *f, const char *fmt, va_list args) {
+    REAL(vfprintf);
+    rt_check("vfprintf", SITE);
+    return real(f, fmt, args);
+}
+
+int fprintf(FILE *f, const char *fmt, ...) {
+    REAL(vfprintf);
+    rt_check("fprintf", SITE);
+
+    va_list args;
+    va_start(args, fmt);
+    int n = real(f, fmt, args);
+    va_end(args);
+
+    return n;
+}
+
+int vprintf(const char *fmt, va_list args) {
+    REAL(vprintf);
+    rt_check("vprintf", SITE);
+    return real(fmt, args);
+}
+
+int printf(const char *fmt, ...) {
+    REAL(vprintf);
+    rt_check("printf", SITE);
+
+    va_list args;
+    va_start(args, fmt);
+    int n = real(fmt, args);
+    va_end(args);
+
+    return n;
+}
+
+int puts(const char *str) {
+    REAL(puts);
+    rt_check("puts", SITE);
+    return real(str);
+}
+
+int fputs(const char *str, FILE *f) {
+    REAL(fputs);
+    rt_check("fputs", SITE);
+    return real(str, f);
+}
+
+size_t fwrite(const void *buf, size_t size, size_t n, FILE *f) {
+    REAL(fwrite);
+    rt_check("fwrite", SITE);
+    return real(buf, size, n, f);
+}
+
+int fflush(FILE *f) {
+    REAL(fflush);
+    rt_check("fflush", SITE);
+    return real(f);
+}
+
+//
+// libc calls that take a lock internally
+//
+
+struct tm *localtime(const time_t *t) {
+    REAL(localtime);
+    rt_check("localtime", SITE);
+    return real(t);
+}
+
+struct tm *localtime_r(const time_t *t, struct tm *out) {
+    REAL(localtime_r);
+    rt_check("localtime_r", SITE);
+    return real(t, out);
+}
+
+int rand(void) {
+    REAL(rand);
+    rt_check("rand", SITE);
+    return real();
+}
+
+#else
+
+// nothing is interposed without JB_RTCHECK, so there's never anything to report
+void jb_rt_enter(void) {
+}
+
+void jb_rt_leave(void) {
+}
+
+size_t jb_rt_violations(void) {
+    return 0;
+}
+
+#endif
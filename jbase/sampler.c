@@ -0,0 +1,452 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// sampler.c: sample streaming
+//
+// plays WAV files too large to keep in memory for every instance. files are mapped read-only, and
+// only their attacks are copied out (into the engine's locked arena); a voice plays its attack
+// straight away, while a background thread copies the rest of the file into the voice's ring ahead
+// of it. the audio thread only reads resident memory, and hands streams to and from the I/O thread
+// through each stream's state, so neither ever waits on the other
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jbase.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ATTACK_USECS 250000 // length of each file kept resident
+#define MAX_RATE 4.f        // fastest a stream plays (two octaves above its root)
+#define CHUNK_FRAMES 4096   // most frames copied into a ring at once
+#define MIN_RING 4096       // fewest frames in a ring
+#define IO_POLL_USECS 1000  // time the I/O thread sleeps when every ring is full
+#define DRY_POLL_USECS 100  // time a freewheeling stream sleeps while waiting for the I/O thread
+#define DRY_TIMEOUT_USECS 1000000 // longest a freewheeling stream waits before running dry
+
+// WAV format tags
+#define WAV_PCM 1
+#define WAV_FLOAT 3
+#define WAV_EXTENSIBLE 0xfffe // real tag is in the first bytes of the subformat
+
+static uint16_t rd16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t rd32(const uint8_t *p) {
+    return rd16(p) | (uint32_t)rd16(p + 2) << 16;
+}
+
+// find the format and sample data of a mapped WAV file
+static jb_res_t wav_parse(jb_wav_t *w) {
+    const uint8_t *buf = w->map;
+    size_t len = w->map_len;
+
+    if (len < 12 || memcmp(buf, "RIFF", 4) != 0 || memcmp(buf + 8, "WAVE", 4) != 0)
+        return JB_ERR(JB_ERR_USER, "'%s' isn't a WAV file", w->path);
+
+    uint16_t format = 0, bits = 0;
+    bool have_fmt = false;
+
+    for (size_t pos = 12; pos + 8 <= len;) {
+        const uint8_t *chunk = buf + pos;
+        size_t body = pos + 8;
+        // a truncated last chunk is used as far as it goes
+        size_t size = JB_MIN((size_t)rd32(chunk + 4), len - body);
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+            format = rd16(buf + body);
+            w->chans = rd16(buf + body + 2);
+            w->srate = rd32(buf + body + 4);
+            bits = rd16(buf + body + 14);
+
+            if (format == WAV_EXTENSIBLE && size >= 26) format = rd16(buf + body + 24);
+            have_fmt = true;
+        } else if (memcmp(chunk, "data", 4) == 0 && have_fmt) {
+            bool is_int = format == WAV_PCM && (bits == 16 || bits == 24 || bits == 32);
+            bool is_float = format == WAV_FLOAT && bits == 32;
+
+            if (!is_int && !is_float)
+                return JB_ERR(JB_ERR_USER,
+                              "'%s' has unsupported format %u (%u bits); expected 16, 24 or 32 bit "
+                              "PCM, or 32 bit float",
+                              w->path,
+                              format,
+                              bits);
+
+            if (w->chans == 0 || w->srate <= 0)
+                return JB_ERR(JB_ERR_USER, "'%s' has a malformed format", w->path);
+
+            w->data = buf + body;
+            w->bytes = bits / 8;
+            w->is_float = is_float;
+            w->frames = size / (w->chans * w->bytes);
+
+            return JB_OK_VAL;
+        }
+
+        // chunks are padded to an even length
+        pos = body + size + (size & 1);
+    }
+
+    return JB_ERR(JB_ERR_USER, "'%s' has no sample data", w->path);
+}
+
+// a frame of a file, mixed down to mono
+static float wav_frame(const jb_wav_t *w, size_t frame) {
+    const uint8_t *p = w->data + frame * w->chans * w->bytes;
+    float sum = 0.0;
+
+    for (size_t c = 0; c < w->chans; c++, p += w->bytes) {
+        switch (w->bytes) {
+            case 2:
+                sum += (int16_t)rd16(p) / 32768.f;
+                break;
+            case 3:
+                // shift into the top of an int32, so the sign comes along
+                sum += (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) /
+                       2147483648.f;
+                break;
+            default:
+                if (w->is_float) {
+                    float f;
+                    memcpy(&f, p, sizeof(f));
+                    sum += f;
+                } else {
+                    sum += (int32_t)rd32(p) / 2147483648.f;
+                }
+        }
+    }
+
+    return sum / w->chans;
+}
+
+// copy frames of a file as mono floats, keeping track of the slowest copy; frames not yet in the
+// page cache are read from disk as they're touched, so this is how long a read can take
+static void wav_copy(jb_sampler_t *smp, const jb_wav_t *w, size_t first, float *out, size_t len) {
+    if (len == 0) return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t i = 0; i < len; i++) out[i] = wav_frame(w, first + i);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+    if (ns > atomic_load_explicit(&smp->latency_ns, memory_order_relaxed))
+        atomic_store_explicit(&smp->latency_ns, ns, memory_order_relaxed);
+}
+
+// ask the kernel to start reading frames in, ahead of them being copied
+static void wav_prefetch(const jb_wav_t *w, size_t first, size_t len) {
+    size_t frame = w->chans * w->bytes;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    uintptr_t start = (uintptr_t)(w->data + first * frame) & ~(uintptr_t)(page - 1);
+    uintptr_t end = (uintptr_t)JB_MIN(w->data + (first + len) * frame,
+                                      (const uint8_t *)w->map + w->map_len);
+
+    if (end > start) madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+static jb_res_t wav_open(jb_sampler_t *smp, jb_wav_t *w, const char *path, jb_arena_t *arena) {
+    w->path = path;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return JB_ERR(JB_ERR_LIBC, "failed to stat '%s': %s", path, strerror(errno));
+    }
+
+    w->map_len = st.st_size;
+    w->map = w->map_len ? mmap(NULL, w->map_len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (w->map == MAP_FAILED) {
+        w->map = NULL;
+        return JB_ERR(JB_ERR_LIBC, "failed to map '%s': %s", path, strerror(errno));
+    }
+
+    // beyond the attack, files are read front to back
+    madvise(w->map, w->map_len, MADV_SEQUENTIAL);
+
+    JB_TRY(wav_parse(w));
+
+    w->n_attack = JB_MIN(w->frames, (size_t)(w->srate * ATTACK_USECS / 1000000));
+    w->attack = JB_ARENA_NEW(arena, float, w->n_attack);
+    if (!w->attack && w->n_attack) return JB_ERR(JB_ERR_OOM, "failed to allocate attack of '%s'", path);
+
+    for (size_t i = 0; i < w->n_attack; i += CHUNK_FRAMES)
+        wav_copy(smp, w, i, w->attack + i, JB_MIN(CHUNK_FRAMES, w->n_attack - i));
+
+    jb_debug("mapped '%s' (%zu frames, %u channels, %.0f Hz; %zu resident)",
+             path,
+             w->frames,
+             w->chans,
+             w->srate,
+             w->n_attack);
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_sampler_init(jb_sampler_t *smp, const jb_patch_t *pt, jb_arena_t *arena) {
+    memset(smp, 0, sizeof(*smp));
+
+    bool any = false;
+    for (size_t i = 0; i < pt->n_oscs; i++) any |= pt->oscs[i].sample != JB_NONE;
+
+    if (!any) return JB_OK_VAL;
+
+    smp->osc_wav = JB_ARENA_NEW(arena, uint32_t, pt->n_oscs);
+    smp->wavs = JB_ARENA_NEW(arena, jb_wav_t, pt->n_oscs);
+    if (!smp->osc_wav || !smp->wavs) return JB_ERR(JB_ERR_OOM, "failed to allocate sampler");
+
+    for (size_t i = 0; i < pt->n_oscs; i++) {
+        smp->osc_wav[i] = JB_NONE;
+        if (pt->oscs[i].sample == JB_NONE) continue;
+
+        const char *path = pt->strs + pt->oscs[i].sample;
+
+        // a file played by several oscillators is only mapped once
+        for (size_t j = 0; j < smp->n_wavs && smp->osc_wav[i] == JB_NONE; j++)
+            if (strcmp(smp->wavs[j].path, path) == 0) smp->osc_wav[i] = j;
+
+        if (smp->osc_wav[i] != JB_NONE) continue;
+
+        smp->osc_wav[i] = smp->n_wavs;
+
+        jb_res_t res = wav_open(smp, &smp->wavs[smp->n_wavs++], path, arena);
+        if (res JB_IS_ERR) {
+            jb_sampler_free(smp);
+            return res;
+        }
+    }
+
+    return JB_OK_VAL;
+}
+
+void jb_sampler_free(jb_sampler_t *smp) {
+    if (smp->running) {
+        atomic_store(&smp->quit, true);
+        pthread_join(smp->thread, NULL);
+        smp->running = false;
+    }
+
+    for (size_t i = 0; i < smp->n_wavs; i++)
+        if (smp->wavs[i].map) munmap(smp->wavs[i].map, smp->wavs[i].map_len);
+
+    smp->n_wavs = 0;
+}
+
+// move a stream along its states on the I/O thread's side, and copy the next chunk of its file
+// into its ring, returning whether anything was copied
+static bool stream_fill(jb_sampler_t *smp, jb_stream_t *s) {
+    int state = atomic_load_explicit(&s->state, memory_order_acquire);
+
+    if (state == JB_STREAM_STOP) {
+        atomic_store_explicit(&s->state, JB_STREAM_FREE, memory_order_release);
+        return false;
+    }
+
+    // the audio thread may stop the stream before it's picked up
+    if (state == JB_STREAM_START &&
+        !atomic_compare_exchange_strong(&s->state, &state, JB_STREAM_RUNNING))
+        return false;
+
+    if (state != JB_STREAM_START && state != JB_STREAM_RUNNING) return false;
+
+    const jb_wav_t *w = &smp->wavs[s->wav];
+    uint64_t written = atomic_load_explicit(&s->written, memory_order_relaxed);
+    uint64_t done = atomic_load_explicit(&s->done, memory_order_acquire);
+
+    size_t left = w->frames - w->n_attack - written;
+    size_t space = smp->ring_len - (written - done);
+    size_t len = JB_MIN(JB_MIN(left, space), CHUNK_FRAMES);
+
+    if (len == 0) return false;
+
+    // the chunk may wrap around the end of the ring
+    size_t first = written & (smp->ring_len - 1);
+    size_t run = JB_MIN(len, smp->ring_len - first);
+    size_t frame = w->n_attack + written;
+
+    wav_copy(smp, w, frame, s->ring + first, run);
+    wav_copy(smp, w, frame + run, s->ring, len - run);
+
+    atomic_store_explicit(&s->written, written + len, memory_order_release);
+
+    wav_prefetch(w, frame + len, CHUNK_FRAMES);
+
+    return true;
+}
+
+static void *io_main(void *arg) {
+    jb_sampler_t *smp = arg;
+
+    while (!atomic_load(&smp->quit)) {
+        bool busy = false;
+        for (size_t i = 0; i < JB_STREAMS; i++) busy |= stream_fill(smp, &smp->streams[i]);
+
+        if (!busy) usleep(IO_POLL_USECS);
+    }
+
+    return NULL;
+}
+
+void jb_sampler_prepare(jb_sampler_t *smp, jb_arena_t *arena, size_t nframes, size_t srate) {
+    if (smp->n_wavs == 0 || smp->ring_len) return;
+
+    // a ring has to last a cycle, the I/O thread's sleep and the slowest read seen, at the fastest
+    // rate; twice that, so that one half can be filled while the other is played
+    uint64_t latency_ns = atomic_load(&smp->latency_ns);
+    double usecs = (double)nframes * 1e6 / srate + IO_POLL_USECS + latency_ns / 1e3;
+    size_t need = 2 * MAX_RATE * usecs * srate / 1e6;
+
+    size_t len = MIN_RING;
+    while (len < need) len *= 2;
+
+    for (size_t i = 0; i < JB_STREAMS; i++) {
+        smp->streams[i].ring = JB_ARENA_NEW(arena, float, len);
+
+        if (!smp->streams[i].ring) {
+            jb_warn("failed to allocate sample streams; sampler instruments will be silent");
+            return;
+        }
+    }
+
+    smp->ring_len = len;
+
+    int err = pthread_create(&smp->thread, NULL, io_main, smp);
+    if (err != 0) {
+        jb_warn("failed to start sample streaming: %s", strerror(err));
+        return;
+    }
+
+    smp->running = true;
+
+    jb_debug("streaming %zu sample file(s) through %zu frame rings (slowest read %.2fms)",
+             smp->n_wavs,
+             len,
+             latency_ns / 1e6);
+}
+
+uint32_t jb_stream_start(jb_sampler_t *smp, uint32_t wav, float rate) {
+    if (!smp->running) return JB_NONE;
+
+    for (uint32_t i = 0; i < JB_STREAMS; i++) {
+        jb_stream_t *s = &smp->streams[i];
+
+        // only the audio thread takes streams out of JB_STREAM_FREE
+        if (atomic_load_explicit(&s->state, memory_order_acquire) != JB_STREAM_FREE) continue;
+
+        s->wav = wav;
+        s->pos = 0;
+        s->frac = 0.0;
+        s->rate = JB_MIN(rate, MAX_RATE);
+        atomic_store_explicit(&s->written, 0, memory_order_relaxed);
+        atomic_store_explicit(&s->done, 0, memory_order_relaxed);
+
+        atomic_store_explicit(&s->state, JB_STREAM_START, memory_order_release);
+
+        return i;
+    }
+
+    return JB_NONE;
+}
+
+void jb_stream_stop(jb_sampler_t *smp, uint32_t idx) {
+    jb_stream_t *s = &smp->streams[idx];
+    int state = atomic_load(&s->state);
+
+    // the I/O thread may be moving the stream from JB_STREAM_START to JB_STREAM_RUNNING
+    while ((state == JB_STREAM_START || state == JB_STREAM_RUNNING) &&
+           !atomic_compare_exchange_weak(&s->state, &state, JB_STREAM_STOP))
+        ;
+}
+
+void jb_stream_rate(jb_sampler_t *smp, uint32_t idx, float rate) {
+    smp->streams[idx].rate = JB_MIN(rate, MAX_RATE);
+}
+
+// wait for the I/O thread to write past a stream's current frame, returning how far is available.
+// only done while freewheeling, when the audio thread has no deadline to miss
+static uint64_t stream_wait(jb_stream_t *s, const jb_wav_t *w) {
+    // let go of everything before the current frame, so that the ring has room
+    if (s->pos > w->n_attack)
+        atomic_store_explicit(&s->done, s->pos - w->n_attack, memory_order_release);
+
+    for (long waited = 0;; waited += DRY_POLL_USECS) {
+        uint64_t avail = w->n_attack + atomic_load_explicit(&s->written, memory_order_acquire);
+        if (s->pos + 1 < avail || waited >= DRY_TIMEOUT_USECS) return avail;
+
+        usleep(DRY_POLL_USECS);
+    }
+}
+
+bool jb_stream_read(jb_sampler_t *smp, uint32_t idx, float *out, size_t len, bool *underrun) {
+    jb_stream_t *s = &smp->streams[idx];
+    const jb_wav_t *w = &smp->wavs[s->wav];
+
+    // frames up to here are resident, or in the ring
+    uint64_t avail = w->n_attack + atomic_load_explicit(&s->written, memory_order_acquire);
+    size_t mask = smp->ring_len - 1;
+
+    for (size_t i = 0; i < len; i++) {
+        if (s->pos + 1 >= w->frames) {
+            memset(out + i, 0, (len - i) * sizeof(*out));
+            return false;
+        }
+
+        if (s->pos + 1 >= avail && smp->freewheel) avail = stream_wait(s, w);
+
+        // a stream that runs dry waits where it is, rather than skipping what it missed
+        if (s->pos + 1 >= avail) {
+            *underrun = true;
+            out[i] = 0.0;
+            continue;
+        }
+
+        uint64_t pos = s->pos;
+        float a = pos < w->n_attack ? w->attack[pos] : s->ring[(pos - w->n_attack) & mask];
+        pos++;
+        float b = pos < w->n_attack ? w->attack[pos] : s->ring[(pos - w->n_attack) & mask];
+
+        out[i] = a + (b - a) * s->frac;
+
+        s->frac += s->rate;
+        uint64_t step = (uint64_t)s->frac;
+        s->pos += step;
+        s->frac -= step;
+    }
+
+    // everything before the current frame can be overwritten (a fast stream may have stepped past
+    // what's been written)
+    uint64_t done = JB_MIN(s->pos, avail);
+    if (done > w->n_attack)
+        atomic_store_explicit(&s->done, done - w->n_attack, memory_order_release);
+
+    return true;
+}
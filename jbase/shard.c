@@ -0,0 +1,478 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// shard.c: engines in worker processes, behind a front end
+//
+// the front end is an ordinary client whose callbacks hand each cycle to the workers attached to
+// it, through a POSIX shared memory object. each worker has a slot with a ring of events and an
+// output buffer; the front end queues the events on the worker's channels, wakes it, and waits
+// for it until the cycle's deadline, then sums whichever outputs are ready. workers run their own
+// engine on a thread of their own, so a crash or overload in one leaves the others playing, and
+// they spread across however many cores the scheduler likes
+//
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <jbase.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARD_VERSION 1
+
+// time given to workers while freewheeling, so that a dead one can't hold a bounce up for good
+#define FREEWHEEL_TIMEOUT_NS 1000000000
+
+// shared memory object names need a leading '/'
+static void shard_name(char *out, size_t len, const char *name) {
+    snprintf(out, len, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+jb_res_t jb_front_create(jb_front_t *f, const char *name, uint64_t timeout, int priority) {
+    memset(f, 0, sizeof(*f));
+    shard_name(f->name, sizeof(f->name), name);
+
+    // workers of an old front end keep their mapping until they stop, rather than seeing it
+    // truncated underneath them
+    shm_unlink(f->name);
+
+    int fd = shm_open(f->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return JB_ERR(JB_ERR_LIBC, "failed to create '%s': %s", f->name, strerror(errno));
+
+    if (ftruncate(fd, sizeof(jb_shard_shm_t)) != 0) {
+        jb_res_t res = JB_ERR(JB_ERR_LIBC, "failed to size '%s': %s", f->name, strerror(errno));
+        close(fd);
+        shm_unlink(f->name);
+        return res;
+    }
+
+    void *shm = mmap(NULL, sizeof(jb_shard_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED) {
+        shm_unlink(f->name);
+        return JB_ERR(JB_ERR_LIBC, "failed to map '%s': %s", f->name, strerror(errno));
+    }
+
+    f->shm = shm;
+    f->timeout_ns = timeout * 1000;
+
+    // the object comes zeroed, so every shard starts out free
+    for (size_t s = 0; s < JB_SHARDS; s++) {
+        sem_init(&f->shm->shards[s].go, 1, 0);
+        sem_init(&f->shm->shards[s].ready, 1, 0);
+    }
+
+    f->shm->version = SHARD_VERSION;
+    f->shm->priority = JB_MAX(priority, 0);
+
+    // the front end waits on workers rendering into this; failing to lock isn't fatal, just slower
+    jb_res_t res = jb_mem_lock(f->shm, sizeof(*f->shm));
+    if (res JB_IS_ERR) {
+        jb_warn("shard memory not locked: %s", res.msg);
+        free(res.msg);
+    }
+
+    jb_debug("taking workers at '%s' (%zu KiB)", f->name, sizeof(*f->shm) / 1024);
+
+    return JB_OK_VAL;
+}
+
+void jb_front_close(jb_front_t *f) {
+    if (!f->shm) return;
+
+    // semaphores are left as they are, as workers may still be waiting on them
+    munmap(f->shm, sizeof(*f->shm));
+    shm_unlink(f->name);
+    f->shm = NULL;
+}
+
+void jb_front_prepare(void *state, jb_ctx_t ctx, size_t nframes) {
+    jb_front_t *f = (jb_front_t *)state;
+
+    f->shm->srate = ctx.srate;
+    f->shm->nframes = nframes;
+
+    // workers check the magic before anything else, so it goes in last
+    atomic_thread_fence(memory_order_release);
+    memcpy(f->shm->magic, JB_SHARD_MAGIC, sizeof(f->shm->magic));
+}
+
+void jb_front_freewheel(void *state, bool on) {
+    jb_front_t *f = (jb_front_t *)state;
+
+    f->freewheel = on;
+}
+
+void jb_front_midi_batch(void *state, jb_ctx_t ctx, const jb_midi_t *evs, size_t len) {
+    (void)ctx;
+
+    jb_front_t *f = (jb_front_t *)state;
+    size_t dropped = 0;
+
+    for (size_t s = 0; s < JB_SHARDS; s++) {
+        jb_shard_t *sh = &f->shm->shards[s];
+        uint32_t head = atomic_load_explicit(&sh->head, memory_order_relaxed);
+
+        f->first[s] = head;
+
+        if (atomic_load_explicit(&sh->state, memory_order_acquire) != JB_SHARD_ATTACHED) continue;
+
+        uint32_t tail = atomic_load_explicit(&sh->tail, memory_order_acquire);
+
+        // a worker that's fallen behind finds its events still queued once it catches up
+        for (size_t i = 0; i < len; i++) {
+            if (!sh->chans[evs[i].chan]) continue;
+
+            if (head - tail == JB_SHARD_EVENTS) {
+                dropped++;
+                continue;
+            }
+
+            sh->ring[head++ % JB_SHARD_EVENTS] = evs[i];
+        }
+
+        atomic_store_explicit(&sh->head, head, memory_order_release);
+    }
+
+    if (dropped && f->metrics)
+        atomic_fetch_add_explicit(&f->metrics->midi_drops, dropped, memory_order_relaxed);
+}
+
+// wait for a shard to finish the cycle it was posted, returning whether it did by the deadline
+static bool shard_wait(jb_shard_t *sh, uint64_t cycle, const struct timespec *deadline) {
+    // `ready` may still hold posts from cycles that were given up on, so the cycle's checked too
+    while (atomic_load_explicit(&sh->done, memory_order_acquire) != cycle)
+        if (sem_clockwait(&sh->ready, CLOCK_MONOTONIC, deadline) != 0 && errno == ETIMEDOUT)
+            return atomic_load_explicit(&sh->done, memory_order_acquire) == cycle;
+
+    return true;
+}
+
+void jb_front_audio(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t **bufs) {
+    JB_ZONE("shards");
+
+    jb_front_t *f = (jb_front_t *)state;
+    size_t misses = 0;
+
+    for (size_t o = 0; o < JB_OUTS; o++) memset(bufs[o], 0, nframes * sizeof(*bufs[o]));
+
+    if (nframes > JB_SHARD_FRAMES) return;
+
+    uint64_t timeout = f->timeout_ns ? f->timeout_ns : nframes * 750000000ull / ctx.srate;
+    if (f->freewheel) timeout = FREEWHEEL_TIMEOUT_NS;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (deadline.tv_nsec + timeout) / 1000000000;
+    deadline.tv_nsec = (deadline.tv_nsec + timeout) % 1000000000;
+
+    // post every worker the cycle first, so that they all render at once
+    for (size_t s = 0; s < JB_SHARDS; s++) {
+        jb_shard_t *sh = &f->shm->shards[s];
+        f->posted[s] = false;
+
+        if (atomic_load_explicit(&sh->state, memory_order_acquire) != JB_SHARD_ATTACHED) continue;
+
+        // still busy with an earlier cycle (or dead); it's left to catch up rather than waited on
+        uint64_t cycle = atomic_load_explicit(&sh->cycle, memory_order_relaxed);
+        if (atomic_load_explicit(&sh->done, memory_order_acquire) != cycle) {
+            misses++;
+            continue;
+        }
+
+        sh->ctx = ctx;
+        sh->nframes = nframes;
+        sh->first = f->first[s];
+        sh->last = atomic_load_explicit(&sh->head, memory_order_relaxed);
+        sh->freewheel = f->freewheel;
+
+        atomic_store_explicit(&sh->cycle, cycle + 1, memory_order_release);
+        sem_post(&sh->go);
+
+        f->posted[s] = true;
+    }
+
+    // the deadline is shared, so a late worker doesn't eat into the time given to the rest
+    for (size_t s = 0; s < JB_SHARDS; s++) {
+        if (!f->posted[s]) continue;
+
+        jb_shard_t *sh = &f->shm->shards[s];
+
+        if (!shard_wait(sh, atomic_load_explicit(&sh->cycle, memory_order_relaxed), &deadline)) {
+            misses++;
+            continue;
+        }
+
+        for (size_t o = 0; o < JB_OUTS; o++)
+            for (size_t i = 0; i < nframes; i++) bufs[o][i] += sh->out[o][i];
+    }
+
+    if (misses && f->metrics)
+        atomic_fetch_add_explicit(&f->metrics->shard_misses, misses, memory_order_relaxed);
+}
+
+jb_res_t jb_worker_init(jb_worker_t *w, const char *name, jb_client_config_t cfg,
+                        const bool chans[JB_CHANS]) {
+    memset(w, 0, sizeof(*w));
+    w->cfg = cfg;
+
+    char path[64];
+    shard_name(path, sizeof(path), name);
+
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) return JB_ERR(JB_ERR_LIBC, "failed to open '%s': %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(jb_shard_shm_t)) {
+        close(fd);
+        return JB_ERR(JB_ERR_USER, "'%s' isn't a front end", path);
+    }
+
+    void *shm = mmap(NULL, sizeof(jb_shard_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED)
+        return JB_ERR(JB_ERR_LIBC, "failed to map '%s': %s", path, strerror(errno));
+
+    w->shm = shm;
+
+    if (memcmp(w->shm->magic, JB_SHARD_MAGIC, sizeof(w->shm->magic)) != 0 ||
+        w->shm->version != SHARD_VERSION) {
+        jb_worker_stop(w);
+        return JB_ERR(JB_ERR_USER, "'%s' isn't a running front end, or is from another version",
+                      path);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    // channels are only handed over once a shard is claimed
+    memcpy(w->chans, chans, sizeof(w->chans));
+    jb_metrics_init(&w->metrics);
+    atomic_init(&w->quit, false);
+
+    jb_res_t res = jb_mem_lock(w->shm, sizeof(*w->shm));
+    if (res JB_IS_ERR) {
+        jb_warn("shard memory not locked: %s", res.msg);
+        free(res.msg);
+    }
+
+    return JB_OK_VAL;
+}
+
+// NaNs in one worker's output would poison the whole mix, so cycles that render any are silenced
+static void worker_sanitise(jb_worker_t *w, jb_shard_t *sh) {
+    bool is_nan = false;
+    for (size_t o = 0; o < JB_OUTS; o++)
+        for (size_t i = 0; i < sh->nframes; i++)
+            if (sh->out[o][i] != sh->out[o][i]) is_nan = true;
+
+    if (is_nan) {
+        atomic_fetch_add_explicit(&w->metrics.nan_mutes, 1, memory_order_relaxed);
+        memset(sh->out, 0, sizeof(sh->out));
+    }
+}
+
+// render the cycle posted to the worker's shard
+static void worker_cycle(jb_worker_t *w, jb_shard_t *sh) {
+    JB_ZONE("worker");
+
+    jb_metrics_t *m = &w->metrics;
+
+    if (sh->freewheel != w->freewheeling) {
+        w->freewheeling = sh->freewheel;
+        atomic_store_explicit(&m->freewheel, sh->freewheel, memory_order_relaxed);
+
+        if (w->cfg.freewheel_cb) w->cfg.freewheel_cb(w->cfg.state, sh->freewheel);
+    }
+
+    // as with a client, freewheeling cycles aren't realtime
+    bool rt = !w->freewheeling;
+    if (rt) jb_rt_enter();
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // events queued for earlier cycles (while the worker was behind) are late, and so go first
+    uint32_t tail = atomic_load_explicit(&sh->tail, memory_order_relaxed);
+    size_t len = 0;
+
+    for (; tail != sh->last && len < JB_MIDI_EVENTS; tail++) {
+        jb_midi_t ev = sh->ring[tail % JB_SHARD_EVENTS];
+        if ((int32_t)(tail - sh->first) < 0) ev.frame = 0;
+
+        w->events[len++] = ev;
+    }
+
+    atomic_store_explicit(&sh->tail, tail, memory_order_release);
+    atomic_fetch_add_explicit(&m->midi_events, len, memory_order_relaxed);
+
+    if (w->cfg.midi_batch_cb) {
+        w->cfg.midi_batch_cb(w->cfg.state, sh->ctx, w->events, len);
+    } else if (w->cfg.midi_cb) {
+        for (size_t i = 0; i < len; i++) w->cfg.midi_cb(w->cfg.state, sh->ctx, w->events[i]);
+    }
+
+    jb_sample_t *bufs[JB_OUTS] = {sh->out[0], sh->out[1]};
+    if (w->cfg.audio_cb) w->cfg.audio_cb(w->cfg.state, sh->ctx, sh->nframes, bufs);
+
+    worker_sanitise(w, sh);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    atomic_fetch_add_explicit(&m->cycles, 1, memory_order_relaxed);
+
+    if (rt) {
+        uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+
+        atomic_store_explicit(&m->period_ns,
+                              (uint64_t)sh->nframes * 1000000000 / sh->ctx.srate,
+                              memory_order_relaxed);
+        jb_metrics_time(m, ns);
+    }
+
+    if (rt) jb_rt_leave();
+}
+
+static void *worker_thread(void *arg) {
+    jb_worker_t *w = (jb_worker_t *)arg;
+    jb_shard_t *sh = w->shard;
+
+    for (;;) {
+        while (sem_wait(&sh->go) != 0 && errno == EINTR) continue;
+
+        if (atomic_load(&w->quit)) break;
+
+        // a post left over from a worker that had the shard before isn't a cycle
+        uint64_t cycle = atomic_load_explicit(&sh->cycle, memory_order_acquire);
+        if (cycle == atomic_load_explicit(&sh->done, memory_order_relaxed)) continue;
+
+        worker_cycle(w, sh);
+
+        atomic_store_explicit(&sh->done, cycle, memory_order_release);
+        sem_post(&sh->ready);
+    }
+
+    return NULL;
+}
+
+// claim a free shard, or one whose worker has died without giving it up
+static jb_shard_t *shard_claim(jb_shard_shm_t *shm, size_t *idx) {
+    for (size_t s = 0; s < JB_SHARDS; s++) {
+        jb_shard_t *sh = &shm->shards[s];
+        uint32_t state = JB_SHARD_FREE;
+
+        if (atomic_compare_exchange_strong(&sh->state, &state, JB_SHARD_CLAIMED)) {
+            *idx = s;
+            return sh;
+        }
+
+        pid_t pid = atomic_load(&sh->pid);
+        if (state != JB_SHARD_ATTACHED || kill(pid, 0) == 0 || errno != ESRCH) continue;
+
+        if (atomic_compare_exchange_strong(&sh->state, &state, JB_SHARD_CLAIMED)) {
+            jb_warn("reclaiming shard %zu from worker %d, which has died", s, (int)pid);
+
+            *idx = s;
+            return sh;
+        }
+    }
+
+    return NULL;
+}
+
+jb_res_t jb_worker_start(jb_worker_t *w) {
+    // best guess at what cycles will look like, as with a client
+    if (w->cfg.prepare_cb) {
+        jb_ctx_t ctx = {.srate = w->shm->srate};
+        ctx.period_usecs = (float)w->shm->nframes * 1000000.f / (float)ctx.srate;
+
+        w->cfg.prepare_cb(w->cfg.state, ctx, w->shm->nframes);
+    }
+
+    jb_shard_t *sh = shard_claim(w->shm, &w->idx);
+    if (!sh) return JB_ERR(JB_ERR_USER, "front end has no free shards (at most %d)", JB_SHARDS);
+
+    memcpy(sh->chans, w->chans, sizeof(sh->chans));
+    atomic_store(&sh->pid, getpid());
+
+    // anything queued for whoever had the shard before is dropped, and the worker starts out done
+    // with the last cycle posted, so that the front end posts it the next
+    atomic_store(&sh->tail, atomic_load(&sh->head));
+    atomic_store(&sh->done, atomic_load(&sh->cycle));
+
+    w->shard = sh;
+
+    // workers render on the front end's deadline, so they run at its priority where allowed
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+
+    if (w->shm->priority > 0) {
+        struct sched_param param = {.sched_priority = w->shm->priority};
+
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    int err = pthread_create(&w->thread, &attr, worker_thread, w);
+    if (err == EPERM) {
+        jb_warn("no permission to render at realtime priority %d", (int)w->shm->priority);
+        err = pthread_create(&w->thread, NULL, worker_thread, w);
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (err != 0) {
+        w->shard = NULL;
+        atomic_store(&sh->state, JB_SHARD_FREE);
+        return JB_ERR(JB_ERR_LIBC, "failed to start worker thread: %s", strerror(err));
+    }
+
+    atomic_store_explicit(&sh->state, JB_SHARD_ATTACHED, memory_order_release);
+
+    jb_info("rendering shard %zu of front end", w->idx);
+
+    return JB_OK_VAL;
+}
+
+void jb_worker_stop(jb_worker_t *w) {
+    if (w->shard) {
+        // the front end stops posting once the shard isn't attached; the thread is woken to quit
+        atomic_store(&w->shard->state, JB_SHARD_CLAIMED);
+        atomic_store(&w->quit, true);
+        sem_post(&w->shard->go);
+        pthread_join(w->thread, NULL);
+
+        atomic_store(&w->shard->state, JB_SHARD_FREE);
+        w->shard = NULL;
+    }
+
+    if (w->shm) {
+        munmap(w->shm, sizeof(*w->shm));
+        w->shm = NULL;
+    }
+}
@@ -0,0 +1,114 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// sock.c: local sockets
+//
+// the metrics and control servers both listen on either a UNIX socket or a localhost TCP port,
+// picked by the form of the address they're given
+//
+
+#include <errno.h>
+#include <jbase.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static jb_res_t listen_unix(jb_sock_t *sock, const char *addr) {
+    struct sockaddr_un sa = {.sun_family = AF_UNIX};
+
+    size_t len = strlen(addr) + 1;
+    if (len > sizeof(sa.sun_path) || len > sizeof(sock->path))
+        return JB_ERR(JB_ERR_USER, "socket path '%s' is too long", addr);
+
+    memcpy(sa.sun_path, addr, len);
+
+    // a socket left behind by an instance that didn't exit cleanly would fail the bind, but
+    // anything else at the path is likely a typo, and isn't ours to remove
+    struct stat st;
+    if (lstat(addr, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            return JB_ERR(JB_ERR_USER, "'%s' exists and isn't a socket", addr);
+
+        unlink(addr);
+    }
+
+    sock->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock->fd < 0) return JB_ERR(JB_ERR_LIBC, "failed to open socket: %s", strerror(errno));
+
+    if (bind(sock->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+        return JB_ERR(JB_ERR_LIBC, "failed to bind '%s': %s", addr, strerror(errno));
+
+    // only remove the file once it's ours
+    memcpy(sock->path, addr, len);
+
+    return JB_OK_VAL;
+}
+
+static jb_res_t listen_tcp(jb_sock_t *sock, const char *addr) {
+    char *end;
+    unsigned long port = strtoul(addr, &end, 10);
+
+    if (end == addr || *end != '\0' || port == 0 || port > 65535)
+        return JB_ERR(JB_ERR_USER, "'%s' is neither a socket path nor a port", addr);
+
+    // only ever served locally; anything further afield should go through a proxy
+    struct sockaddr_in sa = {.sin_family = AF_INET,
+                             .sin_port = htons(port),
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+
+    sock->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock->fd < 0) return JB_ERR(JB_ERR_LIBC, "failed to open socket: %s", strerror(errno));
+
+    int one = 1;
+    setsockopt(sock->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(sock->fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+        return JB_ERR(JB_ERR_LIBC, "failed to bind port %lu: %s", port, strerror(errno));
+
+    return JB_OK_VAL;
+}
+
+jb_res_t jb_sock_listen(jb_sock_t *sock, const char *addr) {
+    memset(sock, 0, sizeof(*sock));
+    sock->fd = -1;
+
+    jb_res_t res = strchr(addr, '/') ? listen_unix(sock, addr) : listen_tcp(sock, addr);
+
+    if (res JB_IS_OK && listen(sock->fd, 8) != 0)
+        res = JB_ERR(JB_ERR_LIBC, "failed to listen on '%s': %s", addr, strerror(errno));
+
+    if (res JB_IS_ERR) jb_sock_close(sock);
+
+    return res;
+}
+
+void jb_sock_wake(jb_sock_t *sock) {
+    if (sock->fd >= 0) shutdown(sock->fd, SHUT_RDWR);
+}
+
+void jb_sock_close(jb_sock_t *sock) {
+    if (sock->fd >= 0) close(sock->fd);
+    if (sock->path[0]) unlink(sock->path);
+
+    sock->fd = -1;
+    sock->path[0] = '\0';
+}
@@ -0,0 +1,173 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// sym.c: patch symbol table
+//
+// names of objects in a patch set are kept in a symbol table, indexed by an open-addressing hash
+// table using Robin Hood probing. slots only hold a hash and a symbol index, so the index is part
+// of the patch set's image and lookups in a mapped image need no rebuilding.
+//
+// slots are hashed on name alone, so every object sharing a name lands in the same probe run. this
+// lets each distinct name be interned in the string table once, whatever kinds of object use it
+//
+
+#include <assert.h>
+#include <jbase.h>
+#include <string.h>
+
+#define INIT_SLOTS 16
+
+const char *jb_sym_str[JB_SYM_MAX] = {
+    [JB_SYM_OSC] = "osc", [JB_SYM_ENV] = "env", [JB_SYM_INST] = "inst"};
+
+static uint32_t name_hash(const char *name, size_t len) {
+    uint64_t hash = jb_hash(JB_HASH_INIT, name, len);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// distance of a slot from where its hash would ideally place it
+static size_t probe_dist(const jb_patch_t *pt, uint32_t hash, size_t pos) {
+    size_t mask = pt->n_slots - 1;
+    return (pos - (hash & mask)) & mask;
+}
+
+static bool name_eq(const jb_patch_t *pt, const jb_sym_t *sym, const char *name, size_t len) {
+    return sym->len == len && memcmp(pt->strs + sym->name, name, len) == 0;
+}
+
+// walk the probe run for a name, returning the matching symbol of the given kind. if `interned` is
+// given, it receives the offset of the name in the string table if any symbol already uses it
+static jb_sym_t *find(const jb_patch_t *pt, jb_sym_kind_t kind, const char *name, size_t len,
+                      uint32_t *interned) {
+    if (interned) *interned = JB_NONE;
+    if (pt->n_slots == 0) return NULL;
+
+    uint32_t hash = name_hash(name, len);
+    size_t mask = pt->n_slots - 1;
+
+    for (size_t pos = hash & mask, dist = 0;; pos = (pos + 1) & mask, dist++) {
+        const jb_sym_slot_t *slot = &pt->slots[pos];
+
+        // with Robin Hood probing, a name can't be any further along than a slot closer to home
+        if (slot->sym == JB_NONE || probe_dist(pt, slot->hash, pos) < dist) return NULL;
+
+        if (slot->hash != hash) continue;
+
+        jb_sym_t *sym = &pt->syms[slot->sym];
+        if (!name_eq(pt, sym, name, len)) continue;
+
+        if (interned) *interned = sym->name;
+        if (sym->kind == kind) return sym;
+    }
+}
+
+// insert a slot, displacing any slot closer to its home position than the one being inserted
+static void slot_insert(jb_patch_t *pt, jb_sym_slot_t ins) {
+    size_t mask = pt->n_slots - 1;
+
+    for (size_t pos = ins.hash & mask, dist = 0;; pos = (pos + 1) & mask, dist++) {
+        jb_sym_slot_t *slot = &pt->slots[pos];
+
+        if (slot->sym == JB_NONE) {
+            *slot = ins;
+            return;
+        }
+
+        size_t cur_dist = probe_dist(pt, slot->hash, pos);
+        if (cur_dist < dist) {
+            jb_sym_slot_t tmp = *slot;
+            *slot = ins;
+            ins = tmp;
+            dist = cur_dist;
+        }
+    }
+}
+
+// double the index, leaving it as it was if there's no memory for a bigger one
+static jb_res_t grow(jb_patch_t *pt) {
+    jb_sym_slot_t *old = pt->slots;
+    size_t old_len = pt->n_slots;
+    size_t len = old_len ? old_len * 2 : INIT_SLOTS;
+
+    jb_sym_slot_t *slots = malloc(len * sizeof(*slots));
+    if (!slots) return JB_ERR(JB_ERR_OOM, "failed to allocate %zu symbol index slots", len);
+
+    pt->slots = slots;
+    pt->n_slots = len;
+
+    for (size_t i = 0; i < pt->n_slots; i++) pt->slots[i].sym = JB_NONE;
+
+    for (size_t i = 0; i < old_len; i++)
+        if (old[i].sym != JB_NONE) slot_insert(pt, old[i]);
+
+    free(old);
+
+    return JB_OK_VAL;
+}
+
+const jb_sym_t *jb_patch_find(const jb_patch_t *pt, jb_sym_kind_t kind, const char *name,
+                              size_t len) {
+    return find(pt, kind, name, len, NULL);
+}
+
+jb_res_t jb_patch_define(jb_patch_t *pt, jb_sym_kind_t kind, const char *name, size_t len,
+                         uint32_t idx) {
+    assert(!pt->image);
+
+    uint32_t interned;
+    jb_sym_t *sym = find(pt, kind, name, len, &interned);
+
+    // redefining a name points it at the new object, leaving the old one in place for anything
+    // that already refers to it
+    if (sym) {
+        sym->idx = idx;
+        return JB_OK_VAL;
+    }
+
+    if (len >= JB_NONE || jb_buf_len(pt->syms) >= JB_NONE)
+        return JB_ERR(JB_ERR_OOM, "too many symbols in patch set");
+
+    // keep load factor at or below 3/4
+    if ((pt->n_syms + 1) * 4 > pt->n_slots * 3) JB_TRY(grow(pt));
+
+    if (interned == JB_NONE) {
+        interned = jb_buf_len(pt->strs);
+
+        for (size_t i = 0; i < len; i++) jb_buf_push(pt->strs, name[i]);
+        jb_buf_push(pt->strs, '\0');
+    }
+
+    jb_sym_t new_sym = {.kind = kind, .idx = idx, .name = interned, .len = len};
+    jb_buf_push(pt->syms, new_sym);
+
+    pt->n_syms = jb_buf_len(pt->syms);
+    pt->n_strs = jb_buf_len(pt->strs);
+
+    slot_insert(pt, (jb_sym_slot_t){.hash = name_hash(name, len), .sym = pt->n_syms - 1});
+
+    return JB_OK_VAL;
+}
+
+const char *jb_patch_name(const jb_patch_t *pt, jb_sym_kind_t kind, uint32_t idx) {
+    for (size_t i = 0; i < pt->n_syms; i++)
+        if (pt->syms[i].kind == kind && pt->syms[i].idx == idx)
+            return pt->strs + pt->syms[i].name;
+
+    return NULL;
+}
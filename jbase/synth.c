@@ -9,7 +9,11 @@ static int rand_between(int min, int max) {
     return rand() % (max - min + 1) + min;
 }
 
+// fold `x` back on itself whenever it crosses +/- threshold. a threshold that isn't positive leaves
+// it unfolded (fmod() by it would give NaN)
 float fold(float x, float threshold) {
+    if (threshold <= 0.0f) return x;
+
     float sign = 1.0f;
     if (x < 0.0f) sign = -1.0;
 
@@ -54,37 +58,78 @@ float jb_wave_noise(float x, float bias) {
     return jb_wave_sin(x, bias) * (float)rand_between(-100, 100) / 100.f;
 }
 
-float jb_osc_sample(jb_osc_t *osc, jb_cents_t note, size_t idx, size_t srate) {
-    size_t phase = idx % srate;
-    float step = (2 * M_PI * jb_cents_hz(note + osc->detune)) / srate;
+const jb_wave_fn_t jb_wave_fns[JB_WAVE_MAX] = {
+    [JB_WAVE_SIN] = jb_wave_sin,
+    [JB_WAVE_SQUARE] = jb_wave_square,
+    [JB_WAVE_TRIANGLE] = jb_wave_triangle,
+    [JB_WAVE_SAW] = jb_wave_saw,
+    [JB_WAVE_NOISE] = jb_wave_noise,
+};
+
+const char *jb_wave_str[JB_WAVE_MAX] = {
+    [JB_WAVE_SIN] = "sin",
+    [JB_WAVE_SQUARE] = "square",
+    [JB_WAVE_TRIANGLE] = "triangle",
+    [JB_WAVE_SAW] = "saw",
+    [JB_WAVE_NOISE] = "noise",
+};
+
+const char jb_mod_char[JB_MOD_MAX] = {
+    [JB_MOD_AM] = '*',
+    [JB_MOD_FM] = '%',
+    [JB_MOD_PM] = '+',
+    [JB_MOD_BM] = '-',
+};
+
+float jb_osc_step(const jb_osc_t *osc, jb_cents_t note, size_t srate) {
+    float hz = osc->hz != 0 ? osc->hz : jb_cents_hz(note + osc->detune);
+    return (2 * M_PI * hz) / srate;
+}
 
-    return osc->fn(step * phase, osc->bias) * osc->amp;
+// keep a phase within [0, 2pi), so that it doesn't lose precision as it accumulates
+static float phase_wrap(float phase) {
+    return phase - 2 * M_PI * floorf(phase / (2 * M_PI));
 }
 
-float jb_chain_sample(jb_osc_link_t *link, jb_cents_t note, size_t idx, size_t srate) {
-    if (!link->next) return jb_osc_sample(link->osc, note, idx, srate);
-
-    float mod_samp = jb_chain_sample(link->next, note, idx, srate);
-
-    jb_wave_fn_t fn = link->osc->fn;
-    float amp = link->osc->amp;
-    jb_cents_t detune = link->osc->detune;
-    float bias = link->osc->bias;
-
-    size_t phase = idx % srate;
-    float step = (2 * M_PI * jb_cents_hz(note + detune)) / srate;
-
-    switch (link->mod) {
-        case JB_MOD_AM:
-            return amp * fn(step * phase, bias) * mod_samp;
-        case JB_MOD_FM:
-            return amp * fn((step * mod_samp) * phase, bias);
-        case JB_MOD_PM:
-            return amp * fn(step * phase + mod_samp, bias);
-        case JB_MOD_BM:
-            return amp * fn(step * phase, (mod_samp + 1.0) / 2. - 0.0005);
-        default:
-            jb_warn("unknown modulation method '%d'", link->mod);
-            return 0.0;
+float jb_chain_sample(const jb_osc_t *oscs, const jb_osc_link_t *chain, size_t len, float *phase,
+                      const float *step) {
+    // the end of the chain is unmodulated; work back towards the start, each link being modulated
+    // by the output of the one after it
+    float mod_samp = 0.0;
+
+    for (size_t i = len; i-- > 0;) {
+        const jb_osc_t *osc = &oscs[chain[i].osc];
+        jb_wave_fn_t fn = jb_wave_fns[osc->wave];
+        float amp = osc->amp;
+        float bias = osc->bias;
+        float ph = phase[i];
+        float inc = step[i];
+
+        if (i == len - 1) {
+            mod_samp = amp * fn(ph, bias);
+        } else {
+            switch (chain[i].mod) {
+                case JB_MOD_AM:
+                    mod_samp = amp * fn(ph, bias) * mod_samp;
+                    break;
+                case JB_MOD_FM:
+                    inc *= 1.0 + mod_samp;
+                    mod_samp = amp * fn(ph, bias);
+                    break;
+                case JB_MOD_PM:
+                    mod_samp = amp * fn(ph + mod_samp, bias);
+                    break;
+                case JB_MOD_BM:
+                    mod_samp = amp * fn(ph, (mod_samp + 1.0) / 2. - 0.0005);
+                    break;
+                default:
+                    jb_warn("unknown modulation method '%d'", chain[i].mod);
+                    mod_samp = 0.0;
+            }
+        }
+
+        phase[i] = phase_wrap(ph + inc);
     }
+
+    return mod_samp;
 }
@@ -23,3 +23,16 @@ void *jb_buf_grow(const void *buf, size_t new_len, size_t elem_size) {
     new_hdr->cap = new_cap;
     return new_hdr->buf;
 }
+
+#define FNV_PRIME 0x100000001b3ull
+
+uint64_t jb_hash(uint64_t hash, const void *buf, size_t len) {
+    const uint8_t *bytes = buf;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
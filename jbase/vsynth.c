@@ -0,0 +1,272 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// vsynth.c: vectorised synthesis
+//
+// renders JB_LANES voices of the same instrument at once. every voice of an instrument shares its
+// oscillator chain, so each lane runs the same instructions on its own phase and step. wave
+// functions are polynomial approximations, close enough to the scalar versions in synth.c to be
+// inaudible, and written entirely with vector operations so that no lane falls back to libm
+//
+// additive oscillators are rendered JB_LANES partials of a voice at a time instead. each partial is
+// a point turned around the unit circle by a complex multiply every frame, so the only sines taken
+// are for the rotations, once per block
+//
+
+#include <jbase.h>
+#include <math.h>
+
+typedef jb_vf_t vf_t;
+typedef jb_vi_t vi_t;
+typedef jb_vu_t vu_t;
+
+#define PI ((float)M_PI)
+#define TAU (2 * PI)
+
+#define SIGN_BIT ((int32_t)0x80000000)
+
+// pick lanes from `a` where `mask` is set, and from `b` elsewhere
+static vf_t vselect(vi_t mask, vf_t a, vf_t b) {
+    return (vf_t)((mask & (vi_t)a) | (~mask & (vi_t)b));
+}
+
+static vf_t vabs(vf_t x) {
+    return (vf_t)((vi_t)x & ~SIGN_BIT);
+}
+
+// give `x` the sign of `s`
+static vf_t vcopysign(vf_t x, vf_t s) {
+    return (vf_t)(((vi_t)x & ~SIGN_BIT) | ((vi_t)s & SIGN_BIT));
+}
+
+static vf_t vtrunc(vf_t x) {
+    return __builtin_convertvector(__builtin_convertvector(x, vi_t), vf_t);
+}
+
+static vf_t vfloor(vf_t x) {
+    vf_t t = vtrunc(x);
+    // comparisons give -1 in lanes where they hold
+    return t + __builtin_convertvector(t > x, vf_t);
+}
+
+// square root of `x` (zero or normal and positive) to within a few ulp, as `x` times its
+// reciprocal square root. that's estimated from the exponent bits, then refined by three newton
+// steps; a zero lane's estimate stays finite, so its root comes out as zero
+static vf_t vsqrt(vf_t x) {
+    vf_t y = (vf_t)(0x5f3759df - ((vi_t)x >> 1));
+
+    for (size_t i = 0; i < 3; i++) y *= 1.5f - 0.5f * x * y * y;
+
+    return x * y;
+}
+
+// sine to within ~4e-6, by reducing to [-pi/2, pi/2] and evaluating a taylor polynomial
+static vf_t vsin(vf_t x) {
+    x -= TAU * vfloor(x / TAU + 0.5f);
+
+    x = vselect(x > PI / 2, PI - x, x);
+    x = vselect(x < -PI / 2, -PI - x, x);
+
+    vf_t x2 = x * x;
+    return x * (1 + x2 * (-1 / 6.f + x2 * (1 / 120.f + x2 * (-1 / 5040.f + x2 * (1 / 362880.f)))));
+}
+
+// arcsine to within ~2e-8 (abramowitz & stegun 4.4.46)
+static vf_t vasin(vf_t x) {
+    vf_t a = vabs(x);
+    a = vselect(a > 1, a - a + 1, a);
+
+    vf_t p = a * -0.0012624911f + 0.0066700901f;
+    p = p * a - 0.0170881256f;
+    p = p * a + 0.0308918810f;
+    p = p * a - 0.0501743046f;
+    p = p * a + 0.0889789874f;
+    p = p * a - 0.2145988016f;
+    p = p * a + 1.5707963050f;
+
+    return vcopysign(PI / 2 - vsqrt(1 - a) * p, x);
+}
+
+// vector version of fold() in synth.c; a threshold that isn't positive leaves `x` unfolded
+static vf_t vfold(vf_t x, vf_t threshold) {
+    vi_t valid = threshold > 0;
+    vf_t t = vselect(valid, threshold, threshold - threshold + 1);
+
+    vf_t a = vabs(x);
+    vf_t folds = vfloor(a / t);
+    vf_t rem = a - folds * t;
+
+    vi_t odd = (__builtin_convertvector(folds, vi_t) & 1) != 0;
+    vf_t y = vselect(odd, t - rem, rem);
+    y = vselect(a > t, y, a);
+
+    return vselect(valid, vcopysign(y, x), x);
+}
+
+static vf_t vwave_sin(vf_t x, vf_t bias) {
+    return vfold(vsin(x), 1 - bias);
+}
+
+static vf_t vwave_square(vf_t x, vf_t bias) {
+    vf_t one = x - x + 1;
+    return vselect(vsin(x) > bias, one, -one);
+}
+
+static vf_t vwave_triangle(vf_t x, vf_t bias) {
+    return vasin(vwave_sin(x, bias));
+}
+
+static vf_t vwave_saw(vf_t x, vf_t bias) {
+    // truncate rather than floor, matching fmod() in the scalar version
+    vf_t s = 2 * ((x - vtrunc(x)) - 0.5f);
+    return vfold(s, bias);
+}
+
+void jb_noise_init(jb_vu_t *noise) {
+    // lanes of an xorshift generator need distinct, nonzero seeds
+    static const vu_t seeds = {
+        0x9e3779b9, 0x7f4a7c15, 0xf39cc060, 0x5ced1a3c,
+        0x2545f491, 0x4f6cdd1d, 0x6c8e9cf5, 0x1b873593,
+#if JB_LANES > 8
+        0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f, 0x165667b1,
+        0xd3a2646c, 0xfd7046c5, 0xb55a4f09, 0x68e31da4,
+#endif
+    };
+
+    *noise = seeds;
+}
+
+static vf_t vwave_noise(vf_t x, vf_t bias, vu_t *noise) {
+    vu_t s = *noise;
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    *noise = s;
+
+    // top 24 bits of each lane, scaled to [-1, 1)
+    vf_t r = __builtin_convertvector((vi_t)(s >> 8), vf_t) / (float)(1 << 23) - 1;
+
+    return vwave_sin(x, bias) * r;
+}
+
+static vf_t vwave(jb_wave_t wave, vf_t x, vf_t bias, vu_t *noise) {
+    switch (wave) {
+        case JB_WAVE_SIN:
+            return vwave_sin(x, bias);
+        case JB_WAVE_SQUARE:
+            return vwave_square(x, bias);
+        case JB_WAVE_TRIANGLE:
+            return vwave_triangle(x, bias);
+        case JB_WAVE_SAW:
+            return vwave_saw(x, bias);
+        case JB_WAVE_NOISE:
+            return vwave_noise(x, bias, noise);
+        default:
+            return x - x;
+    }
+}
+
+void jb_vwave(jb_wave_t wave, const jb_vf_t *x, const jb_vf_t *bias, jb_vu_t *noise,
+              jb_vf_t *out) {
+    *out = vwave(wave, *x, *bias, noise);
+}
+
+void jb_chain_sample_v(const jb_osc_t *oscs, const jb_osc_link_t *chain, size_t len,
+                       jb_vf_t *phase, const jb_vf_t *step, jb_vu_t *noise, jb_vf_t *out) {
+    // mirrors jb_chain_sample(), with a lane per voice
+    vf_t zero = {0};
+    vf_t mod_samp = zero;
+
+    for (size_t i = len; i-- > 0;) {
+        const jb_osc_t *osc = &oscs[chain[i].osc];
+        vf_t bias = zero + osc->bias;
+        vf_t ph = phase[i];
+        vf_t inc = step[i];
+
+        if (i == len - 1) {
+            mod_samp = osc->amp * vwave(osc->wave, ph, bias, noise);
+        } else {
+            switch (chain[i].mod) {
+                case JB_MOD_AM:
+                    mod_samp = osc->amp * vwave(osc->wave, ph, bias, noise) * mod_samp;
+                    break;
+                case JB_MOD_FM:
+                    inc *= 1 + mod_samp;
+                    mod_samp = osc->amp * vwave(osc->wave, ph, bias, noise);
+                    break;
+                case JB_MOD_PM:
+                    mod_samp = osc->amp * vwave(osc->wave, ph + mod_samp, bias, noise);
+                    break;
+                case JB_MOD_BM:
+                    mod_samp =
+                        osc->amp * vwave(osc->wave, ph, (mod_samp + 1) / 2 - 0.0005f, noise);
+                    break;
+                default:
+                    mod_samp = zero;
+            }
+        }
+
+        ph += inc;
+        phase[i] = ph - TAU * vfloor(ph / TAU);
+    }
+
+    *out = mod_samp;
+}
+
+void jb_partials_render_v(jb_partials_v_t *state, const jb_vf_t *ratio, const jb_vf_t *amp,
+                          size_t groups, float step, size_t nframes, float *out) {
+    // partials are summed a group at a time across the block, so that each group's state stays in
+    // registers; lanes are only added together once every group has been through
+    vf_t acc[JB_PARTIAL_BLOCK] = {0};
+
+    for (size_t g = 0; g < groups; g++) {
+        vf_t w = ratio[g] * step;
+        // cos(w) = 1 - 2sin^2(w/2) keeps its precision for the small angles most partials turn by
+        vf_t half = vsin(w / 2);
+        vf_t rot_re = 1 - 2 * half * half, rot_im = vsin(w);
+
+        vf_t re = state[g].re, im = state[g].im, a = state[g].amp;
+        vf_t goal = vselect(w < PI, amp[g], w - w);
+        vf_t da = (goal - a) / (float)nframes;
+
+        for (size_t j = 0; j < nframes; j++) {
+            acc[j] += a * im;
+            a += da;
+
+            vf_t t = re * rot_re - im * rot_im;
+            im = re * rot_im + im * rot_re;
+            re = t;
+        }
+
+        // rounding slowly moves each point off the unit circle; a step of newton's method on
+        // 1/sqrt(|z|^2) puts it back without a square root
+        vf_t k = (3 - (re * re + im * im)) * 0.5f;
+
+        state[g].re = re * k;
+        state[g].im = im * k;
+        state[g].amp = goal;
+    }
+
+    for (size_t j = 0; j < nframes; j++) {
+        float samp = 0.0;
+        for (size_t l = 0; l < JB_LANES; l++) samp += acc[j][l];
+
+        out[j] += samp;
+    }
+}
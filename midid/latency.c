@@ -0,0 +1,345 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// latency.c: MIDI-to-audio latency measurement
+//
+// runs the engine alongside a probe client, which plays notes into the engine's MIDI input and
+// listens to its audio output. each note-on is stamped with the frame it was sent on, and the
+// probe finds the frame its onset comes back on; the difference is the latency through JACK and
+// the engine. results include the period JACK adds to break the loop between the two clients.
+// for repeatable numbers, run against a dummy backend (e.g. `jackd -d dummy -r 48000`)
+//
+
+#include <jack/jack.h>
+#include <math.h>
+#include <midid.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jack/midiport.h"
+
+#define PROBE_NOTES 100       // default notes sent per configuration
+#define PROBE_NOTE 69         // note sent (A4)
+#define PROBE_THRESHOLD 0.01f // level counted as an onset
+#define PROBE_GAP_USECS 20000 // time between notes
+#define PROBE_SETTLE_USECS 200000 // time given to JACK after changing period size
+
+// period sizes measured by default
+static const jack_nframes_t default_periods[] = {64, 128, 256, 512, 1024};
+
+// instant attack and release, so that the onset is the first frame the note is rendered on
+static jb_def_t default_defs[] = {
+    {JB_DEF_ENV, "probe: 0s1.0 -> SUST -> 0s0.0"},
+    {JB_DEF_OSC, "probe: wave=square vol=1.0"},
+    {JB_DEF_INST, "probe probe: probe"},
+    {JB_DEF_CHAN, "0: probe"},
+};
+
+typedef enum {
+    PROBE_IDLE,    // waiting to be told to send a note
+    PROBE_SEND,    // send a note-on next cycle
+    PROBE_ONSET,   // waiting for the note to be heard
+    PROBE_SILENCE, // note heard (or missed); waiting for the output to go quiet again
+} probe_state_t;
+
+typedef struct {
+    jack_client_t *jack;
+    jack_port_t *midi_out;
+    jack_port_t *audio_in;
+    jack_nframes_t srate;
+
+    _Atomic int state;          // probe_state_t
+    _Atomic uint32_t offset;    // frame into the cycle to send the next note on
+    _Atomic int64_t result;     // latency of last note in frames (-1 if it never arrived)
+
+    jack_nframes_t sent;        // frame last note was sent on (process thread only)
+} probe_t;
+
+static void probe_note(void *midi, jack_nframes_t frame, uint8_t kind) {
+    jack_midi_data_t msg[3] = {kind, PROBE_NOTE, kind == JB_NOTE_ON ? 127 : 0};
+    jack_midi_event_write(midi, frame, msg, sizeof(msg));
+}
+
+static void probe_done(probe_t *pr, void *midi, int64_t result) {
+    probe_note(midi, 0, JB_NOTE_OFF);
+    atomic_store(&pr->result, result);
+    atomic_store(&pr->state, PROBE_SILENCE);
+}
+
+static int probe_process(jack_nframes_t nframes, void *arg) {
+    probe_t *pr = (probe_t *)arg;
+
+    void *midi = jack_port_get_buffer(pr->midi_out, nframes);
+    jb_sample_t *in = (jb_sample_t *)jack_port_get_buffer(pr->audio_in, nframes);
+    jack_nframes_t now = jack_last_frame_time(pr->jack);
+
+    jack_midi_clear_buffer(midi);
+
+    switch (atomic_load(&pr->state)) {
+        case PROBE_SEND: {
+            jack_nframes_t offset = atomic_load(&pr->offset) % nframes;
+
+            probe_note(midi, offset, JB_NOTE_ON);
+            pr->sent = now + offset;
+            atomic_store(&pr->state, PROBE_ONSET);
+        } break;
+
+        case PROBE_ONSET:
+            for (size_t i = 0; i < nframes; i++) {
+                if (fabsf(in[i]) > PROBE_THRESHOLD) {
+                    probe_done(pr, midi, (int64_t)(now + i - pr->sent));
+                    return 0;
+                }
+            }
+
+            // give up on notes that take more than a second
+            if (now + nframes - pr->sent > pr->srate) probe_done(pr, midi, -1);
+            break;
+
+        case PROBE_SILENCE: {
+            bool quiet = true;
+            for (size_t i = 0; i < nframes; i++)
+                if (fabsf(in[i]) > PROBE_THRESHOLD) quiet = false;
+
+            if (quiet) atomic_store(&pr->state, PROBE_IDLE);
+        } break;
+
+        default:
+            break;
+    }
+
+    return 0;
+}
+
+static jb_res_t probe_init(probe_t *pr, jb_client_t *target) {
+    memset(pr, 0, sizeof(*pr));
+
+    jack_status_t status;
+    pr->jack = jack_client_open("midid-latency", JackNullOption, &status);
+    if (!pr->jack) return JB_ERR(JB_ERR_JACK, "failed to open probe connection to JACK");
+
+    pr->srate = jack_get_sample_rate(pr->jack);
+
+    pr->midi_out =
+        jack_port_register(pr->jack, "midi_out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
+    pr->audio_in =
+        jack_port_register(pr->jack, "audio_in", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+
+    if (!pr->midi_out || !pr->audio_in) return JB_ERR(JB_ERR_JACK, "failed to open probe ports");
+
+    jack_set_process_callback(pr->jack, probe_process, pr);
+
+    if (jack_activate(pr->jack) != 0) return JB_ERR(JB_ERR_JACK, "failed to activate probe");
+
+    // loop the probe through the engine's first input and left output
+    if (jack_connect(pr->jack, jack_port_name(pr->midi_out), jack_port_name(target->midi_in[0])) ||
+        jack_connect(pr->jack, jack_port_name(target->audio_out[0]), jack_port_name(pr->audio_in)))
+        return JB_ERR(JB_ERR_JACK, "failed to connect probe to engine");
+
+    return JB_OK_VAL;
+}
+
+static void probe_free(probe_t *pr) {
+    if (!pr->jack) return;
+
+    jack_deactivate(pr->jack);
+    jack_client_close(pr->jack);
+    pr->jack = NULL;
+}
+
+// wait for the probe to reach a state, giving up after `usecs`
+static bool probe_wait(probe_t *pr, probe_state_t state, long usecs) {
+    for (long waited = 0; atomic_load(&pr->state) != (int)state; waited += 1000) {
+        if (waited > usecs) return false;
+        usleep(1000);
+    }
+
+    return true;
+}
+
+static int cmp_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// play `notes` notes through the probe, and print the distribution of their latencies
+static void measure(probe_t *pr, jack_nframes_t period, bool accurate, size_t notes) {
+    int64_t *lat = calloc(notes, sizeof(*lat));
+    size_t heard = 0, missed = 0;
+
+    if (!lat) return;
+
+    for (size_t i = 0; i < notes; i++) {
+        if (!probe_wait(pr, PROBE_IDLE, 2000000)) {
+            jb_warn("probe stuck; is the engine running?");
+            break;
+        }
+
+        // spread note-ons across the cycle, since that's where accuracy makes a difference
+        atomic_store(&pr->offset, (uint32_t)rand());
+        atomic_store(&pr->state, PROBE_SEND);
+
+        if (!probe_wait(pr, PROBE_SILENCE, 2000000)) continue;
+
+        int64_t result = atomic_load(&pr->result);
+        if (result < 0)
+            missed++;
+        else
+            lat[heard++] = result;
+
+        usleep(PROBE_GAP_USECS);
+    }
+
+    qsort(lat, heard, sizeof(*lat), cmp_i64);
+
+#define MS(frames) ((double)(frames) * 1000.0 / pr->srate)
+    if (heard > 0)
+        printf("%6u  %-8s  %5zu  %6zu  %7.3f  %7.3f  %7.3f  %7.3f\n",
+               period,
+               accurate ? "yes" : "no",
+               heard,
+               missed,
+               MS(lat[0]),
+               MS(lat[heard / 2]),
+               MS(lat[heard * 95 / 100]),
+               MS(lat[heard - 1]));
+    else
+        printf("%6u  %-8s  %5zu  %6zu  (no notes heard)\n", period, accurate ? "yes" : "no", heard, missed);
+#undef MS
+
+    fflush(stdout);
+    free(lat);
+}
+
+typedef struct {
+    jb_def_t *defs;           // patch to measure (default patch if empty)
+    jack_nframes_t *periods;  // period sizes to measure (defaults if empty)
+    size_t notes;             // notes per configuration
+} latency_opts_t;
+
+static jb_res_t latency_run(latency_opts_t *opts) {
+    jb_patch_t patch;
+    jb_patch_init(&patch);
+
+    const jb_def_t *defs = opts->defs;
+    size_t n_defs = jb_buf_len(opts->defs);
+
+    if (n_defs == 0) {
+        defs = default_defs;
+        n_defs = sizeof(default_defs) / sizeof(*default_defs);
+    }
+
+    JB_TRY(jb_patch_compile(&patch, defs, n_defs));
+
+    jb_engine_t eng;
+    JB_TRY(jb_engine_init(&eng, &patch, JB_ENGINE_VOICES));
+
+    jb_client_t cl;
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = &eng,
+                              .midi_batch_cb = jb_engine_midi_batch,
+                              .audio_cb = jb_engine_audio,
+                              .prepare_cb = jb_engine_prepare};
+
+    JB_TRY(jb_client_init(&cl, cfg));
+    JB_TRY(jb_client_prepare(&cl));
+    JB_TRY(jb_client_activate(&cl));
+
+    probe_t probe;
+    jb_res_t res = probe_init(&probe, &cl);
+
+    if (res JB_IS_OK) {
+        const jack_nframes_t *periods = opts->periods;
+        size_t n_periods = jb_buf_len(opts->periods);
+
+        if (n_periods == 0) {
+            periods = default_periods;
+            n_periods = sizeof(default_periods) / sizeof(*default_periods);
+        }
+
+        printf("# latency from note-on to onset, in ms (%u Hz)\n", probe.srate);
+        printf("%6s  %-8s  %5s  %6s  %7s  %7s  %7s  %7s\n",
+               "period", "accurate", "notes", "missed", "min", "median", "p95", "max");
+
+        for (size_t i = 0; i < n_periods; i++) {
+            if (jack_set_buffer_size(probe.jack, periods[i]) != 0) {
+                jb_warn("JACK refused period size %u", periods[i]);
+                continue;
+            }
+
+            usleep(PROBE_SETTLE_USECS);
+
+            for (int accurate = 0; accurate <= 1; accurate++) {
+                eng.accurate = accurate;
+                measure(&probe, periods[i], accurate, opts->notes);
+            }
+        }
+    }
+
+    probe_free(&probe);
+    jb_client_close(&cl);
+    jb_engine_free(&eng);
+    jb_patch_free(&patch);
+
+    return res;
+}
+
+int latency_main(int argc, char **argv) {
+    latency_opts_t opts = {.notes = PROBE_NOTES};
+
+    int c;
+    while ((c = getopt(argc, argv, "p:N:I:E:O:C:R:")) != -1) {
+        switch (c) {
+            case 'p':  // measure a period size
+                jb_buf_push(opts.periods, strtoul(optarg, NULL, 10));
+                break;
+
+            case 'N':  // notes per configuration
+                opts.notes = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'I':  // patch to measure (note 69 on channel 0 is played)
+            case 'E':
+            case 'O':
+            case 'C':
+            case 'R':
+                jb_buf_push(opts.defs, ((jb_def_t){.kind = c, .src = optarg}));
+                break;
+
+            default:
+                return 1;
+        }
+    }
+
+    jb_res_t res = latency_run(&opts);
+
+    jb_buf_free(opts.defs);
+    jb_buf_free(opts.periods);
+
+    if (res JB_IS_ERR) {
+        jb_report_result(res);
+        return 1;
+    }
+
+    return 0;
+}
@@ -16,94 +16,540 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <jbase.h>
+#include <errno.h>
+#include <jack/jack.h>
+#include <locale.h>
+#include <midid.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// static void midi_cb(void *state, jb_midi_t ev) {
-//     (void)state;
-//     (void)ev;
+typedef struct {
+    jb_def_t *defs;      // patch definitions, in order given
+    char **midi_pats;    // patterns of MIDI ports to connect to, optionally prefixed by `[PORT]:`
+    char **audio_pats;   // patterns of audio ports to connect to
+    char *image_path;    // path of patch image (NULL for default)
+    bool use_image;      // whether to use a patch image at all
+    bool list;           // list ports instead of running
+    size_t midi_ports;   // MIDI input ports to open (0 to open as many as are used)
+    bool accurate;       // apply MIDI events on the frame they arrive on
+    size_t voices;       // voices each engine can sound at once
+    char *metrics_addr;  // socket path or localhost port to serve metrics on (NULL for none)
+    char *trace_path;    // path to write zone trace to (NULL for none)
+    char *control_addr;  // socket path or localhost port to take commands on (NULL for none)
+    char *meter_name;    // shared memory object to publish meters to (NULL for none)
+    uint32_t tap;        // frames averaged into each waveform tap sample (0 for no tap)
+    char **part_paths;   // files of definitions to host an engine each, alongside any given inline
+    char *front_name;    // shared memory object to take workers at, as a front end (NULL if not)
+    uint64_t timeout;    // μs given to workers each cycle, as a front end (0 for default)
+    char *worker_name;   // front end to render for, instead of opening JACK ports (NULL if not)
+} opts_t;
 
-//     switch (ev.kind) {
-//         case JB_NOTE_ON:
-//             jb_info("note %u on", ev.args[JB_NOTE]);
-//             break;
+// an engine hosted by this process
+typedef struct {
+    jb_def_t *defs;      // definitions of its patch set
+    bool read;           // whether definitions were read from a file (and so are owned)
+    jb_patch_t *patch;   // patch set, shared by parts with the same definitions
+    bool owns_patch;     // whether this part is the one to free the patch set
+    jb_engine_t eng;
+} part_t;
 
-//         case JB_NOTE_OFF:
-//             jb_info("note %u off", ev.args[JB_NOTE]);
-//             break;
+// split a `[PORT]:[REGEX]` MIDI pattern, where the port defaults to 0
+static size_t pat_port(char *pat, char **regex) {
+    char *end;
+    unsigned long port = strtoul(pat, &end, 10);
 
-//         default:
-//             jb_warn("unhandled MIDI event kind '%x'", ev.kind);
-//     }
-// }
+    if (end != pat && *end == ':') {
+        *regex = end + 1;
+        return port;
+    }
 
-// static void audio_cb(void *state, jb_ctx_t ctx, size_t nframes, jb_sample_t *buf) {
-//     (void)state;
+    *regex = pat;
+    return 0;
+}
+
+// MIDI input ports needed to reach every channel with instruments (if there's a patch set), and
+// every port connected to
+static size_t ports_used(const opts_t *opts, const jb_patch_t *pt) {
+    size_t ports = 1;
+
+    for (size_t i = 0; pt && i < JB_CHANS; i++)
+        if (pt->chans[i].len > 0) ports = JB_MAX(ports, i / JB_PORT_CHANS + 1);
+
+    for (size_t i = 0; i < jb_buf_len(opts->midi_pats); i++) {
+        char *regex;
+        ports = JB_MAX(ports, pat_port(opts->midi_pats[i], &regex) + 1);
+    }
+
+    return JB_MIN(ports, JB_MIDI_PORTS);
+}
+
+// default patch image location: `$XDG_CACHE_HOME/midid/[HASH].jbp`, falling back to `~/.cache`
+static jb_res_t default_image_path(char *buf, size_t len, uint64_t hash) {
+    char dir[4096];
+    char *cache = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+
+    if (cache && *cache)
+        snprintf(dir, sizeof(dir), "%s", cache);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return JB_ERR(JB_ERR_USER, "neither XDG_CACHE_HOME nor HOME are set");
+
+    mkdir(dir, 0755);
+    strncat(dir, "/midid", sizeof(dir) - strlen(dir) - 1);
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return JB_ERR(JB_ERR_LIBC, "failed to create '%s': %s", dir, strerror(errno));
+
+    snprintf(buf, len, "%s/%016llx.jbp", dir, (unsigned long long)hash);
+
+    return JB_OK_VAL;
+}
+
+// map the patch image for the given definitions if one is up to date, otherwise compile them and
+// write a fresh image for next time
+static jb_res_t load_patch(jb_patch_t *pt, opts_t *opts, const jb_def_t *defs) {
+    size_t len = jb_buf_len(defs);
+    uint64_t hash = jb_patch_hash(defs, len);
+
+    char path[4096];
+    if (opts->use_image) {
+        if (opts->image_path)
+            snprintf(path, sizeof(path), "%s", opts->image_path);
+        else
+            JB_TRY(default_image_path(path, sizeof(path), hash));
+
+        jb_res_t res = jb_image_load(pt, path, hash);
+        if (res JB_IS_OK) return JB_OK_VAL;
+
+        jb_debug("not using patch image: %s", res.msg);
+        free(res.msg);
+    }
+
+    JB_TRY(jb_patch_compile(pt, defs, len));
+
+    if (opts->use_image) {
+        jb_res_t res = jb_image_write(pt, path, hash);
+
+        if (res JB_IS_ERR) {
+            jb_warn("failed to write patch image: %s", res.msg);
+            free(res.msg);
+        }
+    }
+
+    return JB_OK_VAL;
+}
+
+// load each part's patch set, and an engine to play it. parts with the same definitions as an
+// earlier part share its patch set
+static jb_res_t parts_load(part_t *parts, size_t len, opts_t *opts) {
+    for (size_t i = 0; i < len; i++) {
+        part_t *part = &parts[i];
+        uint64_t hash = jb_patch_hash(part->defs, jb_buf_len(part->defs));
+
+        for (size_t j = 0; j < i && !part->patch; j++)
+            if (jb_patch_hash(parts[j].defs, jb_buf_len(parts[j].defs)) == hash)
+                part->patch = parts[j].patch;
+
+        if (!part->patch) {
+            part->patch = malloc(sizeof(*part->patch));
+            if (!part->patch) return JB_ERR(JB_ERR_OOM, "failed to allocate patch set");
+
+            part->owns_patch = true;
+            jb_patch_init(part->patch);
+
+            JB_TRY(load_patch(part->patch, opts, part->defs));
+            jb_patch_log(part->patch);
+        }
+
+        JB_TRY(jb_engine_init(&part->eng, part->patch, opts->voices));
+        part->eng.accurate = opts->accurate;
+    }
+
+    return JB_OK_VAL;
+}
+
+static void parts_free(part_t *parts, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        jb_engine_free(&parts[i].eng);
+
+        if (parts[i].owns_patch) {
+            jb_patch_free(parts[i].patch);
+            free(parts[i].patch);
+        }
+
+        if (parts[i].read) jb_defs_free(parts[i].defs);
+    }
+
+    free(parts);
+}
+
+// connect the client's MIDI inputs and audio outputs to the ports given
+static jb_res_t connect_ports(jb_client_t *cl, opts_t *opts) {
+    for (size_t i = 0; i < jb_buf_len(opts->midi_pats); i++) {
+        char *regex;
+        size_t port = pat_port(opts->midi_pats[i], &regex);
+
+        JB_TRY(jb_client_connect_midi(cl, port, regex));
+    }
+
+    for (size_t i = 0; i < jb_buf_len(opts->audio_pats); i++)
+        JB_TRY(jb_client_connect_audio(cl, opts->audio_pats[i]));
+
+    return JB_OK_VAL;
+}
+
+// own the JACK ports, and hand every cycle to the workers that attach
+static jb_res_t run_front(opts_t *opts) {
+    if (jb_buf_len(opts->defs) > 0 || jb_buf_len(opts->part_paths) > 0)
+        return JB_ERR(JB_ERR_USER, "a front end doesn't play patches itself; workers do (see -w)");
+    if (opts->control_addr || opts->meter_name)
+        return JB_ERR(JB_ERR_USER, "-s and -M apply to workers, not a front end");
+
+    jb_front_t front = {.shm = NULL};
+
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = &front,
+                              .midi_batch_cb = jb_front_midi_batch,
+                              .audio_cb = jb_front_audio,
+                              .prepare_cb = jb_front_prepare,
+                              .freewheel_cb = jb_front_freewheel,
+                              .midi_ports = opts->midi_ports ? opts->midi_ports
+                                                             : ports_used(opts, NULL)};
+
+    jb_client_t cl = {.jack = NULL};
+    jb_metrics_server_t metrics = {.sock.fd = -1};
+
+    jb_res_t res = jb_client_init(&cl, cfg);
+    if (res JB_IS_ERR) goto done;
+
+    if (opts->list) {
+        res = jb_client_list(&cl);
+        goto done;
+    }
+
+    res = jb_front_create(
+        &front, opts->front_name, opts->timeout, jack_client_real_time_priority(cl.jack));
+    if (res JB_IS_ERR) goto done;
+
+    // workers can only attach once it's prepared
+    res = jb_client_prepare(&cl);
+    if (res JB_IS_ERR) goto done;
+    front.metrics = &cl.metrics;
+
+    res = connect_ports(&cl, opts);
+
+    if (res JB_IS_OK && opts->metrics_addr)
+        res = jb_metrics_serve(&metrics, &cl.metrics, cfg.name, opts->metrics_addr);
+    if (res JB_IS_OK && opts->trace_path) res = jb_prof_start(opts->trace_path);
+    if (res JB_IS_ERR) goto done;
 
-//     jb_osc_t osc1, osc2;
+    jb_info("taking workers at '%s'", opts->front_name);
 
-//     // configure oscillator
-//     osc1.fn = jb_wave_sin;
-//     osc1.bias = 0.0;
-//     osc1.amp = 0.5;
-//     osc1.detune = -JB_SEMIS(12);
+    res = jb_client_start(&cl);
 
-//     // configure oscillator
-//     osc2.fn = jb_wave_sin;
-//     osc2.bias = 0.0;
-//     osc2.amp = 0.5;
-//     osc2.detune = -JB_SEMIS(-12);
+done:
+    // the audio thread must be done with the shards before they're unmapped. anything never set up
+    // is left as it is
+    jb_client_close(&cl);
+    jb_prof_stop();
+    jb_metrics_stop(&metrics);
+    jb_front_close(&front);
 
-//     jb_osc_link_t o1, o2;
+    return res;
+}
+
+// render a single engine for a front end, until enter is pressed
+static jb_res_t run_worker(opts_t *opts, jb_engine_t *eng) {
+    if (opts->list || opts->midi_ports || jb_buf_len(opts->midi_pats) ||
+        jb_buf_len(opts->audio_pats))
+        return JB_ERR(JB_ERR_USER, "a worker has no JACK ports for -l, -P, -i or -o");
+
+    bool chans[JB_CHANS];
+    for (size_t i = 0; i < JB_CHANS; i++) chans[i] = eng->patch->chans[i].len > 0;
+
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = eng,
+                              .midi_batch_cb = jb_engine_midi_batch,
+                              .audio_cb = jb_engine_audio,
+                              .prepare_cb = jb_engine_prepare,
+                              .freewheel_cb = jb_engine_freewheel};
+
+    jb_worker_t w;
+
+    JB_TRY(jb_worker_init(&w, opts->worker_name, cfg, chans));
+    eng->metrics = &w.metrics;
+
+    jb_meter_t meter = {.shm = NULL};
+    if (opts->meter_name) {
+        JB_TRY(jb_meter_create(&meter, opts->meter_name, opts->tap));
+        eng->meter = &meter;
+    }
+
+    jb_metrics_server_t metrics = {.sock.fd = -1};
+    jb_res_t res = JB_OK_VAL;
+
+    if (opts->metrics_addr)
+        res = jb_metrics_serve(&metrics, &w.metrics, cfg.name, opts->metrics_addr);
+    if (res JB_IS_OK && opts->trace_path) res = jb_prof_start(opts->trace_path);
+    if (res JB_IS_OK) res = jb_worker_start(&w);
+    if (res JB_IS_OK) getc(stdin);
+
+    // the worker thread must be done with the engine before it's freed
+    jb_worker_stop(&w);
+    jb_prof_stop();
+    jb_metrics_stop(&metrics);
+    jb_meter_close(&meter);
+
+    return res;
+}
+
+// play loaded engines on a JACK client; a single engine is played directly, while several share a
+// rack, and with it the process thread
+static jb_res_t run_parts(opts_t *opts, part_t *parts, size_t n_parts) {
+    jb_rack_t rack;
+    jb_rack_init(&rack);
 
-//     o1.mod = JB_MOD_PM;
-//     o1.osc = &osc1;
-//     // o1.next = &o2;
-//     o1.next = &o2;
+    jb_client_config_t cfg = {.name = "midid",
+                              .state = &parts[0].eng,
+                              .midi_batch_cb = jb_engine_midi_batch,
+                              .audio_cb = jb_engine_audio,
+                              .prepare_cb = jb_engine_prepare,
+                              .freewheel_cb = jb_engine_freewheel,
+                              .midi_ports = opts->midi_ports ? opts->midi_ports
+                                                             : ports_used(opts, parts[0].patch)};
 
-//     o2.mod = JB_MOD_AM;
-//     o2.osc = &osc2;
-//     o2.next = NULL;
+    if (n_parts > 1) {
+        for (size_t i = 0; i < n_parts; i++) JB_TRY(jb_rack_add(&rack, &parts[i].eng));
+
+        cfg.state = &rack;
+        cfg.midi_batch_cb = jb_rack_midi_batch;
+        cfg.audio_cb = jb_rack_audio;
+        cfg.prepare_cb = jb_rack_prepare;
+        cfg.freewheel_cb = jb_rack_freewheel;
+        cfg.midi_ports = n_parts;
+        cfg.out_pairs = n_parts;
+
+        jb_info("hosting %zu engines", n_parts);
+    }
+
+    jb_client_t cl = {.jack = NULL};
+    jb_meter_t meter = {.shm = NULL};
+    jb_metrics_server_t metrics = {.sock.fd = -1};
+    jb_control_t ctl = {.sock.fd = -1};
+
+    jb_res_t res = jb_client_init(&cl, cfg);
+    if (res JB_IS_ERR) goto done;
+
+    if (opts->list) {
+        res = jb_client_list(&cl);
+        goto done;
+    }
+
+    // channels are metered as they're rendered, so the engine needs its meter when it's prepared
+    if (opts->meter_name) {
+        res = jb_meter_create(&meter, opts->meter_name, opts->tap);
+        if (res JB_IS_ERR) goto done;
+        parts[0].eng.meter = &meter;
+    }
+
+    res = jb_client_prepare(&cl);
+    if (res JB_IS_ERR) goto done;
+    // engines in a rack count their own drops and underruns, but the rack reports their voices
+    for (size_t i = 0; i < n_parts; i++) parts[i].eng.metrics = &cl.metrics;
+    rack.metrics = &cl.metrics;
+
+    res = connect_ports(&cl, opts);
+
+    if (res JB_IS_OK && opts->metrics_addr)
+        res = jb_metrics_serve(&metrics, &cl.metrics, cfg.name, opts->metrics_addr);
+    if (res JB_IS_OK && opts->trace_path) res = jb_prof_start(opts->trace_path);
+    if (res JB_IS_ERR) goto done;
+
+    if (opts->control_addr) {
+        // run until told to quit over the control socket, rather than by stdin
+        res = jb_client_activate(&cl);
+        if (res JB_IS_OK)
+            res = jb_control_serve(&ctl, &cl, &parts[0].eng, parts[0].patch, opts->control_addr);
+        if (res JB_IS_OK) jb_control_wait(&ctl);
+    } else {
+        res = jb_client_start(&cl);
+    }
+
+done:
+    // the audio thread must be done with whatever engine it's playing before the server frees it.
+    // anything never set up is left as it is
+    jb_client_close(&cl);
+    jb_control_stop(&ctl);
+    jb_prof_stop();
+    jb_metrics_stop(&metrics);
+    jb_meter_close(&meter);
+
+    return res;
+}
 
-//     (void)o2;
+static jb_res_t run(opts_t *opts) {
+    if (opts->front_name && opts->worker_name)
+        return JB_ERR(JB_ERR_USER, "-S and -w can't be used together");
+    if (opts->front_name) return run_front(opts);
 
-//     for (size_t i = 0; i < nframes; i++) {
-//         buf[i] = jb_chain_sample(&o1, JB_A4_MIDI, ctx.cur_sample + i, ctx.srate);
-//     }
-// }
+    size_t n_files = jb_buf_len(opts->part_paths);
+    bool inline_part = jb_buf_len(opts->defs) > 0 || n_files == 0;
+    size_t n_parts = inline_part + n_files;
 
-// jb_res_t start_client(jb_client_t *cl, jb_client_config_t cfg) {
-//     JB_TRY(jb_client_init(cl, cfg));
+    if (n_parts > 1 && opts->image_path)
+        return JB_ERR(JB_ERR_USER, "-c can only be used with a single engine");
+    if (n_parts > 1 && opts->midi_ports)
+        return JB_ERR(JB_ERR_USER, "-P can only be used with a single engine");
+    if (n_parts > 1 && opts->control_addr)
+        return JB_ERR(JB_ERR_USER, "-s can only be used with a single engine");
+    if (n_parts > 1 && opts->meter_name)
+        return JB_ERR(JB_ERR_USER, "-M can only be used with a single engine");
+    if (n_parts > 1 && opts->worker_name)
+        return JB_ERR(JB_ERR_USER, "-w can only be used with a single engine");
+    if (opts->worker_name && opts->control_addr)
+        return JB_ERR(JB_ERR_USER, "-s can't be used by a worker");
 
-//     JB_TRY(jb_client_connect_midi(cl, "Through"));
-//     JB_TRY(jb_client_connect_audio(cl, "Audio Device|oscroll"));
+    part_t *parts = calloc(n_parts, sizeof(*parts));
+    if (!parts) return JB_ERR(JB_ERR_OOM, "failed to allocate engines");
 
-//     JB_TRY(jb_client_start(cl));
+    jb_res_t res = JB_OK_VAL;
 
-//     return JB_OK_VAL;
-// }
+    if (inline_part) parts[0].defs = opts->defs;
 
-int main(void) {
+    for (size_t i = 0; i < n_files && res JB_IS_OK; i++) {
+        parts[inline_part + i].read = true;
+        res = jb_defs_read(opts->part_paths[i], &parts[inline_part + i].defs);
+    }
+
+    if (res JB_IS_OK) res = parts_load(parts, n_parts, opts);
+
+    if (res JB_IS_OK)
+        res = opts->worker_name ? run_worker(opts, &parts[0].eng) : run_parts(opts, parts, n_parts);
+
+    parts_free(parts, n_parts);
+
+    return res;
+}
+
+int main(int argc, char **argv) {
+    setlocale(LC_ALL, "C");
     jb_log_init();
-    // jb_info("Hello, World!");
 
-    // jb_client_t cl;
-    // jb_client_config_t cfg = {.name = "midid", .midi_cb = midi_cb, .audio_cb = audio_cb};
+    if (argc > 1 && strcmp(argv[1], "latency") == 0) return latency_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "meter") == 0) return meter_main(argc - 1, argv + 1);
+
+    opts_t opts = {.use_image = true, .voices = JB_ENGINE_VOICES};
+
+    int c;
+    while ((c = getopt(argc, argv, "li:o:I:E:O:C:R:c:nP:aV:m:T:s:p:M:W:S:t:w:")) != -1) {
+        switch (c) {
+            case 'l':  // list available MIDI/audio ports
+                opts.list = true;
+                break;
+
+            case 'i':  // connect MIDI input to ports matching regex
+                jb_buf_push(opts.midi_pats, optarg);
+                break;
+
+            case 'o':  // connect audio output to ports matching regex
+                jb_buf_push(opts.audio_pats, optarg);
+                break;
+
+            case 'I':  // declare an instrument
+            case 'E':  // declare an envelope
+            case 'O':  // declare an oscillator
+            case 'C':  // assign instruments to a channel
+            case 'R':  // route a controller to a parameter
+                jb_buf_push(opts.defs, ((jb_def_t){.kind = c, .src = optarg}));
+                break;
+
+            case 'c':  // use patch image at given path
+                opts.image_path = optarg;
+                break;
+
+            case 'n':  // don't read or write a patch image
+                opts.use_image = false;
+                break;
+
+            case 'P':  // number of MIDI input ports to open
+                opts.midi_ports = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'a':  // sample-accurate MIDI
+                opts.accurate = true;
+                break;
+
+            case 'V': {  // voices per engine
+                // an engine with no voices would take notes and never sound them
+                char *end;
+                unsigned long voices = strtoul(optarg, &end, 10);
+
+                if (end == optarg || *end != '\0' || voices == 0 || voices >= JB_NONE) {
+                    jb_report_result(JB_ERR(
+                        JB_ERR_USER, "-V takes a voice count from 1 to %u", JB_NONE - 1));
+                    return 1;
+                }
+
+                opts.voices = voices;
+                break;
+            }
+
+            case 'm':  // serve metrics
+                opts.metrics_addr = optarg;
+                break;
+
+            case 'T':  // write zone trace
+                opts.trace_path = optarg;
+                break;
+
+            case 's':  // serve control commands
+                opts.control_addr = optarg;
+                break;
+
+            case 'p':  // host an engine for a file of definitions
+                jb_buf_push(opts.part_paths, optarg);
+                break;
+
+            case 'M':  // publish meters
+                opts.meter_name = optarg;
+                break;
+
+            case 'W':  // waveform tap decimation
+                opts.tap = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'S':  // run as a front end for workers
+                opts.front_name = optarg;
+                break;
 
-    // jb_res_t res = start_client(&cl, cfg);
+            case 't':  // time given to workers each cycle
+                opts.timeout = strtoull(optarg, NULL, 10);
+                break;
 
-    // if (res JB_IS_ERR) {
-    //     jb_report_result(res);
-    //     return 1;
-    // }
+            case 'w':  // run as a worker for a front end
+                opts.worker_name = optarg;
+                break;
 
-    int *buf = NULL;
+            default:
+                return 1;
+        }
+    }
 
-    for (int i = 0; i < 10; i++) jb_buf_push(buf, i);
+    jb_res_t res = run(&opts);
 
-    int val;
-    while (jb_buf_pop(buf, val)) jb_info("val: %d", val);
+    jb_buf_free(opts.defs);
+    jb_buf_free(opts.midi_pats);
+    jb_buf_free(opts.audio_pats);
+    jb_buf_free(opts.part_paths);
 
-    jb_buf_free(buf);
+    if (res JB_IS_ERR) {
+        jb_report_result(res);
+        return 1;
+    }
 
     return 0;
 }
@@ -0,0 +1,173 @@
+/*
+ * midid - software MIDI synthesiser, utilising JACK
+ * Copyright (C) 2024  Jacob Sinclair <jcbsnclr@outlook.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//
+// meter.c: level display
+//
+// reads the meters another instance publishes with `-M`, and prints the level of its outputs and
+// of each channel sounding, and a scope of its waveform tap if it has one. reading is an atomic
+// exchange on the shared triple buffer, so watching never holds up the audio thread
+//
+
+#include <math.h>
+#include <midid.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define METER_NAME "/midid"  // default shared memory object
+#define METER_INTERVAL 100   // default ms between updates
+#define METER_BAR 40         // width of level bars
+#define METER_FLOOR -60.0    // level at the left end of bars (dBFS)
+#define SCOPE_WIDTH 64       // columns of scope
+
+typedef struct {
+    const char *name;  // shared memory object to read
+    size_t interval;   // ms between updates
+    size_t count;      // updates to print before exiting (0 to run until killed)
+} meter_opts_t;
+
+static double to_db(float x) {
+    return x > 0 ? 20.0 * log10(x) : -INFINITY;
+}
+
+// how far along a bar a level goes
+static size_t bar_len(float x) {
+    double pos = (to_db(x) - METER_FLOOR) / -METER_FLOOR;
+    return pos <= 0 ? 0 : (size_t)fmin(pos * METER_BAR, METER_BAR);
+}
+
+// a bar filled with '=' to the RMS level and '-' to the peak
+static void print_bar(const char *label, char side, float peak, float rms) {
+    char bar[METER_BAR + 1];
+    size_t p = bar_len(peak), r = bar_len(rms);
+
+    for (size_t i = 0; i < METER_BAR; i++) bar[i] = i < r ? '=' : i < p ? '-' : ' ';
+    bar[METER_BAR] = '\0';
+
+    printf("%-10s %c [%s] peak %6.1f  rms %6.1f dBFS\n", label, side, bar, to_db(peak), to_db(rms));
+}
+
+static void print_level(const char *label, const jb_level_t *lvl) {
+    for (size_t o = 0; o < JB_OUTS; o++)
+        print_bar(o == 0 ? label : "", "LR"[o], lvl->peak[o], lvl->rms[o]);
+}
+
+// a row of the tap's peaks, a column for each stretch of samples
+static void print_scope(const jb_meter_frame_t *frame) {
+    static const char *blocks[] = {" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+    size_t per = JB_TAP_LEN / SCOPE_WIDTH;
+
+    for (size_t o = 0; o < JB_OUTS; o++) {
+        printf("%-10s %c [", o == 0 ? "scope" : "", "LR"[o]);
+
+        for (size_t i = 0; i < SCOPE_WIDTH; i++) {
+            float peak = 0.0;
+            for (size_t j = 0; j < per; j++) peak = fmaxf(peak, fabsf(frame->tap[o][i * per + j]));
+
+            fputs(blocks[(size_t)(fminf(peak, 1.0) * 8 + 0.5)], stdout);
+        }
+
+        printf("]\n");
+    }
+
+    printf("%-10s   %.1fms across\n", "", 1e3 * JB_TAP_LEN * frame->decimate / frame->srate);
+}
+
+static void print_frame(const jb_meter_frame_t *frame, bool tty) {
+    // redraw in place on a terminal
+    if (tty) printf("\x1b[H\x1b[J");
+
+    printf("cycle %llu (%u frames at %u Hz)\n",
+           (unsigned long long)frame->cycle,
+           frame->nframes,
+           frame->srate);
+
+    print_level("out", &frame->out);
+
+    for (size_t c = 0; c < JB_CHANS; c++) {
+        const jb_level_t *lvl = &frame->chans[c];
+        if (lvl->peak[0] == 0 && lvl->peak[1] == 0) continue;
+
+        char label[16];
+        snprintf(label, sizeof(label), "chan %zu.%zu", c / JB_PORT_CHANS, c % JB_PORT_CHANS);
+        print_level(label, lvl);
+    }
+
+    if (frame->decimate) print_scope(frame);
+
+    fflush(stdout);
+}
+
+static jb_res_t meter_run(const meter_opts_t *opts) {
+    jb_meter_reader_t r;
+    JB_TRY(jb_meter_open(&r, opts->name));
+
+    bool tty = isatty(STDOUT_FILENO);
+    uint64_t last = UINT64_MAX;
+    size_t shown = 0;
+
+    while (opts->count == 0 || shown < opts->count) {
+        const jb_meter_frame_t *frame = jb_meter_read(&r);
+
+        // nothing new means the instance isn't running cycles
+        if (frame && frame->cycle != last) {
+            print_frame(frame, tty);
+            last = frame->cycle;
+            shown++;
+        }
+
+        usleep(opts->interval * 1000);
+    }
+
+    jb_meter_reader_close(&r);
+
+    return JB_OK_VAL;
+}
+
+int meter_main(int argc, char **argv) {
+    meter_opts_t opts = {.name = METER_NAME, .interval = METER_INTERVAL};
+
+    int c;
+    while ((c = getopt(argc, argv, "i:n:")) != -1) {
+        switch (c) {
+            case 'i':  // ms between updates
+                opts.interval = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'n':  // updates to print
+                opts.count = strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                return 1;
+        }
+    }
+
+    if (optind < argc) opts.name = argv[optind];
+
+    jb_res_t res = meter_run(&opts);
+
+    if (res JB_IS_ERR) {
+        jb_report_result(res);
+        return 1;
+    }
+
+    return 0;
+}